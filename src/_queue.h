@@ -31,6 +31,5 @@ void password_list_free(password_list * K);
 directory_list * add_directory(directory_list * A, struct fileinfo * K);
 
 struct fileinfo * find_directory(_fsession * F);
-struct fileinfo * fileinfo_find_file(struct fileinfo * F, char * name);
 void fileinfo_free(void);
 #endif
@@ -0,0 +1,171 @@
+/* checksums of the uploaded data
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* The checksums are updated with each buffer do_send() reads, so the file
+ * does not have to be read a second time. CRC32 comes from zlib, the others
+ * from gnutls, which uses the sha/aes-instructions of the cpu if there are. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "checksum.h"
+
+#if defined(HAVE_SSL) && !defined(WIN32)
+#  include <gnutls/gnutls.h>
+#  include <gnutls/crypto.h>
+#  define CHECKSUM_GNUTLS
+#endif
+#ifdef HAVE_ZLIB
+#  include <zlib.h>
+#endif
+
+#define CHECKSUM_ALGOS 4
+#define CHECKSUM_BUF   (256 * 1024)
+
+static struct {
+	unsigned int algo;
+	char       * name;
+#ifdef CHECKSUM_GNUTLS
+	gnutls_digest_algorithm_t dig;
+#endif
+} algos[CHECKSUM_ALGOS] = {
+#ifdef CHECKSUM_GNUTLS
+	{HASH_CRC32,  "CRC32",   GNUTLS_DIG_UNKNOWN},
+	{HASH_MD5,    "MD5",     GNUTLS_DIG_MD5},
+	{HASH_SHA1,   "SHA-1",   GNUTLS_DIG_SHA1},
+	{HASH_SHA256, "SHA-256", GNUTLS_DIG_SHA256}
+#else
+	{HASH_CRC32,  "CRC32"},
+	{HASH_MD5,    "MD5"},
+	{HASH_SHA1,   "SHA-1"},
+	{HASH_SHA256, "SHA-256"}
+#endif
+};
+
+struct _checksum {
+	unsigned int  algos;
+	unsigned long crc;
+#ifdef CHECKSUM_GNUTLS
+	gnutls_hash_hd_t hd[CHECKSUM_ALGOS];
+#endif
+	char        * hex[CHECKSUM_ALGOS];
+};
+
+unsigned int checksum_supported(void) {
+	unsigned int res = 0;
+#ifdef HAVE_ZLIB
+	res |= HASH_CRC32;
+#endif
+#ifdef CHECKSUM_GNUTLS
+	res |= HASH_MD5 | HASH_SHA1 | HASH_SHA256;
+#endif
+	return res;
+}
+
+char * checksum_name(unsigned int algo) {
+	int i;
+	for(i = 0; i < CHECKSUM_ALGOS; i++)
+		if(algos[i].algo == algo)
+			return algos[i].name;
+	return NULL;
+}
+
+checksum * checksum_new(unsigned int want) {
+	checksum * C = calloc(1, sizeof(checksum));
+#ifdef CHECKSUM_GNUTLS
+	int i;
+#endif
+
+	C->algos = want & checksum_supported();
+#ifdef HAVE_ZLIB
+	C->crc   = crc32(0, NULL, 0);
+#endif
+#ifdef CHECKSUM_GNUTLS
+	for(i = 1; i < CHECKSUM_ALGOS; i++)
+		if((C->algos & algos[i].algo) && gnutls_hash_init(&C->hd[i], algos[i].dig) < 0)
+			C->algos &= ~algos[i].algo;
+#endif
+	return C;
+}
+
+void checksum_update(checksum * C, const char * buf, size_t len) {
+#ifdef CHECKSUM_GNUTLS
+	int i;
+	for(i = 1; i < CHECKSUM_ALGOS; i++)
+		if((C->algos & algos[i].algo) && !C->hex[i])
+			gnutls_hash(C->hd[i], buf, len);
+#endif
+#ifdef HAVE_ZLIB
+	if(C->algos & HASH_CRC32)
+		C->crc = crc32(C->crc, (const Bytef *) buf, len);
+#endif
+}
+
+int checksum_file(checksum * C, int fd, off_t from, off_t to) {
+	char  * buf = malloc(CHECKSUM_BUF);
+	ssize_t res = 0;
+
+	while(from < to) {
+		res = pread(fd, buf, to - from < CHECKSUM_BUF ? to - from : CHECKSUM_BUF, from);
+		if(res <= 0) break;
+		checksum_update(C, buf, res);
+		from += res;
+	}
+	free(buf);
+	return from < to ? -1 : 0;
+}
+
+char * checksum_hex(checksum * C, unsigned int algo) {
+	int i;
+
+	if(!(C->algos & algo)) return NULL;
+	for(i = 0; algos[i].algo != algo; i++) ;
+	if(C->hex[i]) return C->hex[i];
+
+	if(algo == HASH_CRC32) {
+		C->hex[i] = malloc(9);
+		sprintf(C->hex[i], "%08lx", C->crc);
+	}
+#ifdef CHECKSUM_GNUTLS
+	else {
+		unsigned char digest[64];
+		unsigned int  len = gnutls_hash_get_len(algos[i].dig);
+		unsigned int  j;
+
+		gnutls_hash_deinit(C->hd[i], digest);
+		C->hex[i] = malloc(2 * len + 1);
+		for(j = 0; j < len; j++)
+			sprintf(C->hex[i] + 2 * j, "%02x", digest[j]);
+	}
+#endif
+	return C->hex[i];
+}
+
+void checksum_free(checksum * C) {
+	int i;
+
+	if(!C) return;
+	for(i = 0; i < CHECKSUM_ALGOS; i++) {
+#ifdef CHECKSUM_GNUTLS
+		if(i && (C->algos & algos[i].algo) && !C->hex[i])
+			gnutls_hash_deinit(C->hd[i], NULL);
+#endif
+		free(C->hex[i]);
+	}
+	free(C);
+}
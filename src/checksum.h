@@ -0,0 +1,30 @@
+#ifndef __CHECKSUM_H
+#define __CHECKSUM_H
+
+#include "config.h"
+#include <sys/types.h>
+
+#define HASH_CRC32  0x01
+#define HASH_MD5    0x02
+#define HASH_SHA1   0x04
+#define HASH_SHA256 0x08
+
+typedef struct _checksum checksum;
+
+/* the algorithms this build is able to compute */
+unsigned int checksum_supported(void);
+/* the name as used by the HASH command (e.g. SHA-256) */
+char *       checksum_name(unsigned int algo);
+
+/* compute the given algorithms (or'ed HASH_*) at once */
+checksum *   checksum_new(unsigned int algos);
+void         checksum_update(checksum * C, const char * buf, size_t len);
+/* the digest as lowercase hex-string, or NULL if algo is not computed.
+ * no more updates are possible afterwards */
+char *       checksum_hex(checksum * C, unsigned int algo);
+/* feed the bytes [from, to) of a file into the checksum, without moving the
+ * file-pointer. returns -1 if they cannot be read (e.g. from a pipe) */
+int          checksum_file(checksum * C, int fd, off_t from, off_t to);
+void         checksum_free(checksum * C);
+
+#endif
@@ -6,6 +6,24 @@
 
 #define HAVE_IOCTL 1
 
+/* Define if you have the linux-style sendfile() in <sys/sendfile.h> */
+#define HAVE_SENDFILE 1
+
+/* Define if you have splice() */
+#define HAVE_SPLICE 1
+
+/* Define if you have posix threads */
+#define HAVE_PTHREAD 1
+
+/* Define if you have <linux/io_uring.h> */
+#define HAVE_IO_URING 1
+
+/* Define if you have epoll */
+#define HAVE_EPOLL 1
+
+/* Define if you have zlib */
+#define HAVE_ZLIB 1
+
 /* Define if you have the <libintl.h> header file.  */
 #define HAVE_LIBINTL_H 1
 
@@ -66,6 +84,9 @@
 /* Define if all libs needed for ssl support are existing */
 #define HAVE_SSL 1
 
+/* Define if the kernel can encrypt tls-connections (<linux/tls.h>) */
+#define HAVE_KTLS 1
+
 /* Define to 1 if you have the long long type */
 #define HAVE_LONG_LONG 1
 
@@ -31,6 +31,7 @@
 #define ERR_POSITIVE_PRELIMARY -2
 #define ERR_RETRY -3
 #define ERR_PERMANENT -4
+#define ERR_CHECKSUM -5 /* the server has got something else than we sent */
 #define ERR_RECONNECT -8
 #define ERR_TIMEOUT -9
 
@@ -0,0 +1,137 @@
+/* LF -> CRLF conversion for ascii-mode uploads
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* Text files have long runs without any newline, so the input is scanned
+ * in blocks of 16 (SSE2) or 32 (AVX2) bytes. A block without a newline is
+ * stored as a whole, only blocks that contain one are copied piece by piece.
+ * AVX2 is chosen at runtime, so the binary still runs on older cpus. */
+
+#include <string.h>
+#include "crlf.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+#  define CRLF_AVX2
+#endif
+
+/* copy s up to each newline, adding the missing \r */
+static char * crlf_scalar(char * d, const char * s, size_t n, char prev) {
+	const char * end = s + n;
+	const char * nl;
+
+	while(s < end) {
+		nl = memchr(s, '\n', end - s);
+		if(!nl) {
+			memcpy(d, s, end - s);
+			return d + (end - s);
+		}
+		memcpy(d, s, nl - s);
+		d += nl - s;
+		if((nl > s ? nl[-1] : prev) != '\r')
+			*d++ = '\r';
+		*d++ = '\n';
+		prev = '\n';
+		s    = nl + 1;
+	}
+	return d;
+}
+
+#if defined(__SSE2__) || defined(CRLF_AVX2)
+/* copy a block of n bytes, mask has a bit set for each newline in it */
+static inline char * crlf_block(char * d, const char * s, unsigned int mask, int n, char prev) {
+	int from = 0;
+	int i;
+
+	while(mask) {
+		i     = __builtin_ctz(mask);
+		mask &= mask - 1;
+		memcpy(d, s + from, i - from);
+		d += i - from;
+		if((i ? s[i - 1] : prev) != '\r')
+			*d++ = '\r';
+		*d++ = '\n';
+		from = i + 1;
+	}
+	memcpy(d, s + from, n - from);
+	return d + (n - from);
+}
+#endif
+
+#ifdef __SSE2__
+static char * crlf_sse2(char * d, const char * s, size_t n, char prev) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	__m128i v;
+	unsigned int mask;
+	size_t i;
+
+	for(i = 0; i + 16 <= n; i += 16) {
+		v    = _mm_loadu_si128((const __m128i *) (s + i));
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		if(!mask) {
+			_mm_storeu_si128((__m128i *) d, v);
+			d += 16;
+		} else
+			d = crlf_block(d, s + i, mask, 16, i ? s[i - 1] : prev);
+	}
+	return crlf_scalar(d, s + i, n - i, i ? s[i - 1] : prev);
+}
+#endif
+
+#ifdef CRLF_AVX2
+__attribute__((target("avx2")))
+static char * crlf_avx2(char * d, const char * s, size_t n, char prev) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	__m256i v;
+	unsigned int mask;
+	size_t i;
+
+	for(i = 0; i + 32 <= n; i += 32) {
+		v    = _mm256_loadu_si256((const __m256i *) (s + i));
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		if(!mask) {
+			_mm256_storeu_si256((__m256i *) d, v);
+			d += 32;
+		} else
+			d = crlf_block(d, s + i, mask, 32, i ? s[i - 1] : prev);
+	}
+	return crlf_scalar(d, s + i, n - i, i ? s[i - 1] : prev);
+}
+#endif
+
+size_t crlf_convert(const char * src, size_t len, char * dst, char * last) {
+#ifdef CRLF_AVX2
+	static int avx2 = -1;
+#endif
+	char * end;
+
+	if(!len) return 0;
+#ifdef CRLF_AVX2
+	if(avx2 == -1)
+		avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	if(avx2)
+		end = crlf_avx2(dst, src, len, *last);
+	else
+#endif
+#ifdef __SSE2__
+		end = crlf_sse2(dst, src, len, *last);
+#else
+		end = crlf_scalar(dst, src, len, *last);
+#endif
+	*last = src[len - 1];
+	return end - dst;
+}
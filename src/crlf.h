@@ -0,0 +1,14 @@
+#ifndef __CRLF_H
+#define __CRLF_H
+
+#include "config.h"
+#include <sys/types.h>
+
+/* convert len bytes of src into dst, replacing each \n by \r\n unless it
+ * is already preceded by \r. dst must hold 2 * len bytes.
+ * last holds the final byte of the previous call (0 at the start of a file)
+ * and is updated, so that \r\n split across two reads is recognized.
+ * returns the number of bytes written to dst */
+size_t crlf_convert(const char * src, size_t len, char * dst, char * last);
+
+#endif
@@ -0,0 +1,258 @@
+/* the cache of remote directory-listings
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* Directories are found by their path and entries by their name through
+ * hash-tables, so looking up each file of a directory with 200k entries
+ * does not walk the listing each time. The entries and their names live
+ * in an arena that is only freed with the whole cache. Removed entries
+ * are just unlinked, which keeps loops over a listing (the recursive
+ * delete of wdel) safe while entries disappear. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "dircache.h"
+#include "utils.h"
+
+#define ARENA_BLOCK (64 * 1024)
+
+typedef struct _arena_block {
+	struct _arena_block * next;
+	size_t used;
+	size_t size;
+	char   data[1];
+} arena_block;
+
+struct _dircache {
+	directory_list ** dirs;
+	unsigned int      buckets;
+	unsigned int      count;
+	arena_block     * arena;
+};
+
+/* FNV-1a */
+static unsigned int dircache_hash(const char * s) {
+	unsigned int h = 2166136261u;
+	while(*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void * arena_alloc(dircache * C, size_t len) {
+	arena_block * B = C->arena;
+	len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if(!B || B->used + len > B->size) {
+		size_t size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+		B = malloc(sizeof(arena_block) + size);
+		B->next  = C->arena;
+		B->used  = 0;
+		B->size  = size;
+		C->arena = B;
+	}
+	B->used += len;
+	return B->data + B->used - len;
+}
+
+static char * arena_strdup(dircache * C, const char * s) {
+	char * p;
+	if(!s) return NULL;
+	p = arena_alloc(C, strlen(s) + 1);
+	strcpy(p, s);
+	return p;
+}
+
+dircache * dircache_new(void) {
+	dircache * C = malloc(sizeof(dircache));
+	memset(C, 0, sizeof(dircache));
+	return C;
+}
+
+static void dircache_free_dir(directory_list * D) {
+	free(D->name);
+	free(D->index);
+	free(D);
+}
+
+void dircache_free(dircache * C) {
+	directory_list * D;
+	arena_block    * B;
+	unsigned int     i;
+
+	if(!C) return;
+	for(i = 0; i < C->buckets; i++)
+		while((D = C->dirs[i])) {
+			C->dirs[i] = D->next;
+			dircache_free_dir(D);
+		}
+	while((B = C->arena)) {
+		C->arena = B->next;
+		free(B);
+	}
+	free(C->dirs);
+	free(C);
+}
+
+directory_list * dircache_find(dircache * C, const char * path) {
+	directory_list * D;
+	unsigned int     h;
+
+	if(!C || !C->buckets) return NULL;
+	h = dircache_hash(path);
+	for(D = C->dirs[h & (C->buckets - 1)]; D; D = D->next)
+		if(D->hash == h && !strcmp(D->name, path))
+			return D;
+	return NULL;
+}
+
+/* put the entry into the index, doubling it once it is full */
+static void dircache_index(directory_list * D, struct fileinfo * F) {
+	struct fileinfo ** old = D->index;
+	struct fileinfo  * E;
+	unsigned int       n   = D->buckets;
+	unsigned int       i;
+	unsigned int       h;
+
+	if(D->count >= D->buckets) {
+		D->buckets = D->buckets ? D->buckets * 2 : 64;
+		D->index   = calloc(D->buckets, sizeof(struct fileinfo *));
+		for(i = 0; i < n; i++)
+			while((E = old[i])) {
+				old[i]   = E->hnext;
+				h        = dircache_hash(E->name) & (D->buckets - 1);
+				E->hnext = D->index[h];
+				D->index[h] = E;
+			}
+		free(old);
+	}
+	h        = dircache_hash(F->name) & (D->buckets - 1);
+	F->hnext = D->index[h];
+	D->index[h] = F;
+	D->count++;
+}
+
+directory_list * dircache_begin(dircache * C, const char * path) {
+	directory_list * D;
+	unsigned int     i;
+
+	dircache_drop(C, path);
+	if(C->count >= C->buckets) {
+		directory_list ** old = C->dirs;
+		unsigned int      n   = C->buckets;
+		C->buckets = C->buckets ? C->buckets * 2 : 16;
+		C->dirs    = calloc(C->buckets, sizeof(directory_list *));
+		for(i = 0; i < n; i++)
+			while((D = old[i])) {
+				old[i]  = D->next;
+				D->next = C->dirs[D->hash & (C->buckets - 1)];
+				C->dirs[D->hash & (C->buckets - 1)] = D;
+			}
+		free(old);
+	}
+	D = malloc(sizeof(directory_list));
+	memset(D, 0, sizeof(directory_list));
+	D->name = cpy((char *) path);
+	D->hash = dircache_hash(path);
+	D->next = C->dirs[D->hash & (C->buckets - 1)];
+	C->dirs[D->hash & (C->buckets - 1)] = D;
+	C->count++;
+	return D;
+}
+
+void dircache_drop(dircache * C, const char * path) {
+	directory_list ** P;
+	directory_list  * D;
+	unsigned int      h;
+
+	if(!C || !C->buckets) return;
+	h = dircache_hash(path);
+	for(P = &C->dirs[h & (C->buckets - 1)]; (D = *P); P = &D->next)
+		if(D->hash == h && !strcmp(D->name, path)) {
+			*P = D->next;
+			C->count--;
+			dircache_free_dir(D);
+			return;
+		}
+}
+
+struct fileinfo * dircache_lookup(directory_list * D, const char * name) {
+	struct fileinfo * F;
+	if(!D->buckets) return NULL;
+	for(F = D->index[dircache_hash(name) & (D->buckets - 1)]; F; F = F->hnext)
+		if(!strcmp(F->name, name))
+			return F;
+	return NULL;
+}
+
+void dircache_append(dircache * C, directory_list * D, struct fileinfo * F) {
+	struct fileinfo * E;
+
+	if(F->name && !dircache_lookup(D, F->name)) {
+		E = arena_alloc(C, sizeof(struct fileinfo));
+		memcpy(E, F, sizeof(struct fileinfo));
+		E->name   = arena_strdup(C, F->name);
+		E->linkto = arena_strdup(C, F->linkto);
+		E->prev   = D->last;
+		E->next   = NULL;
+		if(D->last) D->last->next = E;
+		else        D->list       = E;
+		D->last = E;
+		dircache_index(D, E);
+	}
+	if(F->name)   free(F->name);
+	if(F->linkto) free(F->linkto);
+	F->name = F->linkto = NULL;
+}
+
+struct fileinfo * dircache_set(dircache * C, directory_list * D, const char * name,
+                               enum ftype type, off_t size, time_t tstamp) {
+	struct fileinfo * F = dircache_lookup(D, name);
+
+	if(!F) {
+		F = arena_alloc(C, sizeof(struct fileinfo));
+		memset(F, 0, sizeof(struct fileinfo));
+		F->name  = arena_strdup(C, name);
+		F->perms = type == FT_DIRECTORY ? 0755 : 0644;
+		F->next  = D->list;
+		if(D->list) D->list->prev = F;
+		else        D->last       = F;
+		D->list  = F;
+		dircache_index(D, F);
+	}
+	F->type   = type;
+	F->size   = size;
+	F->tstamp = tstamp;
+	return F;
+}
+
+void dircache_remove(directory_list * D, const char * name) {
+	struct fileinfo ** P;
+	struct fileinfo  * F;
+
+	if(!D->buckets) return;
+	for(P = &D->index[dircache_hash(name) & (D->buckets - 1)]; (F = *P); P = &F->hnext)
+		if(!strcmp(F->name, name)) {
+			*P = F->hnext;
+			if(F->prev) F->prev->next = F->next;
+			else        D->list       = F->next;
+			if(F->next) F->next->prev = F->prev;
+			else        D->last       = F->prev;
+			D->count--;
+			return;
+		}
+}
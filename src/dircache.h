@@ -0,0 +1,40 @@
+#ifndef __DIRCACHE_H
+#define __DIRCACHE_H
+
+#include "config.h"
+#include "ftplib.h"
+
+typedef struct _dircache dircache;
+
+/* the listing of a remote directory. list has the entries in the order
+ * of the listing, index finds them by name */
+struct _directory_list {
+	char             * name;
+	unsigned int       hash;
+	struct fileinfo  * list;
+	struct fileinfo  * last;
+	struct fileinfo ** index;
+	unsigned int       buckets;
+	unsigned int       count;
+	struct _directory_list * next; /* in the same bucket of the cache */
+};
+
+dircache        * dircache_new(void);
+void              dircache_free(dircache * C);
+
+directory_list  * dircache_find(dircache * C, const char * path);
+/* start an empty listing of path, replacing the one known before */
+directory_list  * dircache_begin(dircache * C, const char * path);
+void              dircache_drop(dircache * C, const char * path);
+
+struct fileinfo * dircache_lookup(directory_list * D, const char * name);
+/* append an entry as it comes from a parser. it is copied into the cache,
+ * its name and linkto are freed */
+void              dircache_append(dircache * C, directory_list * D, struct fileinfo * F);
+/* add an entry or update the one of this name */
+struct fileinfo * dircache_set(dircache * C, directory_list * D, const char * name,
+                               enum ftype type, off_t size, time_t tstamp);
+/* entries are only unlinked, so a loop walking the list may go on */
+void              dircache_remove(directory_list * D, const char * name);
+
+#endif
@@ -0,0 +1,243 @@
+/* event loop for non-blocking sockets
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* Descriptors are registered once together with a handler, which is called
+ * whenever they are ready. With epoll the kernel keeps the interest list,
+ * so waiting costs the same for one or for hundreds of connections, and
+ * there is no FD_SETSIZE limit. Without epoll, poll() is used.
+ *
+ * ev_wait() is the one-shot variant for a single descriptor. It replaces
+ * the select() calls of the blocking socket-functions. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "eventloop.h"
+#include "constants.h"
+#include "utils.h"
+
+#ifndef WIN32
+#  include <poll.h>
+#  ifdef HAVE_EPOLL
+#    include <sys/epoll.h>
+#    include <unistd.h>
+#  endif
+#else
+#  include "windows.h"
+#endif
+
+/* how many events are taken from the kernel at once */
+#define EV_BATCH 64
+
+typedef struct _ev_watch {
+	int        events;
+	ev_handler handler;
+	void     * data;
+} ev_watch;
+
+struct _ev_loop {
+	ev_watch * watch;   /* indexed by the descriptor */
+	int        size;
+	int        count;
+#ifdef HAVE_EPOLL
+	int        epfd;
+#endif
+};
+
+ev_loop * ev_new(void) {
+	ev_loop * L = malloc(sizeof(ev_loop));
+	memset(L, 0, sizeof(ev_loop));
+#ifdef HAVE_EPOLL
+	L->epfd = epoll_create(EV_BATCH);
+	if(L->epfd == -1) {
+		free(L);
+		return NULL;
+	}
+#endif
+	return L;
+}
+
+void ev_free(ev_loop * L) {
+	if(!L) return;
+#ifdef HAVE_EPOLL
+	close(L->epfd);
+#endif
+	free(L->watch);
+	free(L);
+}
+
+#ifdef HAVE_EPOLL
+static int ev_ctl(ev_loop * L, int op, int fd, int events) {
+	struct epoll_event e;
+	memset(&e, 0, sizeof(e));
+	e.events  = (events & EV_READ  ? EPOLLIN  : 0)
+	          | (events & EV_WRITE ? EPOLLOUT : 0);
+	e.data.fd = fd;
+	return epoll_ctl(L->epfd, op, fd, &e) == -1 ? ERR_FAILED : 0;
+}
+#endif
+
+int ev_add(ev_loop * L, int fd, int events, ev_handler handler, void * data) {
+	if(fd < 0) return ERR_FAILED;
+	if(fd >= L->size) {
+		int size = L->size ? L->size : 64;
+		while(size <= fd) size *= 2;
+		L->watch = realloc(L->watch, size * sizeof(ev_watch));
+		memset(L->watch + L->size, 0, (size - L->size) * sizeof(ev_watch));
+		L->size  = size;
+	}
+	if(L->watch[fd].handler) return ev_modify(L, fd, events);
+#ifdef HAVE_EPOLL
+	if(ev_ctl(L, EPOLL_CTL_ADD, fd, events) < 0) return ERR_FAILED;
+#endif
+	L->watch[fd].events  = events;
+	L->watch[fd].handler = handler;
+	L->watch[fd].data    = data;
+	L->count++;
+	return 0;
+}
+
+int ev_modify(ev_loop * L, int fd, int events) {
+	if(fd < 0 || fd >= L->size || !L->watch[fd].handler) return ERR_FAILED;
+	if(L->watch[fd].events == events) return 0;
+#ifdef HAVE_EPOLL
+	if(ev_ctl(L, EPOLL_CTL_MOD, fd, events) < 0) return ERR_FAILED;
+#endif
+	L->watch[fd].events = events;
+	return 0;
+}
+
+void ev_remove(ev_loop * L, int fd) {
+	if(fd < 0 || fd >= L->size || !L->watch[fd].handler) return;
+#ifdef HAVE_EPOLL
+	ev_ctl(L, EPOLL_CTL_DEL, fd, 0);
+#endif
+	memset(&L->watch[fd], 0, sizeof(ev_watch));
+	L->count--;
+}
+
+int ev_count(ev_loop * L) {
+	return L->count;
+}
+
+/* a descriptor might have been removed by an earlier handler of the batch */
+static void ev_dispatch(ev_loop * L, int fd, int events) {
+	if(fd >= L->size || !L->watch[fd].handler) return;
+	events &= L->watch[fd].events | EV_ERROR;
+	if(events)
+		L->watch[fd].handler(L, fd, events, L->watch[fd].data);
+}
+
+#ifdef HAVE_EPOLL
+int ev_run(ev_loop * L, int timeout) {
+	struct epoll_event e[EV_BATCH];
+	int n, i;
+
+	n = epoll_wait(L->epfd, e, EV_BATCH, timeout < 0 ? -1 : timeout * 100);
+	if(n == -1) return errno == EINTR ? 0 : ERR_FAILED;
+	for(i = 0; i < n; i++)
+		ev_dispatch(L, e[i].data.fd,
+			(e[i].events & EPOLLIN                ? EV_READ  : 0) |
+			(e[i].events & EPOLLOUT               ? EV_WRITE : 0) |
+			(e[i].events & (EPOLLERR | EPOLLHUP)  ? EV_ERROR : 0));
+	return n;
+}
+#elif !defined(WIN32)
+int ev_run(ev_loop * L, int timeout) {
+	struct pollfd * p = malloc(L->count * sizeof(struct pollfd));
+	int n = 0, i, res;
+
+	for(i = 0; i < L->size && n < L->count; i++)
+		if(L->watch[i].handler) {
+			p[n].fd      = i;
+			p[n].events  = (L->watch[i].events & EV_READ  ? POLLIN  : 0)
+			             | (L->watch[i].events & EV_WRITE ? POLLOUT : 0);
+			p[n].revents = 0;
+			n++;
+		}
+	res = poll(p, n, timeout < 0 ? -1 : timeout * 100);
+	if(res == -1) {
+		free(p);
+		return errno == EINTR ? 0 : ERR_FAILED;
+	}
+	for(i = 0; i < n; i++)
+		if(p[i].revents)
+			ev_dispatch(L, p[i].fd,
+				(p[i].revents & POLLIN                          ? EV_READ  : 0) |
+				(p[i].revents & POLLOUT                         ? EV_WRITE : 0) |
+				(p[i].revents & (POLLERR | POLLHUP | POLLNVAL)  ? EV_ERROR : 0));
+	free(p);
+	return res;
+}
+#endif
+
+#ifndef WIN32
+int ev_wait(int fd, int events, int timeout) {
+	struct pollfd p;
+	int res;
+
+	p.fd      = fd;
+	p.events  = (events & EV_READ  ? POLLIN  : 0)
+	          | (events & EV_WRITE ? POLLOUT : 0);
+	p.revents = 0;
+	do
+		res = poll(&p, 1, timeout < 0 ? -1 : timeout * 100);
+	while(res == -1 && errno == EINTR);
+	if(res <= 0) return 0;
+	/* errors are reported as readiness, so that the following call fails */
+	return (p.revents & POLLIN  ? EV_READ  : 0)
+	     | (p.revents & POLLOUT ? EV_WRITE : 0)
+	     | (p.revents & (POLLERR | POLLHUP | POLLNVAL) ? EV_ERROR | events : 0);
+}
+#else
+/* winsock has select() only (and no limit on the descriptor value) */
+int ev_run(ev_loop * L, int timeout) {
+	struct timeval t;
+	fd_set rset, wset;
+	int i, res;
+
+	FD_ZERO(&rset);
+	FD_ZERO(&wset);
+	for(i = 0; i < L->size; i++) {
+		if(L->watch[i].events & EV_READ)  FD_SET(i, &rset);
+		if(L->watch[i].events & EV_WRITE) FD_SET(i, &wset);
+	}
+	t.tv_sec  = timeout / 10;
+	t.tv_usec = (timeout % 10) * 100000;
+	res = select(L->size, &rset, &wset, NULL, timeout < 0 ? NULL : &t);
+	if(res <= 0) return res == 0 ? 0 : ERR_FAILED;
+	for(i = 0; i < L->size; i++)
+		if(FD_ISSET(i, &rset) || FD_ISSET(i, &wset))
+			ev_dispatch(L, i, (FD_ISSET(i, &rset) ? EV_READ : 0) | (FD_ISSET(i, &wset) ? EV_WRITE : 0));
+	return res;
+}
+
+int ev_wait(int fd, int events, int timeout) {
+	struct timeval t;
+	fd_set rset, wset;
+
+	FD_ZERO(&rset);
+	FD_ZERO(&wset);
+	if(events & EV_READ)  FD_SET(fd, &rset);
+	if(events & EV_WRITE) FD_SET(fd, &wset);
+	t.tv_sec  = timeout / 10;
+	t.tv_usec = (timeout % 10) * 100000;
+	if(select(fd + 1, &rset, &wset, NULL, timeout < 0 ? NULL : &t) <= 0) return 0;
+	return (FD_ISSET(fd, &rset) ? EV_READ : 0) | (FD_ISSET(fd, &wset) ? EV_WRITE : 0);
+}
+#endif
@@ -0,0 +1,35 @@
+#ifndef __EVENTLOOP_H
+#define __EVENTLOOP_H
+
+#include "config.h"
+
+#define EV_READ  1
+#define EV_WRITE 2
+#define EV_ERROR 4 /* hang-up or error, always reported */
+
+typedef struct _ev_loop ev_loop;
+
+/* called with the events that are ready on fd. a handler may add and
+ * remove descriptors, including its own */
+typedef void (*ev_handler)(ev_loop * L, int fd, int events, void * data);
+
+ev_loop * ev_new(void);
+void      ev_free(ev_loop * L);
+
+/* watch fd for events. returns ERR_FAILED if it cannot be watched */
+int       ev_add(ev_loop * L, int fd, int events, ev_handler handler, void * data);
+int       ev_modify(ev_loop * L, int fd, int events);
+void      ev_remove(ev_loop * L, int fd);
+/* the number of descriptors being watched */
+int       ev_count(ev_loop * L);
+
+/* wait up to timeout 10th-seconds (-1 for ever) and call the handlers of
+ * the descriptors that are ready. returns how many were, 0 on timeout or
+ * ERR_FAILED */
+int       ev_run(ev_loop * L, int timeout);
+
+/* wait for events on a single descriptor, which is what the blocking
+ * socket-functions need. returns the events that are ready or 0 on timeout */
+int       ev_wait(int fd, int events, int timeout);
+
+#endif
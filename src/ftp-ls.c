@@ -384,20 +384,6 @@ ftp_parse_unix_ls (const char *file, int ignore_perms)
 	  continue;
 	}
 
-      if (!dir)
-	{
-	  l = dir = (struct fileinfo *)xmalloc (sizeof (struct fileinfo));
-	  memcpy (l, &cur, sizeof (cur));
-	  l->prev = l->next = NULL;
-	}
-      else
-	{
-	  cur.prev = l;
-	  l->next = (struct fileinfo *)xmalloc (sizeof (struct fileinfo));
-	  l = l->next;
-	  memcpy (l, &cur, sizeof (cur));
-	  l->next = NULL;
-	}
       /* Get the current time.  */
       timenow = time (NULL);
       tnow = localtime (&timenow);
@@ -426,7 +412,26 @@ ftp_parse_unix_ls (const char *file, int ignore_perms)
       timestruct.tm_wday  = 0;
       timestruct.tm_yday  = 0;
       timestruct.tm_isdst = -1;
-      l->tstamp = mktime (&timestruct); /* store the time-stamp */
+      cur.tstamp = mktime (&timestruct); /* store the time-stamp */
+
+#ifdef WPUT
+      ls_store (&cur);
+#else
+      if (!dir)
+	{
+	  l = dir = (struct fileinfo *)xmalloc (sizeof (struct fileinfo));
+	  memcpy (l, &cur, sizeof (cur));
+	  l->prev = l->next = NULL;
+	}
+      else
+	{
+	  cur.prev = l;
+	  l->next = (struct fileinfo *)xmalloc (sizeof (struct fileinfo));
+	  l = l->next;
+	  memcpy (l, &cur, sizeof (cur));
+	  l->next = NULL;
+	}
+#endif
 
       xfree (line);
     }
@@ -536,6 +541,9 @@ ftp_parse_winnt_ls (const char *file)
       cur.linkto = NULL;
 
       /* And put everything into the linked list */
+#ifdef WPUT
+      ls_store (&cur);
+#else
       if (!dir)
 	{
 	  l = dir = (struct fileinfo *)xmalloc (sizeof (struct fileinfo));
@@ -550,6 +558,7 @@ ftp_parse_winnt_ls (const char *file)
 	  memcpy (l, &cur, sizeof (cur));
 	  l->next = NULL;
 	}
+#endif
 
       xfree(line);
     }
@@ -880,6 +889,9 @@ ftp_parse_vms_ls (const char *file)
       DEBUGP(("Timestamp: %ld\n", cur.tstamp));
 
       /* Add the data for this item to the linked list, */
+#ifdef WPUT
+      ls_store (&cur);
+#else
       if (!dir)
         {
           l = dir = (struct fileinfo *)xmalloc (sizeof (struct fileinfo));
@@ -894,6 +906,7 @@ ftp_parse_vms_ls (const char *file)
           memcpy (l, &cur, sizeof (cur));
           l->next = NULL;
         }
+#endif
 
       /* Free old line storage.  Read a new line. */
       xfree (line);
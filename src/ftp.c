@@ -25,14 +25,40 @@
 #include "windows.h"
 #include "constants.h"
 #include "_queue.h"
+#include "worker.h"
+#include "readahead.h"
+#include "uring.h"
+#include "crlf.h"
+#include "ratelimit.h"
+#include "zmode.h"
+#include "checksum.h"
+#include "manifest.h"
+#include "pool.h"
+#include "resolve.h"
 
 void makeskip(_fsession * fsession, char * tmp);
 
+/* tell the cache about the last count directories of path, which have
+ * just been created, starting with the topmost one */
+static void cache_created(ftp_con * ftp, char * path, int count) {
+	char * name = strrchr(path, '/');
+	if(!count) return;
+	if(!name) {
+		ftp_cache_mkd(ftp, NULL, path);
+		return;
+	}
+	if(name == path || !name[1]) return;
+	*name = 0;
+	cache_created(ftp, path, count - 1);
+	ftp_cache_mkd(ftp, path, name + 1);
+	*name = '/';
+}
 /* if direct cwding fails for some reason, try the long way.
  * directiories that do not exist yet are being created if possible */
 /* error-levels: ERR_FAILED, ERR_RECONNECT */
 int long_do_cwd(_fsession * fsession){
 	int res = 0;
+	int created = 0;
 	
 	char * unescaped = cpy(fsession->target_dname);
 	char * tmpbuf = unescaped;
@@ -55,6 +81,10 @@ int long_do_cwd(_fsession * fsession){
 		/* take each token, unescape it and cwd there */
 		ptr = unescape(cpy(tmpbuf));
 		res = try_do_cwd(fsession->ftp, ptr, res);
+		if(res == 1 && strcmp(ptr, "."))
+			created++;
+		else if(res == 0)
+			created = 0;
 		free(ptr);
 		if(res == ERR_FAILED) {
 			ptr = cpy(fsession->target_dname);
@@ -82,6 +112,12 @@ int long_do_cwd(_fsession * fsession){
 		tmpbuf = strtok(NULL, "/");
 	}
 	free(unescaped);
+	/* the directories we just created need not be listed later on */
+	if(created) {
+		ptr = cpy(fsession->target_dname);
+		cache_created(fsession->ftp, ptr, created);
+		free(ptr);
+	}
 	return 0;
 }
 /* first try to change to the directory. if it fails, try to change to the
@@ -122,9 +158,15 @@ int try_do_cwd(ftp_con * ftp, char * path, int mkd) {
 		res = ftp_do_mkd(ftp, path);
 		if(SOCK_ERROR(res))
 			return ERR_RECONNECT;
-		if(res < 0) return ERR_FAILED;	
-		
-		mkd = 1; 
+		/* another connection (--parallel) might have created it meanwhile */
+		if(res < 0) {
+			res = ftp_do_cwd(ftp, path);
+			if(SOCK_ERROR(res))
+				return ERR_RECONNECT;
+			return res < 0 ? ERR_FAILED : 0;
+		}
+
+		mkd = 1;
 
 		res = ftp_do_cwd(ftp, path);
 		if(SOCK_ERROR(res))
@@ -255,13 +297,224 @@ int open_input_file(_fsession * fsession) {
 	*  TODO USS i.e.: can local_fname not be set while opt.input_pipe is also not set? */
 	return fd;
 }
+#define IOBUF_MIN (256 * 1024)
+#define IOBUF_MAX (4 * 1024 * 1024)
+/* the size of the i/o-buffer. unless set by --buffer-size, it is derived from
+ * the bandwidth-delay-product of the data-connection measured so far, so that
+ * a single read() covers at least what is in flight during one round-trip */
+static size_t get_bufsize(wput_socket * sock, off_t bytes, double elapsed) {
+	unsigned int rtt = socket_get_rtt(sock);
+	double bdp;
+	
+	if(opt.buffer_size) return opt.buffer_size;
+	if(!rtt || elapsed <= 0) return IOBUF_MIN;
+	bdp = 2 * (WINCONV bytes / (elapsed / 1000)) * rtt / 1000000;
+	if(bdp < IOBUF_MIN) return IOBUF_MIN;
+	if(bdp > IOBUF_MAX) return IOBUF_MAX;
+	return bdp;
+}
+#define URING_BUFFERS 8
+/* the io_uring-engine reports each chunk it sent through this */
+struct send_state {
+	_fsession * fsession;
+	off_t     * transfered_size;
+	int       * transfered_last;
+	struct wput_timer ** timers;
+	int         paced;
+};
+static void send_progress(void * arg, int bytes) {
+	struct send_state * S = arg;
+	
+	*S->transfered_size += bytes;
+	*S->transfered_last += bytes;
+	if(opt.verbose >= vNORMAL) {
+		bar_update(S->fsession, *S->transfered_size, *S->transfered_last, S->timers[1]);
+		*S->transfered_last = 0;
+	}
+	if(!S->paced)
+		ratelimit_take(bytes);
+}
+/* the strongest of the given checksum-algorithms */
+static unsigned int checksum_pick(unsigned int algos) {
+	unsigned int algo;
+	for(algo = HASH_SHA256; algo; algo >>= 1)
+		if(algos & algo) return algo;
+	return 0;
+}
+/* compare two hex-checksums. some servers leave the leading zeros out of a crc */
+static int checksum_equal(unsigned int algo, char * a, char * b) {
+	if(algo == HASH_CRC32)
+		return strtoul(a, NULL, 16) == strtoul(b, NULL, 16);
+	return !strcasecmp(a, b);
+}
+/* let the server confirm the checksum of what we sent and note it in the
+ * checksum-file (--checksum-file) */
+/* error-levels: ERR_CHECKSUM (mismatch), get_msg() */
+static int checksum_check(_fsession * fsession, checksum * sum, unsigned int algo) {
+	char * local;
+	char * remote = NULL;
+	int    res;
+	
+	if(algo) {
+		res = ftp_do_hash(fsession->ftp, fsession->target_fname, algo, 0, -1, &remote);
+		if(SOCK_ERROR(res)) return res;
+		if(res == 0) {
+			local = checksum_hex(sum, algo);
+			if(!checksum_equal(algo, local, remote)) {
+				printout(vLESS, _("Error: "));
+				printout(vLESS, _("%s checksum mismatch (local %s, remote %s).\n"),
+					checksum_name(algo), local, remote);
+				free(remote);
+				return ERR_CHECKSUM;
+			}
+			printout(vMORE, _("%s checksum verified.\n"), checksum_name(algo));
+			free(remote);
+		} else
+			printout(vMORE, _("The server did not compute the checksum. Not verifying.\n"));
+	}
+	
+	if(opt.checksum_file && checksum_hex(sum, HASH_SHA256)) {
+		static FILE * fp = NULL;
+		if(!fp && !(fp = fopen(opt.checksum_file, "a"))) {
+			printout(vLESS, _("Warning: "));
+			printout(vLESS, _("Cannot open the checksum-file `%s' (%s).\n"), opt.checksum_file, strerror(errno));
+			opt.checksum_file = NULL;
+			return 0;
+		}
+		/* the format of sha256sum. each line goes out at once, because
+		 * several --parallel workers might append to the same file */
+		fprintf(fp, "%s  %s\n", checksum_hex(sum, HASH_SHA256),
+			fsession->local_fname ? fsession->local_fname : fsession->target_fname);
+		fflush(fp);
+	}
+	if(opt.manifest && checksum_hex(sum, HASH_SHA256))
+		fsession->digest = cpy(checksum_hex(sum, HASH_SHA256));
+	return 0;
+}
+/* smart resuming does not narrow the bad spot down further than this */
+#define RESUME_BLOCK (64 * 1024)
+/* compare the bytes [from, to) of the local file with the server's copy */
+/* error-levels: 1 (differ), ERR_FAILED (cannot tell), get_msg() */
+static int checksum_range(_fsession * fsession, int fd, unsigned int algo, off_t from, off_t to) {
+	checksum * sum = checksum_new(algo);
+	char     * remote = NULL;
+	int        res;
+	
+	if(!sum || checksum_file(sum, fd, from, to) < 0) {
+		checksum_free(sum);
+		return ERR_FAILED;
+	}
+	res = ftp_do_hash(fsession->ftp, fsession->target_fname, algo, from, to, &remote);
+	if(res == 0) {
+		res = checksum_equal(algo, checksum_hex(sum, algo), remote) ? 0 : 1;
+		free(remote);
+	}
+	checksum_free(sum);
+	return res;
+}
+/* find out how much of the remote file matches the local one, instead of
+ * blindly trusting everything but the last 512 bytes. if the whole prefix
+ * does not match, the first bad block is narrowed down by bisection. */
+/* error-levels: ERR_FAILED (the server cannot tell), get_msg() */
+static int smart_resume(_fsession * fsession) {
+	unsigned int algo;
+	off_t good = 0;
+	off_t bad  = fsession->target_fsize;
+	off_t mid;
+	int   fd;
+	int   res;
+	
+	res = ftp_do_feat(fsession->ftp);
+	if(SOCK_ERROR(res)) return res;
+	algo = checksum_pick(ftp_hash_algos(fsession->ftp, 1) & checksum_supported());
+	if(!algo) return ERR_FAILED;
+	
+	if((fd = open(fsession->local_fname, O_RDONLY)) == -1)
+		return ERR_FAILED;
+	
+	res = checksum_range(fsession, fd, algo, 0, bad);
+	if(res == 0) {
+		printout(vMORE, _("%s checksum of the remote file matches. Resuming at %l.\n"),
+			checksum_name(algo), bad);
+		close(fd);
+		return 0;
+	}
+	if(res < 0) {
+		close(fd);
+		return res;
+	}
+	
+	/* [0, good) is known to match, [good, bad) to contain a difference.
+	 * each round only hashes the part between good and mid */
+	while(bad - good > RESUME_BLOCK) {
+		mid = good + ((bad - good) / 2 & ~(RESUME_BLOCK - 1));
+		if(mid == good) mid = good + RESUME_BLOCK;
+		res = checksum_range(fsession, fd, algo, good, mid);
+		if(res == 0)
+			good = mid;
+		else if(res == 1)
+			bad  = mid;
+		else
+			break;
+	}
+	close(fd);
+	if(SOCK_ERROR(res)) return res;
+	
+	printout(vMORE, _("The remote file differs from the local one. Resuming at %l.\n"), good);
+	fsession->target_fsize = good;
+	return 0;
+}
+/* hand the data to the socket, through the compressor if there is one.
+ * the rate-limit counts what goes over the wire then */
+/* MODE B (RFC 959, 3.4.2): the data goes in blocks of at most 64k, each
+ * with a header of a descriptor and the length. the last block of a file
+ * has BLOCK_EOF set */
+#define BLOCK_EOF 64
+static int send_block(wput_socket * sock, unsigned char desc, char * buf, int len) {
+	char * block = malloc((len > 0xffff ? 0xffff : len) + 3);
+	int n;
+	
+	do {
+		n = len > 0xffff ? 0xffff : len;
+		block[0] = desc;
+		block[1] = n >> 8;
+		block[2] = n & 0xff;
+		if(n) memcpy(block + 3, buf, n);
+		if(socket_write(sock, block, n + 3) != n + 3) {
+			free(block);
+			return ERR_FAILED;
+		}
+		buf += n;
+		len -= n;
+	} while(len > 0);
+	free(block);
+	return 0;
+}
+
+static int send_data(wput_socket * sock, zmode * zs, int block, char * buf, int len, int paced) {
+	off_t sent;
+	
+	if(block)
+		return send_block(sock, 0, buf, len);
+	if(!zs)
+		return socket_write(sock, buf, len) == len ? 0 : ERR_FAILED;
+	sent = zmode_sent(zs);
+	if(zmode_send(zs, sock, buf, len, 0) < 0)
+		return ERR_FAILED;
+	if(!paced)
+		ratelimit_take(zmode_sent(zs) - sent);
+	return 0;
+}
 /* finally this is about actually transmitting the file.
  * putting it through the socket and giving status information to the logfile */
 /* TODO NRV do_send() contains a lot of code. maybe too much? */
 /* error-levels: ERR_FAILED, get_msg() */
 int do_send(_fsession * fsession){
-#define DBUFSIZE 1024
-	char        databuf[DBUFSIZE];
+	char      * databuf     = NULL;
+	char      * data        = NULL;
+	size_t      bufsize     = 0;
+	readahead * ra          = NULL;
+	double      resized     = 0;
 	int         fd          = open_input_file(fsession);
 	int         readbytes   = 0;
 	int         res         = 0;
@@ -271,15 +524,25 @@ int do_send(_fsession * fsession){
 	
 	struct wput_timer * timers[2];
 	
-	char * d                = NULL;
-	char * p                = NULL;
 	int    convertbytes     = 0;
-	char   convertbuf[DBUFSIZE];
-	int    crcount          = 0;
-
+	char * convertbuf       = NULL;
+	char   lastbyte         = 0;
 	
-	res = ftp_establish_data_connection(fsession->ftp);
-	if(res < 0) return res;
+	/* binary data is put from the file into the socket directly if possible */
+	int    zerocopy         = 0;
+	int    uring_sent       = 0;
+	/* the kernel takes care of --limit-rate */
+	int    paced            = 0;
+	/* MODE Z */
+	int    compress         = 0;
+	/* MODE B */
+	int    block            = 0;
+	zmode * zs              = NULL;
+	/* checksum of the data sent and the algorithm the server verifies it with */
+	checksum * sum          = NULL;
+	unsigned int verify     = 0;
+	size_t chunksize;
+
 	
 	/* TODO USS make resuming work for ascii-files too */
 	if(fsession->binary == TYPE_A) {
@@ -287,17 +550,60 @@ int do_send(_fsession * fsession){
 		fsession->target_fsize = -1;
 	}
 	
+	/* compress on the wire if the server is able to and the file seems worth it.
+	 * resuming refers to the uncompressed data, so that is left to MODE S */
+	if(opt.compress && fsession->target_fsize <= 0 && !fsession->segment) {
+		res = ftp_do_feat(fsession->ftp);
+		if(SOCK_ERROR(res)) return res;
+		compress = (fsession->ftp->features & FEAT_MODE_Z) && zmode_worth(fsession->local_fname, fd);
+	}
+	/* otherwise block mode keeps the data-connection open for the next file.
+	 * resuming would need restart-markers, so that is left to MODE S as well.
+	 * the mode is set first, since it decides whether there is a data-connection
+	 * to go on with */
+	block = !compress && opt.block_mode && fsession->target_fsize <= 0 && !fsession->segment;
+	res = ftp_set_mode(fsession->ftp, compress ? 'Z' : block ? 'B' : 'S', opt.compress);
+	if(SOCK_ERROR(res)) return res;
+	/* whatever mode the server is in now, we have to go with it */
+	compress = fsession->ftp->mode == 'Z';
+	block    = fsession->ftp->mode == 'B';
+	
+	res = ftp_establish_data_connection(fsession->ftp);
+	if(res < 0) return res;
+	
 	if(fsession->target_fsize > 0) {
 		res = ftp_do_rest(fsession->ftp, fsession->target_fsize);
 		if(SOCK_ERROR(res)) return res;
+		/* a segment cannot be restarted at 0 */
+		if(res == ERR_FAILED && fsession->segment) {
+			fsession->done = 1;
+			return ERR_FAILED;
+		}
 		if(res == ERR_FAILED)
 			fsession->target_fsize = -1;
 	}
 	
+	if(fsession->segment == SEGMENT_TRAILING && fsession->segment_go != -1) {
+		char c;
+		while(read(fsession->segment_go, &c, 1) == -1 && errno == EINTR) ;
+		close(fsession->segment_go);
+		fsession->segment_go = -1;
+	}
+	
+	/* a server that is able to compute checksums can confirm the upload.
+	 * segments are just parts of the file, so there is nothing to compare */
+	if(opt.verify && fsession->binary == TYPE_I && !fsession->segment) {
+		res = ftp_do_feat(fsession->ftp);
+		if(SOCK_ERROR(res)) return res;
+		verify = checksum_pick(ftp_hash_algos(fsession->ftp, 0) & checksum_supported());
+		if(!verify)
+			printout(vMORE, _("The server cannot compute any checksum we know. Not verifying.\n"));
+	}
+	
 	while(1) {
 		res = ftp_do_stor(fsession->ftp, fsession->target_fname);
 		if(res == 1 ) { /* disable resuming */
-			if(fsession->target_fsize == -1) {
+			if(fsession->target_fsize == -1 || fsession->segment) {
 				res = ERR_FAILED;
 				break;
 			} else {
@@ -313,12 +619,19 @@ int do_send(_fsession * fsession){
 		fsession->done = 1;
 	if(res < 0) return res;
 	
+	/* the remote file is (re)created now, so the other segments may go on */
+	if(fsession->segment == SEGMENT_LEADING && fsession->segment_go != -1) {
+		close(fsession->segment_go);
+		fsession->segment_go = -1;
+	}
+	
 	/* we now have to accept the socket (if listening) and close the listening server */
 	if( ftp_complete_data_connection(fsession->ftp) == ERR_FAILED) return ERR_FAILED;
 	/* -1 indicates that the file does not exist remotely, but now,
 	 * after we set resuming, we can again start assuming that remote
 	 * file is 0 bytes long (needed for some calculations) */	
 	if(fsession->target_fsize == -1) fsession->target_fsize = 0;
+	if(compress) zs = zmode_new(opt.compress);
 	/* initiate progress-output */
 	bar_create(fsession);
 	
@@ -343,73 +656,213 @@ int do_send(_fsession * fsession){
 		transfered_size = fsession->target_fsize;
 	}
 	
-	memset(databuf, 0, DBUFSIZE);
-	while( (readbytes = read(fd, (char *)databuf, DBUFSIZE)) != 0 ) {    
+	if(verify || (opt.checksum_file && !fsession->segment))
+		sum = checksum_new(verify | (opt.checksum_file ? HASH_SHA256 : 0));
+	
+#ifdef HAVE_KTLS
+	/* with the kernel encrypting, protected data can be sent like any other */
+	if(fsession->ftp->datasock->ssl && socket_ktls_tx(fsession->ftp->datasock) == ERR_FAILED) {
+		static int warned = 0;
+		if(!warned++)
+			printout(vDEBUG, "kTLS is not available (%s)\n", strerror(errno));
+	}
+#endif
+#ifdef HAVE_SENDFILE
+	zerocopy = fsession->binary == TYPE_I
+#  ifdef HAVE_SSL
+		&& (!fsession->ftp->datasock->ssl || fsession->ftp->datasock->ktls)
+#  endif
+#  ifndef HAVE_SPLICE
+		&& fsession->local_fname
+#  endif
+		&& !zs && !block && !sum;
+#endif
+	
+	bufsize = get_bufsize(fsession->ftp->datasock, 0, 0);
+	databuf = malloc(bufsize);
+	/* each \n might become \r\n */
+	if(fsession->binary == TYPE_A)
+		convertbuf = malloc(2 * bufsize);
+	
+	/* the checksum covers the whole file, so the part that is on the server
+	 * already has to be read as well */
+	if(sum && fsession->target_fsize > 0 && checksum_file(sum, fd, 0, fsession->target_fsize) < 0) {
+		printout(vMORE, _("Cannot read the beginning of the file. Not verifying.\n"));
+		checksum_free(sum);
+		sum    = NULL;
+		verify = 0;
+	}
+	
+	/* let the kernel space out the packets if whished. this is smoother
+	 * than anything we can do by sleeping */
+	if(opt.kernel_pacing && ratelimit_rate()) {
+		paced = socket_set_pacing(fsession->ftp->datasock, ratelimit_rate()) == 0;
+		if(!paced)
+			printout(vMORE, _("Kernel pacing is not available (%s).\n"), strerror(errno));
+	}
+	
+	/* let a thread read ahead while we are sending. the data has to pass
+	 * our own buffers then, so this excludes zero-copy */
+	if(opt.read_ahead > 0) {
+		ra = readahead_start(fd, ratelimit_chunk(bufsize), opt.read_ahead,
+			fsession->segment ? fsession->local_fsize - transfered_size : -1);
+		if(ra) zerocopy = 0;
+	}
+	
+	/* or let the kernel do reading and sending on its own */
+	if(opt.io_uring && !ra && !zs && !block && !sum && fsession->binary == TYPE_I && fsession->local_fname
+#ifdef HAVE_SSL
+		&& (!fsession->ftp->datasock->ssl || fsession->ftp->datasock->ktls)
+#endif
+		) {
+		uring * U = uring_new(ratelimit_chunk(bufsize), URING_BUFFERS);
+		if(!U) {
+			static int warned = 0;
+			if(!warned++)
+				printout(vMORE, _("io_uring is not available. Using read()/send() instead.\n"));
+		} else {
+			struct send_state state;
+			off_t  sent;
+			off_t  before = transfered_size;
+			
+			state.fsession        = fsession;
+			state.transfered_size = &transfered_size;
+			state.transfered_last = &transfered_last;
+			state.timers          = timers;
+			state.paced           = paced;
+			sent = uring_send_file(U, fsession->ftp->datasock, fd, transfered_size,
+				fsession->local_fsize - transfered_size, send_progress, &state);
+			uring_free(U);
+			/* a kernel that rejects the requests leaves it to read()/send() */
+			if(sent == ERR_FAILED && errno == EINVAL && transfered_size == before) {
+				printout(vDEBUG, "io_uring not possible (%s)\n", strerror(errno));
+			} else if(sent == ERR_FAILED) {
+				printout(vLESS, _("Error: "));
+				printout(vLESS, _("Error encountered during uploading data (%s)\n"), strerror(errno));
+				free(timers[0]);
+				free(timers[1]);
+				free(databuf);
+				free(convertbuf);
+				zmode_free(zs);
+				checksum_free(sum);
+				opt.transfered_bytes += transfered_size - fsession->target_fsize;
+				res = ftp_do_abor(fsession->ftp);
+				if(SOCK_ERROR(res)) return ERR_RECONNECT;
+				return ERR_FAILED;
+			} else
+				uring_sent = 1;
+		}
+	}
+	
+	if(!uring_sent) while(1) {
+		/* grow the buffer once a second, as long as the bandwidth-delay-product does */
+		if(!opt.buffer_size && !ra && wtimer_elapsed(timers[0]) - resized >= 1000) {
+			resized = wtimer_elapsed(timers[0]);
+			chunksize = get_bufsize(fsession->ftp->datasock, transfered_size - fsession->target_fsize, resized);
+			if(chunksize > bufsize) {
+				printout(vDEBUG, "i/o-buffer grows to %d bytes\n", (int) chunksize);
+				bufsize = chunksize;
+				free(databuf);
+				databuf = malloc(bufsize);
+				if(convertbuf) {
+					free(convertbuf);
+					convertbuf = malloc(2 * bufsize);
+				}
+			}
+		}
+		chunksize = ratelimit_chunk(bufsize);
+		if(fsession->segment && fsession->local_fsize - transfered_size < chunksize)
+			chunksize = fsession->local_fsize - transfered_size;
+#ifdef HAVE_SENDFILE
+		if(zerocopy) {
+			readbytes = socket_sendfile(fsession->ftp->datasock, fd, chunksize, !fsession->local_fname);
+			/* the kernel might not support it for this kind of file. nothing is
+			 * sent in that case, so just go on the usual way */
+			if(readbytes == ERR_FAILED && (errno == EINVAL || errno == ENOSYS)) {
+				printout(vDEBUG, "zero-copy not possible (%s)\n", strerror(errno));
+				zerocopy = 0;
+				continue;
+			}
+			if(readbytes == ERR_FAILED) {
+				printout(vLESS, _("Error: "));
+				printout(vLESS, _("Error encountered during uploading data (%s)\n"), strerror(errno));
+				free(timers[0]);
+				free(timers[1]);
+				free(databuf);
+				free(convertbuf);
+				zmode_free(zs);
+				checksum_free(sum);
+				if(ra) readahead_stop(ra);
+				opt.transfered_bytes += transfered_size - fsession->target_fsize;
+				res = ftp_do_abor(fsession->ftp);
+				if(SOCK_ERROR(res)) return ERR_RECONNECT;
+				return ERR_FAILED;
+			}
+		} else
+#endif
+		if(ra)
+			readbytes = readahead_get(ra, &data);
+		else
+			readbytes = read(fd, data = databuf, chunksize);
+		if( readbytes == 0 ) break;
 		if( readbytes == -1 ) {
 			printout(vLESS, _("Error: "));
 			printout(vLESS, _("local file could not be read: %s\n"), strerror(errno));
 			free(timers[0]);
 			free(timers[1]);
+			free(databuf);
+			free(convertbuf);
+			zmode_free(zs);
+			checksum_free(sum);
+			if(ra) readahead_stop(ra);
 			return ERR_FAILED;
 		}
 	
-		/* TODO NRV speed_limit should take other reference-data than the average speed... 
-		 * TODO NRV maybe average-speed during the last minute or st. similar.
-		 * works for now noone complained ;-) */
-		if(opt.speed_limit > 0 ) {
-			double elapsed_time = wtimer_elapsed(timers[0]);
-			while(elapsed_time > 0 && WINCONV(transfered_size - fsession->target_fsize) / (elapsed_time / 1000) > opt.speed_limit) {
-				usleep(1000 * 200); /* sleep 0.2 seconds */
-				elapsed_time = wtimer_elapsed(timers[0]);
-			}
-		}
+		if(!paced && !zs)
+			ratelimit_take(readbytes);
+		if(sum)
+			checksum_update(sum, data, readbytes);
 	
 		if(fsession->binary == TYPE_A){
-			d = databuf;
-			p = convertbuf;
-			crcount = 0;
 			/* TODO NRV ascii mode means more than just CRLF (7-bit), i suppose this
 			 * TODO NRV is enough, but maybe someone has time to play around... */
-			/* simply replace all \n by \r\n unless there is already an \n */
-			while( d < databuf + readbytes){
-				while ((p < convertbuf + sizeof(convertbuf)) && (d < databuf + readbytes)){
-					if (*d == '\n' && d != databuf && *(d-1) != '\r'){
-						*p++ = '\r';
-						crcount++;
-						if (p == convertbuf + sizeof(convertbuf))
-							break;
-					}
-					*p++ = *d++;
-				}
-				/* send data converted so far */
-				convertbytes = p - convertbuf;
-				
-				res = socket_write(fsession->ftp->datasock, convertbuf, convertbytes);
-				if (res != convertbytes){
-					printout(vLESS, _("Error: "));
-					printout(vLESS, _("Error encountered during uploading data\n"));
-					free(timers[0]);
-					free(timers[1]);
-					opt.transfered_bytes += transfered_size - fsession->target_fsize;
-					res = ftp_do_abor(fsession->ftp);
-					if(SOCK_ERROR(res)) return ERR_RECONNECT;
-					return ERR_FAILED;
-				}
-				/* reset convert buffer to proceed */
-				p = convertbuf;
+			/* simply replace all \n by \r\n unless there is already an \r */
+			convertbytes = crlf_convert(data, readbytes, convertbuf, &lastbyte);
+			if(send_data(fsession->ftp->datasock, zs, block, convertbuf, convertbytes, paced) < 0){
+				printout(vLESS, _("Error: "));
+				printout(vLESS, _("Error encountered during uploading data\n"));
+				free(timers[0]);
+				free(timers[1]);
+				free(databuf);
+				free(convertbuf);
+				zmode_free(zs);
+				checksum_free(sum);
+				if(ra) readahead_stop(ra);
+				opt.transfered_bytes += transfered_size - fsession->target_fsize;
+				res = ftp_do_abor(fsession->ftp);
+				if(SOCK_ERROR(res)) return ERR_RECONNECT;
+				return ERR_FAILED;
 			}
-			transfered_size += crcount + readbytes;
-			transfered_last += crcount + readbytes;
+			transfered_size += convertbytes;
+			transfered_last += convertbytes;
+		}
+		else if(zerocopy) {
+			transfered_size += readbytes;
+			transfered_last += readbytes;
 		}
 		else {
 			transfered_size += readbytes;
 			transfered_last += readbytes;
-			res = socket_write(fsession->ftp->datasock, databuf, readbytes);
-			if(res != readbytes) {
+			if(send_data(fsession->ftp->datasock, zs, block, data, readbytes, paced) < 0) {
 				printout(vLESS, _("Error: "));
 				printout(vLESS, _("Error encountered during uploading data (%s)\n"), strerror(errno));
 				free(timers[0]);
 				free(timers[1]);
+				free(databuf);
+				free(convertbuf);
+				zmode_free(zs);
+				checksum_free(sum);
+				if(ra) readahead_stop(ra);
 				opt.transfered_bytes += transfered_size - fsession->target_fsize;
 				res = ftp_do_abor(fsession->ftp);
 				if(SOCK_ERROR(res)) return ERR_RECONNECT;
@@ -422,6 +875,47 @@ int do_send(_fsession * fsession){
 		}
 	}
 	
+	if(ra) readahead_stop(ra);
+	
+	/* terminate the compressed stream */
+	if(zs) {
+		res = zmode_send(zs, fsession->ftp->datasock, NULL, 0, 1);
+		if(res == 0 && transfered_size > fsession->target_fsize)
+			printout(vMORE, _("Compressed %l bytes to %l (%d%%).\n"),
+				transfered_size - fsession->target_fsize, zmode_sent(zs),
+				(int) (100 * zmode_sent(zs) / (transfered_size - fsession->target_fsize)));
+		zmode_free(zs);
+		zs = NULL;
+		if(res < 0) {
+			printout(vLESS, _("Error: "));
+			printout(vLESS, _("Error encountered during uploading data (%s)\n"), strerror(errno));
+			free(timers[0]);
+			free(timers[1]);
+			free(databuf);
+			free(convertbuf);
+			checksum_free(sum);
+			opt.transfered_bytes += transfered_size - fsession->target_fsize;
+			res = ftp_do_abor(fsession->ftp);
+			if(SOCK_ERROR(res)) return ERR_RECONNECT;
+			return ERR_FAILED;
+		}
+	}
+	
+	/* the server knows from the last block that the file is complete */
+	if(block && send_block(fsession->ftp->datasock, BLOCK_EOF, NULL, 0) < 0) {
+		printout(vLESS, _("Error: "));
+		printout(vLESS, _("Error encountered during uploading data (%s)\n"), strerror(errno));
+		free(timers[0]);
+		free(timers[1]);
+		free(databuf);
+		free(convertbuf);
+		checksum_free(sum);
+		opt.transfered_bytes += transfered_size - fsession->target_fsize;
+		res = ftp_do_abor(fsession->ftp);
+		if(SOCK_ERROR(res)) return ERR_RECONNECT;
+		return ERR_FAILED;
+	}
+	
 	/* TODO USS ok the pipe-handle is missing. so we just close the fd? memory-leak... */
 /*	if(!fsession->local_fname && opt.input_pipe)
 		pclose(pipe);
@@ -429,15 +923,29 @@ int do_send(_fsession * fsession){
 	if(fd != -1)
 		close(fd);
 	
-	if(fsession->ftp->datasock) {
-		socket_close(fsession->ftp->datasock);
+	/* in block mode, the data-connection stays open for the next file */
+	if(block)
+		fsession->ftp->datakept = 1;
+	else if(fsession->ftp->datasock) {
+		socket_finish(fsession->ftp->datasock);
 		fsession->ftp->datasock = NULL;
 	}
 	
+	/* with --pipeline, the next data-connection is asked for right away */
+	if(opt.pipeline && !fsession->segment)
+		ftp_prepare_data_connection(fsession->ftp);
+	
 	/* receive the final message. allow 1xy answers because they might have
 	 * been timeouted in do_stor and it's ok if we receive them here */
 	printout(vNORMAL, "\n");
 	while( (res = ftp_get_msg(fsession->ftp)) == ERR_POSITIVE_PRELIMARY) ;
+	if(!SOCK_ERROR(res))
+		ftp_prepared_reply(fsession->ftp);
+	else
+		ftp_drop_prepared(fsession->ftp);
+	/* no telling what state the block-mode connection is in after a failure */
+	if(res < 0)
+		ftp_close_data(fsession->ftp);
 	
 	printout(vNORMAL, "%s (%s) - `%s' [%l]\n\n",
 			time_str(),
@@ -449,6 +957,21 @@ int do_send(_fsession * fsession){
 	
 	free(timers[0]);
 	free(timers[1]);
+	free(databuf);
+	free(convertbuf);
+	zmode_free(zs);
+	
+	/* compare the checksum with the one of the server, if the file is complete */
+	if(sum && !SOCK_ERROR(res) && !FTP_ERROR(res)
+			&& (transfered_size == fsession->local_fsize || !fsession->local_fname))
+		res = checksum_check(fsession, sum, verify);
+	checksum_free(sum);
+	if(res == ERR_CHECKSUM) {
+		/* we do not know where the damage is, so start over */
+		fsession->target_fsize = -1;
+		opt.barstyle = backupbarstyle;
+		return ERR_RETRY;
+	}
 	
 	opt.transfered_bytes += transfered_size - fsession->target_fsize;
 	opt.transfered++;
@@ -460,6 +983,10 @@ int do_send(_fsession * fsession){
 	if(FTP_ERROR(res))   return ERR_FAILED;
 	if(SOCK_ERROR(res)) return res;
 	
+	/* keep the cached listing in sync, so it need not be fetched again */
+	if(fsession->binary == TYPE_I && !fsession->segment)
+		ftp_cache_file(fsession->ftp, fsession->target_fname, transfered_size);
+	
 	if( fsession->local_fname &&
 		(transfered_size == fsession->local_fsize || fsession->binary == TYPE_A) 
 		&& opt.unlink) {
@@ -581,9 +1108,27 @@ int do_delete(_fsession * fsession, char * filename){
 	}
 
 
+/* the key of a file in the manifest: user@host:port/path */
+static char * manifest_key(_fsession * fsession) {
+	char * host = fsession->host->hostname ? fsession->host->hostname : printip((unsigned char *) &fsession->host->ip);
+	char * key  = malloc(strlen(fsession->user) + strlen(host) + 8 +
+		(fsession->target_dname ? strlen(fsession->target_dname) : 0) + strlen(fsession->target_fname) + 3);
+
+	if(fsession->target_dname)
+		clear_path(fsession->target_dname);
+	sprintf(key, "%s@%s:%d/%s%s%s", fsession->user, host, fsession->host->port,
+		fsession->target_dname ? fsession->target_dname : "",
+		fsession->target_dname ? "/" : "",
+		fsession->target_fname);
+	return key;
+}
+
 /* error-levels: 0 (success), -1 (failed), -2 (skipped) */
 int fsession_process_file(_fsession * fsession, ftp_con * ftp) {
 	int res = 0;
+	/* the local mtime is changed by check_timestamp(), the manifest wants the real one */
+	time_t mtime = fsession->local_ftime;
+	char * key   = NULL;
 	/* we don't do any GUI interactive stuff, so we can afford a "simpler" flow
 	* of command sequence */
 	
@@ -596,7 +1141,20 @@ int fsession_process_file(_fsession * fsession, ftp_con * ftp) {
 		return ERR_FAILED;
 	}
 	
-	if (!opt.wdel)
+	/* files that have not changed since they were uploaded the last time
+	 * are skipped without asking the server */
+	if(opt.manifest && !opt.wdel && !fsession->segment && fsession->local_fname) {
+		key = manifest_key(fsession);
+		if(manifest_known(key, fsession->local_fsize, mtime)) {
+			printout(vMORE, _("Skipping this file, since it did not change since the last upload.\n"));
+			printout(vLESS, _("-- Skipping file: %s\n"), fsession->local_fname);
+			free(key);
+			return ERR_SKIP;
+		}
+	}
+	
+	/* segments are announced by the fsession they belong to */
+	if (!opt.wdel && !fsession->segment)
 		printout(vLESS,
 				"--%s-- `%s'\n"
 				"    => ftp://%s:xxxxx@%s:%d/%s%s%s\n",
@@ -608,7 +1166,7 @@ int fsession_process_file(_fsession * fsession, ftp_con * ftp) {
 				fsession->target_dname,
 				fsession->target_dname ? "/" : "",
 				fsession->target_fname);
-	else
+	else if (opt.wdel)
 		printout(vLESS,
 				_("--%s-- Deleting file/dir: ftp://%s:xxxxx@%s:%d/%s%s%s\n"),
 				time_str(),
@@ -619,20 +1177,30 @@ int fsession_process_file(_fsession * fsession, ftp_con * ftp) {
 				fsession->target_dname ? "/" : "",
 				fsession->target_fname);
 
+  /* drop or keep alive what has been idle in the pool meanwhile */
+  pool_maintain();
+  
   while(!fsession->done && ( fsession->retry > 0 || fsession->retry == -1) ){
 	printout(vDEBUG, "starting again\n");
-    /* ftp is the last ftp-connection. so we check whether both hosts match. 
-	 * if not the old connection is closed and a new one is created */
+    /* ftp is the last ftp-connection. if it belongs to another server or
+	 * account, a pooled connection of this account is preferred and the
+	 * old one is parked in the pool */
 	if(ftp) {
-		if(ftp->host->ip       == fsession->host->ip && 
-		   ftp->host->port     == fsession->host->port && 
-		   SAVE_STRCMP(ftp->host->hostname, fsession->host->hostname))
+		int match = pool_match(ftp, fsession->host, fsession->user, fsession->pass);
+		if(match != POOL_ACCOUNT)
+			fsession->ftp = pool_get(fsession->host, fsession->user, fsession->pass);
+		if(match != POOL_OTHER && !fsession->ftp)
 			fsession->ftp = ftp;
-		else
-			ftp_quit(ftp);
+		else if(fsession->ftp != ftp)
+			pool_put(ftp);
+		ftp = NULL;
 	}
 	if(!fsession->ftp)
-		fsession->ftp = ftp_new(ftp_new_host(fsession->host->ip, fsession->host->hostname, fsession->host->port), opt.tls);
+		fsession->ftp = pool_get(fsession->host, fsession->user, fsession->pass);
+	if(!fsession->ftp)
+		fsession->ftp = ftp_new(ftp_new_host(fsession->host->ip, 
+			fsession->host->hostname ? cpy(fsession->host->hostname) : NULL, 
+			fsession->host->port), opt.tls);
 	
 	/* if there is already an established connection skip the connecting procedure */
 	if(!fsession->ftp->sock) {
@@ -661,6 +1229,7 @@ int fsession_process_file(_fsession * fsession, ftp_con * ftp) {
 			fsession->pass ? cpy(fsession->pass) : NULL, NULL);
 		ftp_do_quit(fsession->ftp);
 		fsession->ftp = NULL;
+		if(key) free(key);
 		return ERR_FAILED;
 	}
 
@@ -688,6 +1257,7 @@ int fsession_process_file(_fsession * fsession, ftp_con * ftp) {
 				 * TODO USS wise to set fsession->ftp->current_directory to the actual one */
 				fsession->ftp->needcwd = 1;
 				printout(vLESS, _("Failed to change to target directory. Skipping this file/dir.\n"));
+				if(key) free(key);
 				return ERR_FAILED;
 			}
 		}
@@ -708,7 +1278,8 @@ int fsession_process_file(_fsession * fsession, ftp_con * ftp) {
 		fsession->binary = get_filemode(fsession->target_fname);
 
 	
-	if (!opt.wdel) {
+	/* segments already know their offsets, so there is nothing to figure out */
+	if (!opt.wdel && !fsession->segment) {
 		/* on most ftps we have to say PASV or PORT before typing REST n. 
 		 * So i assume that it's best to _only_ SIZE here and do REST in do_send() */
 		/* we don't need to SIZE for input-pipes, since we don't know the local file-size anyway */
@@ -719,6 +1290,10 @@ int fsession_process_file(_fsession * fsession, ftp_con * ftp) {
 			fsession->target_fsize = -1;
 		else
 			if(fsession->local_fname) {
+				/* with --pipeline, TYPE, SIZE and MDTM cost one round-trip */
+				res = ftp_pipeline_stat(fsession->ftp, fsession->binary, fsession->target_fname, opt.timestamping);
+				SOCKET_RETRY;
+				
 				res = ftp_set_type(fsession->ftp, fsession->binary);
 				SOCKET_RETRY;
 				if(res == ERR_FAILED)
@@ -728,8 +1303,15 @@ int fsession_process_file(_fsession * fsession, ftp_con * ftp) {
 				if(res == ERR_FAILED) fsession->target_fsize = -1;
 				SOCKET_RETRY;
 
-				/* reupload last 512-byte block in case connection errors cause bad data to be inserted */
-				if(fsession->target_fsize > 0 && fsession->target_fsize != fsession->local_fsize)
+				/* let the server tell us how much of the file really made it. if it
+				 * cannot, reupload last 512-byte block in case connection errors
+				 * cause bad data to be inserted */
+				res = ERR_FAILED;
+				if(fsession->target_fsize > 0 && fsession->target_fsize < fsession->local_fsize &&
+				   fsession->binary == TYPE_I)
+					res = smart_resume(fsession);
+				SOCKET_RETRY;
+				if(res == ERR_FAILED && fsession->target_fsize > 0 && fsession->target_fsize != fsession->local_fsize)
 					fsession->target_fsize = (fsession->target_fsize - 511) & ~0x1ff;
 			}
 
@@ -760,17 +1342,25 @@ int fsession_process_file(_fsession * fsession, ftp_con * ftp) {
 				fsession->done = 1;
 				break;
 			}
+	}
 
+	if (!opt.wdel) {
 		/* redo setting of binary/ascii mode, in case we did no SIZE */
 		res = ftp_set_type(fsession->ftp, fsession->binary);
 		SOCKET_RETRY;
 
 		if(res == ERR_FAILED)
 			printout(vMORE, _("Unable to set transfer mode. Assuming binary\n"));
-	}
 
-	if (!opt.wdel) {
+		/* split large files among several connections if whished.
+		 * 1 means that the file has to be sent the usual way */
+		res = 1;
+		if(opt.segments > 1 && !fsession->segment)
+			res = fsession_send_segments(fsession);
+		SOCKET_RETRY;
+
 		/* transmit the file and retry if requested */
+		if(res == 1)
 		while((res = do_send(fsession)) == ERR_RETRY) {
 			retry_wait(fsession);
 			if(!( fsession->retry > 0 || fsession->retry == -1)) {
@@ -826,6 +1416,14 @@ int fsession_process_file(_fsession * fsession, ftp_con * ftp) {
         
   } /* while */
 
+	/* the server has the file now. a skipped file of the same size is
+	 * assumed to be there too, like the resume-rules do */
+	if(key) {
+		if(res == ERR_OK || (res == ERR_SKIP && fsession->local_fsize == fsession->target_fsize))
+			manifest_store(key, fsession->local_fsize, mtime, fsession->digest);
+		free(key);
+	}
+
 	/* TODO NRV wait only if this is _not_ the last file */
 	/* wait opt.wait seconds or if random_wait is enabled wait
 	 * st. between 0 and 2*opt.wait 10th-seconds (average would be opt.wait) */
@@ -868,14 +1466,20 @@ int parse_url(_fsession * fsession, char *url) {
 	}
 	fsession->host = ftp_new_host(0,NULL,21);
 	
-	/* port */
-	d = strchr(host, ':');
-	if(d)
+	/* port. an ipv6-address is enclosed in brackets */
+	if(*host == '[' && (d = strchr(host, ']'))) {
+		*d++ = 0;
+		host++;
+		if(*d == ':') fsession->host->port = atoi(d + 1);
+	} else if((d = strchr(host, ':')))
 		*d = 0,
 		fsession->host->port = atoi(d + 1);
 	
-	/* hostname */
-	if( get_ip_addr(host, &fsession->host->ip) == -1) {
+	/* hostname. a host without an ipv4-address is known by its name */
+	if( resolve_host(host, &fsession->host->ip) == 0) {
+		if(!fsession->host->ip)
+			fsession->host->hostname = cpy(host);
+	} else {
 		if(opt.ps.type != PROXY_OFF) {
 			fsession->host->hostname = cpy(host);
 			printout(vMORE, _("Warning: "));
@@ -35,6 +35,16 @@ typedef struct ftp_session {
 	
 	unsigned char done  :1;
 	         char binary :2;
+	/* segmented uploads: a segment sends only the bytes up to local_fsize.
+	 * trailing segments wait with their STOR until the leading one closes
+	 * the segment_go pipe, because its STOR may truncate the remote file */
+#define SEGMENT_NONE     0
+#define SEGMENT_LEADING  1
+#define SEGMENT_TRAILING 2
+	unsigned char segment :2;
+	int segment_go;
+
+	char * digest; /* sha-256 of the file sent, for the manifest */
 
 	struct fileinfo * directory;
 	struct ftp_session * next;
@@ -45,6 +55,7 @@ int long_do_cwd(_fsession * fsession);
 int try_do_cwd(ftp_con * ftp, char * path, int mkd);
 
 int do_send(_fsession * fsession);
+void set_resuming(_fsession * fsession);
 
 int fsession_process_file(_fsession * fsession, ftp_con * ftp);
 
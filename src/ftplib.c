@@ -19,6 +19,9 @@
 /* this file contains library procedures for the ftp-protocol */
 #include "ftplib.h"
 #include "utils.h"
+#include "checksum.h"
+#include "dircache.h"
+#include "resolve.h"
 #include <string.h>
 #ifndef WIN32
 #  include <netinet/in.h>
@@ -27,6 +30,10 @@
 #define ISDIGIT(x) ((x) >= '0' && (x) <= '9')
 #define FORCE_STR(x) ((x) ? (x) : "")
 
+static directory_list * ftp_current_directory(ftp_con * self);
+static char * ftp_directory_path(ftp_con * self, char * parent, char * name);
+static struct fileinfo * ftp_find_file(ftp_con * self, char * filename);
+
 /* =================================== *
  * ===== basic (de)constructors ====== *
  * =================================== */
@@ -54,15 +61,39 @@ void ftp_free_host(host_t * host) {
 	free(host);
 }
 
+/* forget about replies that have been read ahead */
+static void ftp_prefetch_clear(ftp_con * self) {
+	int i;
+	if(self->mlst_name) {
+		free(self->mlst_name);
+		self->mlst_name = NULL;
+	}
+	if(self->mlst) {
+		free(self->mlst->name);
+		free(self->mlst);
+		self->mlst = NULL;
+	}
+	for(i = 0; i < FTP_PREFETCH; i++)
+		if(self->prefetched[i].cmd) {
+			free(self->prefetched[i].cmd);
+			if(self->prefetched[i].reply) free(self->prefetched[i].reply);
+			self->prefetched[i].cmd   = NULL;
+			self->prefetched[i].reply = NULL;
+		}
+}
+
 void ftp_quit(ftp_con * self) {
 	ftp_free_host(self->host);
 	ftp_do_quit(self);
 	if(self->current_directory)  free(self->current_directory);
 	if(self->r.reply)            free(self->r.reply);
+	if(self->r.lines)            free(self->r.lines);
 	if(self->user)               free(self->user);
 	if(self->pass)               free(self->pass);
-	self->current_directory = self->r.reply = NULL;
+	self->current_directory = self->r.reply = self->r.lines = NULL;
 	free(self->sbuf);
+	if(self->qbuf)               free(self->qbuf);
+	ftp_prefetch_clear(self);
 	/* TODO IMP */
 	ftp_fileinfo_free(self);
 	free(self);
@@ -82,44 +113,66 @@ void ftp_quit(ftp_con * self) {
 	123 The last line
  * numbers must be padded and if other lines follow they do not need to start
  * with XXX-. the last line contains the code again and should be considered
- * relevant. the others are user-information printed on vNOMRAL (or vMORE?) */
-int ftp_get_msg(ftp_con * self) {
-	char * msg = socket_read_line(self->sock);
-	static int multi_line = 0;
+ * relevant. the others are user-information printed on vNOMRAL (or vMORE?)
+ * they are collected in r.lines for commands like FEAT that need them */
+static void ftp_add_reply_line(ftp_con * self, char * line, int * len, int * size) {
+	int add = strlen(line);
+	/* grow by doubling, so long replies (FEAT, STAT) are not copied per line */
+	if(*len + add + 2 > *size) {
+		while(*len + add + 2 > *size) *size = *size ? *size * 2 : 256;
+		self->r.lines = realloc(self->r.lines, *size);
+	}
+	memcpy(self->r.lines + *len, line, add);
+	*len += add;
+	self->r.lines[(*len)++] = '\n';
+	self->r.lines[*len] = 0;
+}
+static int ftp_read_reply(ftp_con * self) {
+	char * msg;
+	int multi_line = 0;
+	int len  = 0;
+	int size = 0;
 	if(self->r.reply) {
 		free(self->r.reply);
 		self->r.reply = NULL;
 	}
-	if(!msg) {
-		printout(vLESS, _("Receive-Error: Connection broke down.\n"));
-		return ERR_RECONNECT;
+	if(self->r.lines) {
+		free(self->r.lines);
+		self->r.lines = NULL;
 	}
-	if(msg == (char *) ERR_TIMEOUT)
-		return ERR_TIMEOUT;
-	if(strlen(msg) < 4 || !ISDIGIT(msg[0]) || !ISDIGIT(msg[1]) || !ISDIGIT(msg[2])) {
-		if(multi_line) {
-			printout(vMORE, "# %s\n", msg);
-			free(msg);
-			return ftp_get_msg(self);
+	while(1) {
+		msg = socket_read_line(self->sock);
+		if(!msg) {
+			printout(vLESS, _("Receive-Error: Connection broke down.\n"));
+			return ERR_RECONNECT;
 		}
-		printout(vLESS, _("Receive-Error: Invalid FTP-answer (%d bytes): %s\n"), strlen(msg), msg);
-		free(msg);
-		printout(vLESS, _("Reconnecting to be sure, nothing went wrong\n"));
-		return ERR_RECONNECT;
+		if(msg == (char *) ERR_TIMEOUT)
+			return ERR_TIMEOUT;
+		if(strlen(msg) < 4 || !ISDIGIT(msg[0]) || !ISDIGIT(msg[1]) || !ISDIGIT(msg[2])) {
+			if(multi_line) {
+				printout(vMORE, "# %s\n", msg);
+				ftp_add_reply_line(self, msg, &len, &size);
+				continue;
+			}
+			printout(vLESS, _("Receive-Error: Invalid FTP-answer (%d bytes): %s\n"), strlen(msg), msg);
+			printout(vLESS, _("Reconnecting to be sure, nothing went wrong\n"));
+			return ERR_RECONNECT;
+		}
+		if(msg[3] == '-') {
+			/* hyphened lines indicate that there is another reply line coming
+			 * print it out to anyone who is interested and go on walking */
+			multi_line = 1;
+			printout(vMORE, "# %s\n", msg+4);
+			ftp_add_reply_line(self, msg+4, &len, &size);
+			continue;
+		}
+		break;
 	}
-	if(msg[3] == '-') {
-		/* hyphened lines indicate that there is another reply line coming
-		 * print it out to anyone who is interested and go on walking */
-		multi_line = 1;
-		printout(vMORE, "# %s\n", msg+4);
-		free(msg);
-		return ftp_get_msg(self);
-	}
-	multi_line = 0;
-	msg[3] = 0;
-	self->r.code    = atoi(msg);
-	self->r.reply   = msg;
-	self->r.message = msg+4;
+	/* the line is overwritten by the next read, so keep a copy */
+	self->r.reply   = cpy(msg);
+	self->r.reply[3] = 0;
+	self->r.code    = atoi(self->r.reply);
+	self->r.message = self->r.reply + 4;
 	printout(vDEBUG, "[%d] '%s'\n", self->r.code, self->r.message);
 
 	/* check errors that may occur to every process and return a specific error number */
@@ -145,15 +198,39 @@ int ftp_get_msg(ftp_con * self) {
 	return 0;
 }
 
-/* puts the string in self->sbuf into the socket. */
+/* the replies to deferred commands (see ftp_do_chmod()) come first */
+int ftp_get_msg(ftp_con * self) {
+	int res;
+	while(self->deferred) {
+		self->deferred--;
+		res = ftp_read_reply(self);
+		if(SOCK_ERROR(res)) {
+			self->deferred = 0;
+			return res;
+		}
+		if(res != 0)
+			printout(vMORE, _("A deferred command failed (%s).\n"), self->r.message);
+	}
+	return ftp_read_reply(self);
+}
+
+/* puts the string in self->sbuf into the socket, together with the
+ * commands queued before */
 void ftp_send_msg(ftp_con * self) {
+	int len = strlen(self->sbuf);
 	if(strncmp(self->sbuf, "PASS", 4) != 0)
 		printout(vDEBUG, "---->%s", self->sbuf);
-	socket_write(self->sock, self->sbuf, strlen(self->sbuf));
+	if(self->qlen) {
+		self->qbuf = realloc(self->qbuf, self->qlen + len);
+		memcpy(self->qbuf + self->qlen, self->sbuf, len);
+		socket_write(self->sock, self->qbuf, self->qlen + len);
+		self->qlen = 0;
+	} else
+		socket_write(self->sock, self->sbuf, len);
 }
 
-/* sends a command to the server. */
-void ftp_issue_cmd(ftp_con * self, char * cmd, char * value) {
+/* write a command-line into self->sbuf */
+static void ftp_format_cmd(ftp_con * self, char * cmd, char * value) {
 	int len = strlen(cmd)
 		+ ((value) ? strlen(value) + 1 : 0) /* value + space */ 
 		+ 2  /* \r\n */ 
@@ -174,10 +251,111 @@ void ftp_issue_cmd(ftp_con * self, char * cmd, char * value) {
 		strcpy(self->sbuf+pos+1, value);
 	}
 	strncpy(self->sbuf+strlen(self->sbuf), "\r\n\0", 3);
-	
+}
+
+/* sends a command to the server. */
+void ftp_issue_cmd(ftp_con * self, char * cmd, char * value) {
+	ftp_format_cmd(self, cmd, value);
+	ftp_prefetch_clear(self);
 	ftp_send_msg(self);
 }
 
+/* queue a command to be sent in one go with the next ftp_issue_cmd() */
+void ftp_queue_cmd(ftp_con * self, char * cmd, char * value) {
+	int len;
+	ftp_format_cmd(self, cmd, value);
+	len = strlen(self->sbuf);
+	printout(vDEBUG, "(queued)%s", self->sbuf);
+	self->qbuf = realloc(self->qbuf, self->qlen + len);
+	memcpy(self->qbuf + self->qlen, self->sbuf, len);
+	self->qlen += len;
+}
+
+/* issue a command and read the reply, unless the command has already been
+ * sent by ftp_pipeline_stat() */
+/* error-levels: get_msg() */
+int ftp_do_cmd(ftp_con * self, char * cmd, char * value) {
+	ftp_prefetched * P;
+	int i;
+	
+	for(i = 0; i < FTP_PREFETCH; i++) {
+		P = &self->prefetched[i];
+		if(P->cmd && !strncmp(P->cmd, cmd, strlen(cmd)) && P->cmd[strlen(cmd)] == ' '
+		   && !strcmp(P->cmd + strlen(cmd) + 1, value)) {
+			if(self->r.reply) free(self->r.reply);
+			self->r.reply   = P->reply;
+			self->r.message = P->reply + 4;
+			self->r.code    = P->code;
+			free(P->cmd);
+			P->cmd   = NULL;
+			P->reply = NULL;
+			printout(vDEBUG, "[%d] '%s' (pipelined)\n", self->r.code, self->r.message);
+			return P->res;
+		}
+	}
+	ftp_issue_cmd(self, cmd, value);
+	return ftp_get_msg(self);
+}
+
+/* send TYPE, SIZE and MDTM (if whished) at once and keep the replies for
+ * ftp_set_type(), ftp_do_size() and ftp_get_modification_time(). a server
+ * that mixes up the replies disables pipelining for the rest of the run */
+/* error-levels: get_msg() */
+int ftp_pipeline_stat(ftp_con * self, int type, char * filename, int mdtm) {
+	static char * types[] = {"A", "I"};
+	char * cmds[FTP_PREFETCH];
+	char * args[FTP_PREFETCH];
+	unsigned short int expect[FTP_PREFETCH];
+	int n = 0;
+	int i;
+	int res;
+	
+	if(!opt.pipeline || ftp_has_directory_list(self)) return 0;
+	/* --prefetch-listing answers these with MLST or MLSD */
+	if(opt.prefetch_listing && (self->features & FEAT_MLST)) return 0;
+	if(self->current_type != type && type != TYPE_UNDEFINED) {
+		cmds[n] = "TYPE"; args[n] = types[type]; expect[n++] = 200;
+	}
+	cmds[n] = "SIZE"; args[n] = filename; expect[n++] = 213;
+	if(mdtm) {
+		cmds[n] = "MDTM"; args[n] = filename; expect[n++] = 213;
+	}
+	if(n < 2) return 0;
+	
+	printout(vDEBUG, "pipelining %d commands\n", n);
+	for(i = 0; i < n - 1; i++)
+		ftp_queue_cmd(self, cmds[i], args[i]);
+	ftp_issue_cmd(self, cmds[n - 1], args[n - 1]);
+	
+	for(i = 0; i < n; i++) {
+		res = ftp_get_msg(self);
+		if(res == ERR_TIMEOUT) {
+			printout(vLESS, _("No reply to pipelined commands. Disabling pipelining.\n"));
+			opt.pipeline = 0;
+		}
+		if(SOCK_ERROR(res)) {
+			ftp_prefetch_clear(self);
+			return res;
+		}
+		/* anything but the expected reply or an error means, that the
+		 * replies are not in the order of the commands */
+		if(self->r.code != expect[i] && self->r.reply[0] != '4' && self->r.reply[0] != '5') {
+			printout(vLESS, _("Unexpected reply to pipelined %s (%d %s). Disabling pipelining.\n"),
+				cmds[i], self->r.code, self->r.message);
+			opt.pipeline = 0;
+			ftp_prefetch_clear(self);
+			return ERR_RECONNECT;
+		}
+		self->prefetched[i].cmd = malloc(strlen(cmds[i]) + strlen(args[i]) + 2);
+		sprintf(self->prefetched[i].cmd, "%s %s", cmds[i], args[i]);
+		self->prefetched[i].reply = self->r.reply;
+		self->prefetched[i].code  = self->r.code;
+		self->prefetched[i].res   = res;
+		self->r.reply = NULL;
+	}
+	return 0;
+}
+
 /* =================================== *
  * ========== api-routines =========== *
  * =================================== */
@@ -194,8 +372,14 @@ int ftp_connect(ftp_con * self, proxy_settings * ps) {
 	
 	if(ps->type != PROXY_OFF)
 		self->sock = proxy_connect(ps, self->host->ip, self->host->port, self->host->hostname);
-	else
-		self->sock = socket_connect(self->host->ip, self->host->port);
+	else {
+		/* all addresses of the host race, see socket_timeout_connect() */
+		wput_addr   A[2 * RESOLVE_MAXADDR];
+		signed char status[2 * RESOLVE_MAXADDR];
+		int n = resolve_candidates(self->host->ip, self->host->hostname, A);
+		self->sock = socket_connect_addrs(A, n, self->host->port, status);
+		resolve_report(A, n, status);
+	}
 	
 	if(!self->sock) {
 		printout(vNORMAL, _("failed!\n"));
@@ -224,6 +408,12 @@ int ftp_connect(ftp_con * self, proxy_settings * ps) {
 	self->needcwd      = 1;
 	self->OS           = ST_UNDEFINED;
 	self->current_type = TYPE_UNDEFINED;
+	self->mode         = 'S';
+	self->datakept     = 0;
+	self->qlen         = 0;
+	self->deferred     = 0;
+	self->dir_lookups  = 0;
+	ftp_prefetch_clear(self);
 	self->ps           = ps; /* proxy_settings for data-connections */
 	
 #ifdef HAVE_SSL
@@ -253,6 +443,8 @@ int ftp_login(ftp_con * self, char * user, char * pass){
 		
 	printout(vNORMAL, _("Logging in as %s ... "), user);
 	
+	/* USER resets the session, the prepared data-connection included */
+	ftp_drop_prepared(self);
 	ftp_issue_cmd(self, "USER", user);
 	res = ftp_get_msg(self);
 	if(SOCK_ERROR(res)) return res;
@@ -304,7 +496,7 @@ int ftp_auth_tls(ftp_con * self) {
 	ftp_issue_cmd(self, "AUTH TLS", 0);
 	res = ftp_get_msg(self);
 	if(self->r.code == 234)
-		res = socket_transform_to_ssl(self->sock);
+		res = socket_transform_to_ssl(self->sock, NULL);
 	if(res < 0) printout(vMORE, _("failed (%s).\n"), self->r.message);
 	else        printout(vNORMAL, _("encrypted!"));
 	return res;
@@ -369,6 +561,58 @@ int ftp_do_syst(ftp_con * self) {
 	return 0;
 }
 
+/* ask the server which extensions it supports. the result is kept in
+ * self->features, so FEAT is issued only once per connection */
+/* error-levels: SOCK_ERRORs */
+int ftp_do_feat(ftp_con * self) {
+	static struct { char * name; unsigned int flag; } feats[] = {
+		{"REST STREAM", FEAT_REST_STREAM},
+		{"SIZE",        FEAT_SIZE},
+		{"MDTM",        FEAT_MDTM},
+		{"MODE Z",      FEAT_MODE_Z},
+		{"XCRC",        FEAT_XCRC},
+		{"XMD5",        FEAT_XMD5},
+		{"XSHA1",       FEAT_XSHA1},
+		{"RANG STREAM", FEAT_RANG},
+		{"MLST",        FEAT_MLST},
+		{"EPSV",        FEAT_EPSV},
+		{NULL, 0}
+	};
+	char * line;
+	char * next;
+	int res;
+	int i;
+
+	if(self->features & FEAT_KNOWN) return 0;
+
+	printout(vMORE, "==> FEAT ... ");
+	ftp_issue_cmd(self, "FEAT", 0);
+	res = ftp_get_msg(self);
+	if(SOCK_ERROR(res)) return res;
+
+	self->features   = FEAT_KNOWN;
+	self->hash_algos = 0;
+	if(self->r.code != 211 || !self->r.lines) {
+		printout(vMORE, _("failed.\n"));
+		return 0;
+	}
+	for(line = self->r.lines; *line; line = next) {
+		next = strchr(line, '\n');
+		*next++ = 0;
+		while(*line == ' ') line++;
+		for(i = 0; feats[i].name; i++)
+			if(!strncasecmp(line, feats[i].name, strlen(feats[i].name)))
+				self->features |= feats[i].flag;
+		/* e.g. HASH SHA-256;SHA-1*;MD5;CRC32 */
+		if(!strncasecmp(line, "HASH ", 5))
+			for(i = 1; i <= HASH_SHA256; i <<= 1)
+				if(strstr(line, checksum_name(i)))
+					self->hash_algos |= i;
+	}
+	printout(vMORE, _("done.\n"));
+	return 0;
+}
+
 /* send an ABOR command and clear the data-socket */
 int ftp_do_abor(ftp_con * self) {
 	int res;
@@ -386,9 +630,18 @@ int ftp_do_abor(ftp_con * self) {
 		printout(vNORMAL, _("Connection cancelled (%s)\n"), self->r.message);
 		res = ftp_get_msg(self);
 	}
-	if(self->datasock)
-		socket_close(self->datasock),
-		self->datasock = 0;
+	ftp_close_data(self);
+	return res;
+}
+
+/* send a NOOP to keep an idle connection alive. returns 0 if the
+ * server answered */
+int ftp_do_noop(ftp_con * self) {
+	int res;
+	printout(vDEBUG, "==> NOOP ... ");
+	ftp_issue_cmd(self, "NOOP", 0);
+	res = ftp_get_msg(self);
+	printout(vDEBUG, res == 0 ? _("done.\n") : _("failed.\n"));
 	return res;
 }
 
@@ -404,11 +657,138 @@ void ftp_do_quit(ftp_con * self){
 		* recognize us leaving */
 		ftp_get_msg(self);
 	}
+	ftp_drop_prepared(self);
+	ftp_close_data(self);
 	if(self->sock)     socket_close(self->sock);
-	if(self->datasock) socket_close(self->datasock);
 	self->sock     = NULL;
-	self->datasock = NULL;
 }
+/* the time-format of MDTM and MLSx: YYYYMMDDHHMMSS[.sss] */
+static int ftp_parse_time(const char * s, struct tm * ts) {
+	int i;
+	for(i = 0; i < 14; i++)
+		if(!ISDIGIT(s[i])) return ERR_FAILED;
+	memset(ts, 0, sizeof(struct tm));
+	sscanf(s, "%4d%2d%2d%2d%2d%2d", &ts->tm_year, &ts->tm_mon, &ts->tm_mday,
+		&ts->tm_hour, &ts->tm_min, &ts->tm_sec);
+	ts->tm_year -= 1900;
+	ts->tm_mon  -= 1; /* decrement month, to have it zerobased */
+	ts->tm_isdst = -1;
+	return 0;
+}
+
+/* parse an entry of MLSD or MLST ("fact=value;fact=value; name").
+ * returns NULL for the entries of the directory itself and its parent */
+static struct fileinfo * ftp_parse_facts(char * line) {
+	struct fileinfo * F;
+	struct tm ts;
+	char * name = strchr(line, ' ');
+	char * fact;
+	char * next;
+
+	if(!name || !name[1]) return NULL;
+	*name++ = 0;
+	F = malloc(sizeof(struct fileinfo));
+	memset(F, 0, sizeof(struct fileinfo));
+	F->type   = FT_UNKNOWN;
+	F->tstamp = -1;
+	F->perms  = 0644;
+	for(fact = line; *fact; fact = next) {
+		if((next = strchr(fact, ';'))) *next++ = 0;
+		else next = fact + strlen(fact);
+		if(!strncasecmp(fact, "type=", 5)) {
+			if(!strcasecmp(fact + 5, "file"))
+				F->type = FT_PLAINFILE;
+			else if(!strcasecmp(fact + 5, "dir"))
+				F->type = FT_DIRECTORY;
+			else if(!strcasecmp(fact + 5, "cdir") || !strcasecmp(fact + 5, "pdir")) {
+				free(F);
+				return NULL;
+			} else if(!strncasecmp(fact + 5, "OS.unix=slink", 13))
+				F->type = FT_SYMLINK;
+		} else if(!strncasecmp(fact, "size=", 5))
+			F->size = strtoll(fact + 5, NULL, 10);
+		else if(!strncasecmp(fact, "modify=", 7) && ftp_parse_time(fact + 7, &ts) == 0)
+			F->tstamp = mktime(&ts);
+		else if(!strncasecmp(fact, "UNIX.mode=", 10))
+			F->perms = strtol(fact + 10, NULL, 8);
+	}
+	F->name = cpy(name);
+	return F;
+}
+
+/* parse a MLSD-listing line by line, as it arrives */
+static void ftp_parse_mlsd(void) {
+	struct fileinfo * F;
+	char * line;
+	size_t len;
+
+	while((line = read_whole_line(NULL))) {
+		len = strlen(line);
+		if(len && line[len - 1] == '\r') line[len - 1] = 0;
+		if(!(F = ftp_parse_facts(line))) continue;
+		ls_store(F);
+		free(F);
+	}
+}
+
+/* look up a single file with MLST. the facts are kept for
+ * ftp_get_filesize() and ftp_get_modification_time() */
+/* error-levels: ERR_FAILED (file not found), ERR_PERMANENT, get_msg() */
+int ftp_do_mlst(ftp_con * self, char * filename) {
+	char * line;
+	int res;
+
+	printout(vMORE, "==> MLST %s ... ", filename);
+	ftp_issue_cmd(self, "MLST", filename);
+	res = ftp_get_msg(self);
+	if(SOCK_ERROR(res)) return res;
+	
+	if(self->r.code == 550) {
+		printout(vMORE, _("failed (no such file).\n"));
+		self->mlst_name = cpy(filename);
+		return ERR_FAILED;
+	}
+	/* the facts are on a line of their own, starting with a space */
+	line = self->r.lines;
+	while(line && *line != ' ' && (line = strchr(line, '\n')))
+		line++;
+	if(self->r.code != 250 || !line || *line != ' ') {
+		printout(vMORE, _("failed.\n"));
+		return ERR_PERMANENT;
+	}
+	line = cpy(line + 1);
+	line[strcspn(line, "\r\n")] = 0;
+	self->mlst = ftp_parse_facts(line);
+	free(line);
+	if(!self->mlst) {
+		printout(vMORE, _("failed.\n"));
+		return ERR_PERMANENT;
+	}
+	self->mlst_name = cpy(filename);
+	printout(vMORE, _("done (%l bytes)\n"), self->mlst->size);
+	return 0;
+}
+
+/* with --prefetch-listing, the first file of a directory is looked up with
+ * MLST. as soon as there is a second one, the whole directory is read with
+ * MLSD, so the rest can be answered from memory */
+/* error-levels: get_msg() */
+static int ftp_prefetch_listing(ftp_con * self, char * filename) {
+	int res;
+	
+	res = ftp_do_feat(self);
+	if(SOCK_ERROR(res)) return res;
+	if(!(self->features & FEAT_MLST)) return 0;
+	
+	if(self->dir_lookups++ == 0) {
+		res = ftp_do_mlst(self, filename);
+		if(res == ERR_PERMANENT)
+			self->features &= ~FEAT_MLST;
+	} else
+		res = ftp_get_list(self);
+	return SOCK_ERROR(res) ? res : 0;
+}
+
 /* issues the mdtm command and reads the modification time of the file. the
  * epoch timestamp is stored in *timestamp */
 /* i allways have to search hours until i find the document. save time:
@@ -417,32 +797,23 @@ void ftp_do_quit(ftp_con * self){
 int ftp_get_modification_time(ftp_con * self, char * filename, time_t * timestamp) {
 	int res;
 	struct fileinfo * finfo = NULL;
-	struct fileinfo * dl = ftp_get_current_directory_list(self);
 	struct tm ts;
+	
+	/* the facts of a previous MLST */
+	if(self->mlst_name && !strcmp(self->mlst_name, filename)) {
+		if(!self->mlst || self->mlst->tstamp == -1) return ERR_FAILED;
+		*timestamp = self->mlst->tstamp;
+		return 0;
+	}
 	/* if we already have a directory-listing, we can obtain the modification
 	 * time from there, otherwise it is better to use the MDTM command if avail-
 	 * able */
-	/* TODO NRV this is less efficient if the modification time has to be checked
-	 * TODO NRV for a huge amount of files of the same directory */
-	if(!dl) {
+	if(!ftp_has_directory_list(self)) {
 		printout(vMORE, "==> MDTM %s ... ", filename);
-		ftp_issue_cmd(self, "MDTM", filename);
-		res = ftp_get_msg(self);
+		res = ftp_do_cmd(self, "MDTM", filename);
 		if(SOCK_ERROR(res)) return res;
 		/* if the file does not exist remotely, this is ok for us */
-		if(self->r.code == 213) {
-			//JJJJMMDDHHMMSS
-#define MDTM_AT(x) atoi(self->r.message+x); self->r.message[x] = 0
-			ts.tm_sec   = MDTM_AT(12);
-			ts.tm_min   = MDTM_AT(10);
-			ts.tm_hour  = MDTM_AT( 8);
-			ts.tm_mday  = MDTM_AT( 6);
-			ts.tm_mon   = MDTM_AT( 4);
-			ts.tm_year  = atoi(self->r.message) - 1900;
-			ts.tm_wday  = 0;
-			ts.tm_yday  = 0;
-			ts.tm_isdst = -1;
-			ts.tm_mon  -= 1; /* decrement month, to have it zerobased */
+		if(self->r.code == 213 && ftp_parse_time(self->r.message, &ts) == 0) {
 			/* TODO USS l10n */
 			printout(vMORE, _("done (modified on %d.%d.%d at %d:%d:%d)\n"), ts.tm_mday, 
 				ts.tm_mon+1, ts.tm_year+1900, ts.tm_hour, ts.tm_min, ts.tm_sec);
@@ -454,10 +825,9 @@ int ftp_get_modification_time(ftp_con * self, char * filename, time_t * timestam
 			return ERR_FAILED;
 		res = ftp_get_list(self);
 		if(SOCK_ERROR(res) || res == ERR_FAILED) return res;
-		dl = ftp_get_current_directory_list(self);
 	}
-	if(dl) finfo = fileinfo_find_file(dl, filename);
-	if(!finfo) return ERR_FAILED;
+	finfo = ftp_find_file(self, filename);
+	if(!finfo || finfo->tstamp == -1) return ERR_FAILED;
 	*timestamp = finfo->tstamp;
 	return 0;
 }
@@ -468,47 +838,151 @@ int ftp_get_modification_time(ftp_con * self, char * filename, time_t * timestam
 int ftp_get_filesize(ftp_con * self, char * filename, off_t * filesize){
 	int res;
 	struct fileinfo * finfo = NULL;
-	struct fileinfo * dl    = ftp_get_current_directory_list(self);
 
-	if(!dl) {
-		printout(vMORE, "==> SIZE %s ... ", filename);
-		ftp_issue_cmd(self, "SIZE", filename);
-		res = ftp_get_msg(self);
+	if(opt.prefetch_listing && !ftp_has_directory_list(self)) {
+		res = ftp_prefetch_listing(self, filename);
 		if(SOCK_ERROR(res)) return res;
-		
-		/* TODO USS there might be other codes for 'file not found' */
-		if(self->r.code == 213) {
-			printout(vMORE, _("done (%s bytes)\n"), self->r.message);
-			*filesize = strtoll(self->r.message, NULL, 10);
-			return 0;
-		}
-		printout(vMORE, _("failed.\n"));
-		if(self->r.code == 550)
-			return ERR_FAILED;
+	}
+	if(self->mlst_name && !strcmp(self->mlst_name, filename)) {
+		if(!self->mlst) return ERR_FAILED;
+		*filesize = self->mlst->size;
+		return 0;
+	}
+	
+	if(!ftp_has_directory_list(self)) {
+		res = ftp_do_size(self, filename, filesize);
+		if(res != ERR_PERMANENT) return res;
 		
 		/* otherwise try LIST method */
 		res = ftp_get_list(self);
 		if(SOCK_ERROR(res) || res == ERR_FAILED) return res;
-		dl = ftp_get_current_directory_list(self);
 	}
-	if(dl) finfo = fileinfo_find_file(dl, filename);
+	finfo = ftp_find_file(self, filename);
 	if(!finfo) return ERR_FAILED;
 	*filesize = finfo->size;
 	return 0;
 }
 
+/* issue the SIZE command, regardless of any cached directory-listing */
+/* error-levels: ERR_FAILED (file not found), ERR_PERMANENT (SIZE not
+ * available), ERR_TIMEOUT, ERR_RECONNECT */
+int ftp_do_size(ftp_con * self, char * filename, off_t * filesize) {
+	int res;
+	printout(vMORE, "==> SIZE %s ... ", filename);
+	res = ftp_do_cmd(self, "SIZE", filename);
+	if(SOCK_ERROR(res)) return res;
+	
+	/* TODO USS there might be other codes for 'file not found' */
+	if(self->r.code == 213) {
+		printout(vMORE, _("done (%s bytes)\n"), self->r.message);
+		*filesize = strtoll(self->r.message, NULL, 10);
+		return 0;
+	}
+	printout(vMORE, _("failed.\n"));
+	if(self->r.code == 550)
+		return ERR_FAILED;
+	return ERR_PERMANENT;
+}
+
+/* the checksum-algorithms the server is able to compute for us.
+ * ranged: only those that can be restricted to a part of the file */
+unsigned int ftp_hash_algos(ftp_con * self, int ranged) {
+	unsigned int algos = 0;
+	if(!ranged || (self->features & FEAT_RANG))
+		algos = self->hash_algos;
+	if(self->features & FEAT_XCRC)  algos |= HASH_CRC32;
+	if(ranged) return algos;
+	if(self->features & FEAT_XMD5)  algos |= HASH_MD5;
+	if(self->features & FEAT_XSHA1) algos |= HASH_SHA1;
+	return algos;
+}
+
+/* ask the server for the checksum of a file, or of the bytes [from, to) if
+ * to is not -1. HASH (with RANG) is preferred, the X-commands are the older,
+ * non-standard way. *hex has to be freed */
+/* error-levels: ERR_FAILED, get_msg() */
+int ftp_do_hash(ftp_con * self, char * filename, unsigned int algo, off_t from, off_t to, char ** hex) {
+	char   arg[64];
+	char * p;
+	char * cmd;
+	int res;
+	
+	if(self->hash_algos & algo) {
+		snprintf(arg, sizeof(arg), "HASH %s", checksum_name(algo));
+		printout(vMORE, "==> OPTS %s ... ", arg);
+		ftp_issue_cmd(self, "OPTS", arg);
+		res = ftp_get_msg(self);
+		if(SOCK_ERROR(res)) return res;
+		if(self->r.code != 200) {
+			printout(vMORE, _("failed.\n"));
+			return ERR_FAILED;
+		}
+		printout(vMORE, _("done.\n"));
+		/* the end-point of RANG is inclusive. it applies to the next command only */
+		if(to != -1) {
+			snprintf(arg, sizeof(arg), "%lld %lld", (long long) from, (long long) to - 1);
+			printout(vMORE, "==> RANG %s ... ", arg);
+			ftp_issue_cmd(self, "RANG", arg);
+			res = ftp_get_msg(self);
+			if(SOCK_ERROR(res)) return res;
+			if(self->r.code != 350) {
+				printout(vMORE, _("failed.\n"));
+				return ERR_FAILED;
+			}
+			printout(vMORE, _("done.\n"));
+		}
+		cmd = "HASH";
+	} else
+		cmd = algo == HASH_CRC32 ? "XCRC" : algo == HASH_MD5 ? "XMD5" : "XSHA1";
+	
+	if(to != -1 && strcmp(cmd, "HASH")) {
+		/* XCRC <file> <start> <end> */
+		p = malloc(strlen(filename) + 44);
+		sprintf(p, "%s %lld %lld", filename, (long long) from, (long long) to);
+	} else
+		p = cpy(filename);
+	printout(vMORE, "==> %s %s ... ", cmd, p);
+	ftp_issue_cmd(self, cmd, p);
+	free(p);
+	res = ftp_get_msg(self);
+	if(SOCK_ERROR(res)) return res;
+	if(self->r.code != 213 && self->r.code != 250) {
+		printout(vMORE, _("failed.\n"));
+		return ERR_FAILED;
+	}
+	
+	/* 213 <algo> <start>-<end> <hash> <file> for HASH, 250 <hash> otherwise */
+	p = self->r.message;
+	if(!strcmp(cmd, "HASH")) {
+		long long start = 0, end = 0;
+		p = strchr(p, ' ');
+		/* make sure that the server hashed what we asked for */
+		if(p && to != -1 && (sscanf(p, " %lld-%lld", &start, &end) != 2
+				|| start != from || end != to - 1))
+			p = NULL;
+		if(p) p = strchr(p + 1, ' ');
+		if(p) p++;
+	}
+	if(!p || !*p) {
+		printout(vMORE, _("failed.\n"));
+		return ERR_FAILED;
+	}
+	*hex = cpy(p);
+	if((p = strchr(*hex, ' '))) *p = 0;
+	printout(vMORE, _("done (%s).\n"), *hex);
+	return 0;
+}
+
 /* get the fileinfo of a directory entry */
 int ftp_get_fileinfo(ftp_con * self, char * filename, struct fileinfo ** info) {
 	int res;
 	struct fileinfo * finfo = NULL;
-	struct fileinfo * dl    = ftp_get_current_directory_list(self);
 
-	if(!dl) {
+	if(!ftp_has_directory_list(self)) {
 		res = ftp_get_list(self);
 		if(SOCK_ERROR(res) || res == ERR_FAILED) return res;
-		dl = ftp_get_current_directory_list(self);
 	}
-	if(dl) finfo = fileinfo_find_file(dl, filename);
+	finfo = ftp_find_file(self, filename);
 	if(!finfo) return ERR_FAILED;
 	*info = finfo;
 	return 0;
@@ -524,8 +998,7 @@ int ftp_set_type(ftp_con * self, int type) {
 	if(self->current_type == type) return 0;
 	
 	printout(vMORE, "==> TYPE %s ... ", types[type]);
-	ftp_issue_cmd(self, "TYPE", types[type]);
-	res = ftp_get_msg(self);
+	res = ftp_do_cmd(self, "TYPE", types[type]);
 	
 	if(self->r.code == 200) {
 		printout(vMORE, _("done.\n"));
@@ -536,6 +1009,49 @@ int ftp_set_type(ftp_con * self, int type) {
 	return res;
 }
 
+/* switch the transfer-mode to S(tream), B(lock) or Z (compressed with the
+ * given level). a server that does not know block mode is asked for MODE S
+ * instead and not bothered with MODE B again */
+/* error-levels: ERR_FAILED, get_msg() */
+int ftp_set_mode(ftp_con * self, char mode, int level) {
+	char lvl[20];
+	char arg[2];
+	int res;
+	
+	if(mode == 'B' && self->no_mode_b) mode = 'S';
+	if(self->mode == mode) return 0;
+	
+	/* the data-connection of block mode is not of use in any other */
+	ftp_close_data(self);
+	
+	arg[0] = mode;
+	arg[1] = 0;
+	printout(vMORE, "==> MODE %s ... ", arg);
+	ftp_issue_cmd(self, "MODE", arg);
+	res = ftp_get_msg(self);
+	if(SOCK_ERROR(res)) return res;
+	if(self->r.code != 200) {
+		printout(vMORE, _("failed.\n"));
+		if(mode == 'B') {
+			self->no_mode_b = 1;
+			return ftp_set_mode(self, 'S', 0);
+		}
+		return ERR_FAILED;
+	}
+	printout(vMORE, _("done.\n"));
+	self->mode = mode;
+	if(mode != 'Z') return 0;
+	
+	/* the level is just a wish, so a refusal does not matter */
+	snprintf(lvl, sizeof(lvl), "MODE Z LEVEL %d", level);
+	printout(vMORE, "==> OPTS %s ... ", lvl);
+	ftp_issue_cmd(self, "OPTS", lvl);
+	res = ftp_get_msg(self);
+	if(SOCK_ERROR(res)) return res;
+	printout(vMORE, self->r.code == 200 ? _("done.\n") : _("failed.\n"));
+	return 0;
+}
+
 int ftp_do_cwd(ftp_con * self, char * directory) {
 	int res;
 	
@@ -554,6 +1070,7 @@ int ftp_do_cwd(ftp_con * self, char * directory) {
 		return ERR_FAILED;
 	}
 	printout(vMORE, "\n");
+	self->dir_lookups = 0;
 	return 0;
 }
 int ftp_do_mkd(ftp_con * self, char * directory) {
@@ -575,15 +1092,15 @@ int ftp_do_mkd(ftp_con * self, char * directory) {
 }
 /* ask for directory-listing.
  * error-levels: ERR_RECONNECT, ERR_FAILED */
-int ftp_do_list(ftp_con * self) {
+int ftp_do_list(ftp_con * self, char * cmd) {
 	int res;
 	/* ascii mode is a good idea, esp for listings */
 	res = ftp_set_type(self, TYPE_A);
 	if(SOCK_ERROR(res))
 		return ERR_RECONNECT;
 	
-	printout(vMORE, "==> LIST ... ");
-	ftp_issue_cmd(self, "LIST", NULL);
+	printout(vMORE, "==> %s ... ", cmd);
+	ftp_issue_cmd(self, cmd, NULL);
 	res = ftp_get_msg(self);
 	if(SOCK_ERROR(res))
 		return ERR_RECONNECT;
@@ -634,6 +1151,15 @@ int ftp_do_chmod(ftp_con * self, char * lfile, char * rfile) {
 	strcat(value, " ");
 	strcat(value, rfile);
 	free(mode);
+	/* nothing depends on the outcome, so the reply is read along with the
+	 * one of the next command */
+	if(opt.pipeline) {
+		ftp_queue_cmd(self, "SITE CHMOD", value);
+		free(value);
+		self->deferred++;
+		printout(vMORE, _(" deferred.\n"));
+		return 0;
+	}
 	ftp_issue_cmd(self, "SITE CHMOD", value);
 	free(value);
 	res = ftp_get_msg(self);
@@ -648,22 +1174,62 @@ int ftp_do_chmod(ftp_con * self, char * lfile, char * rfile) {
 	return 0;
 }
 
-/* Global (hence stable) pseudo file pointer for Wget ftp_parse_ls(). */
-char *ls_next;
+/* the listing is parsed while it arrives, so only the line that is being
+ * parsed needs to be in memory. read_whole_line() and nextchr() hand the
+ * lines of the data-connection to the parsers of ftp-ls.c, which give
+ * each entry to ls_store() */
+#define LS_BUFSIZE 16384
+static struct {
+	ftp_con        * ftp;
+	directory_list * dir;
+	char           * buf;
+	int              size;
+	int              start;  /* the unparsed data is buf[start..end) */
+	int              end;
+	int              scan;   /* no newline up to here */
+	int              res;    /* of the last socket_read(), 0 while reading */
+} ls;
+
+/* read the next piece of the listing. returns 0 at the end of it */
+static int ls_fill(void) {
+	int res;
+
+	if(ls.res) return 0;
+	if(ls.start) {
+		memmove(ls.buf, ls.buf + ls.start, ls.end - ls.start);
+		ls.end  -= ls.start;
+		ls.scan -= ls.start;
+		ls.start = 0;
+	}
+	/* a line that does not fit into the buffer */
+	if(ls.end + 1 >= ls.size) {
+		ls.size *= 2;
+		ls.buf   = realloc(ls.buf, ls.size);
+	}
+	res = socket_read(ls.ftp->datasock, ls.buf + ls.end, ls.size - ls.end - 1);
+	if(res <= 0) {
+		ls.res = res;
+		return 0;
+	}
+	ls.end += res;
+	return 1;
+}
 
 /* retrieve a LIST of the current directory */
 /* error-levels: ERR_FAILED, get_msg() */
 int ftp_get_list(ftp_con * self) {
 	int res;
-	int size = 1;
-	char * list;
-	char rbuf[1024];
-	struct fileinfo * listing;
+	int mlsd;
+	char * path = FORCE_STR(self->current_directory);
 
 	/* retrieve the remote system if not done yet */
 	res = ftp_do_syst(self);
 	if(res < 0) return res;
 	
+	/* the listing is read as a plain stream */
+	res = ftp_set_mode(self, 'S', 0);
+	if(SOCK_ERROR(res)) return res;
+	
 	res = ftp_establish_data_connection(self);
 	if(res < 0) {
 		printout(vLESS, _("Error: "));
@@ -672,26 +1238,38 @@ int ftp_get_list(ftp_con * self) {
 		return res;
 	}
 	
-	res = ftp_do_list(self);
+	/* MLSD is much easier to parse and has got the times in UTC */
+	mlsd = (self->features & FEAT_MLST) != 0;
+	res = ftp_do_list(self, mlsd ? "MLSD" : "LIST");
 	if(res < 0) return res;
 	
-	/* start buffer-size. is being reallocated as soon as data arrives.
-	 * ugly but works */
-	list = malloc(1);
-	list[0] = 0;
+	/* parse the listing straight into the cache of known directories */
+	if(!self->dirs) self->dirs = dircache_new();
+	memset(&ls, 0, sizeof(ls));
+	ls.ftp  = self;
+	ls.dir  = dircache_begin(self->dirs, path);
+	ls.size = LS_BUFSIZE;
+	ls.buf  = malloc(ls.size);
+	printout(vDEBUG, "Directory-Listing:\n");
+	if(mlsd)
+		ftp_parse_mlsd();
+	else
+		ftp_parse_ls("LIST", self->OS);
+	/* the parsers might stop early (e.g. at a blank line) */
+	while(read_whole_line(NULL)) ;
+	printout(vDEBUG, "-----\n");
+	free(ls.buf);
+	res = ls.res == ERR_FAILED ? 0 : ls.res;
+	memset(&ls, 0, sizeof(ls));
 	
-	/* until the socket is done, add everything to the list-buffer */
-	while( (res = socket_read(self->datasock, rbuf, 1024-1)) > 0) {
-		rbuf[res] = 0;
-		size += res;
-		list = realloc(list, size);
-		strcat(list, rbuf);
-	}
 	/* make sure the socket gets closed correctly. */
 	/* TODO NRV need to check error-level here too? */
 	if(res == ERR_TIMEOUT) {
 		res = ftp_do_abor(self);
-		if(SOCK_ERROR(res)) return ERR_RECONNECT;
+		if(SOCK_ERROR(res)) {
+			dircache_drop(self->dirs, path);
+			return ERR_RECONNECT;
+		}
 	}
 	
 	if(self->datasock) {
@@ -710,21 +1288,14 @@ int ftp_get_list(ftp_con * self) {
 		res = ftp_do_abor(self);
 	}
 	if(FTP_ERROR(res)) {
-		free(list);
+		dircache_drop(self->dirs, path);
 		printout(vLESS, _("Error: "));
 		printout(vLESS, _("listing directory failed (%s)\n"), self->r.message);
 		return res;
 	} else if(res < 0) {
-		free(list);
+		dircache_drop(self->dirs, path);
 		return res;
 	}
-	
-	printout(vDEBUG, "Directory-Listing:\n%s\n-----\n", list);
-	ls_next = list;
-	listing = ftp_parse_ls(list, self->OS);
-	free(list);
-	/* add it to the list of known directories */
-	self->directorylist = directory_add_dir(FORCE_STR(self->current_directory), self->directorylist, listing);
 	return 0;
 }
 /* issue the REST command for resuming a file at a certain
@@ -824,6 +1395,8 @@ int ftp_do_dele(ftp_con * self, char * filename) {
 		return ERR_FAILED;
 	} else if(self->r.code == 250) {
 		printout(vMORE, _("done.\n"));
+		if(ftp_current_directory(self))
+			dircache_remove(ftp_current_directory(self), filename);
 		return 0;
 	}
 	printout(vMORE, _("failed (%d %s). (skipping)\n"), self->r.code, self->r.message);
@@ -846,7 +1419,12 @@ int ftp_do_rmd(ftp_con * self, char * dirname) {
 		printout(vMORE, _("failed (%s)\n"), self->r.message);
 		return ERR_FAILED;
 	} else if(self->r.code == 250) {
+		char * path = ftp_directory_path(self, self->current_directory, dirname);
 		printout(vMORE, _("done.\n"));
+		if(ftp_current_directory(self))
+			dircache_remove(ftp_current_directory(self), dirname);
+		dircache_drop(self->dirs, path);
+		free(path);
 		return 0;
 	}
 	printout(vMORE, _("failed (%d %s). (skipping)\n"), self->r.code, self->r.message);
@@ -861,6 +1439,14 @@ int ftp_do_rmd(ftp_con * self, char * dirname) {
 /* error-levels: ERR_FAILED, get_msg() */
 int ftp_establish_data_connection(ftp_con * self){
 	int res;
+	
+	/* block mode goes on with the connection of the last file, unless the
+	 * server closed it meanwhile */
+	if(self->datakept) {
+		if(!socket_is_data_readable(self->datasock->fd, 0)) return 0;
+		printout(vDEBUG, "The server closed the data-connection.\n");
+		ftp_close_data(self);
+	}
 #ifdef HAVE_SSL
 	self->datatls = 0;
 	/* prepare ssl-connection if possible */
@@ -876,6 +1462,20 @@ int ftp_establish_data_connection(ftp_con * self){
 		if(res == 0) self->datatls = 1;
 	}
 #endif
+	/* the data-connection might have been prepared during the last transfer */
+	if(self->prepared == PREPARED_READY) {
+		self->prepared = PREPARED_NONE;
+		if(self->servsock) return 0;
+		if(socket_connect_finish(self->predata) == 0) {
+			printout(vDEBUG, "Using the prepared data-connection\n");
+			self->datasock = self->predata;
+			self->predata  = NULL;
+			return 0;
+		}
+		printout(vMORE, _("The prepared data-connection failed.\n"));
+	}
+	ftp_drop_prepared(self);
+	
 	printout(vDEBUG, "Portmode: %d\n", self->portmode);
 	if(!self->portmode){
 		res = ftp_do_passive(self);
@@ -901,6 +1501,9 @@ int ftp_establish_data_connection(ftp_con * self){
 /* this will accept the incoming connection if portmode is used */
 /* error-levels: ERR_FAILED */
 int ftp_complete_data_connection(ftp_con * self) {
+	int res = 0;
+	
+	if(self->datakept) return 0;
 	if(self->portmode) {
 		if(self->ps->type == PROXY_SOCKS && self->ps->bind)
 			self->datasock =  proxy_accept(self->servsock);
@@ -917,18 +1520,171 @@ int ftp_complete_data_connection(ftp_con * self) {
 	if(ssllib_in_use)
 #endif
 	if(self->datatls)
-		return socket_transform_to_ssl(self->datasock);
+		res = socket_transform_to_ssl(self->datasock, self->sock);
 #endif
+	/* blocks are written as a whole, the end-of-file marker on its own */
+	if(res == 0 && self->mode == 'B')
+		socket_set_nodelay(self->datasock);
+	return res;
+}
+
+/* close the data-connection, also one kept open by block mode */
+void ftp_close_data(ftp_con * self) {
+	if(self->datasock) socket_close(self->datasock);
+	self->datasock = NULL;
+	self->datakept = 0;
+}
+/* the port of a reply to EPSV, 0 if it is none:
+ * 229 Entering Extended Passive Mode (|||port|) */
+unsigned short parse_epsv_reply(ftp_reply * r) {
+	char * p = strchr(r->message, '(');
+	if(r->code != 229 || !p || !p[1] || p[2] != p[1] || p[3] != p[1])
+		return 0;
+	return atoi(p + 4);
+}
+
+/* --pipeline: the command for the data-connection of the next transfer goes
+ * out before the final reply of the current one is read. its reply follows
+ * that one and is taken by ftp_prepared_reply(), so the connection is ready
+ * by the time the next STOR goes out instead of costing another round-trip.
+ * PORT gets a new listening socket each time: servers connect from port 20,
+ * so connections from the same address and port would be the same again.
+ * proxies are left to the usual way */
+void ftp_prepare_data_connection(ftp_con * self) {
+	unsigned short sport = 0;
+	unsigned int   sip;
+	wput_addr      A;
+	char           eprt[64];
+	
+	if(self->prepared || self->datasock || self->servsock || !self->sock
+	  || self->ps->type != PROXY_OFF
+	  || socket_get_addr(self->sock->fd, &A, !self->portmode) == ERR_FAILED)
+		return;
+	
+	if(!self->portmode) {
+		self->prepared = (A.family == AF_INET6 || (self->features & FEAT_EPSV)) ? PREPARED_EPSV : PREPARED_PASV;
+		printout(vDEBUG, "Preparing the next data-connection\n");
+		ftp_issue_cmd(self, self->prepared == PREPARED_EPSV ? "EPSV" : "PASV", NULL);
+		return;
+	}
+	
+	if(!(self->servsock = socket_listen(A.family, A.family == AF_INET ? self->bindaddr : 0, &sport)))
+		return;
+	self->prepared = PREPARED_PORT;
+	printout(vDEBUG, "Preparing the next data-connection\n");
+	if(A.family == AF_INET6) {
+		sprintf(eprt, "|2|%s|%d|", printaddr(&A), sport);
+		ftp_issue_cmd(self, "EPRT", eprt);
+	} else {
+		memcpy(&sip, A.ip, 4);
+		ftp_issue_cmd(self, "PORT", get_port_fmt(sip, sport));
+	}
+}
+
+/* read the reply to the command of ftp_prepare_data_connection() and start
+ * connecting. self->r stays the reply of the transfer. if anything goes wrong,
+ * the next transfer just sets up its data-connection the usual way */
+void ftp_prepared_reply(ftp_con * self) {
+	ftp_reply      transfer = self->r;
+	unsigned short sport    = 0;
+	unsigned int   sip      = 0;
+	wput_addr      peer;
+	int res;
+	
+	if(self->prepared == PREPARED_NONE || self->prepared == PREPARED_READY)
+		return;
+	
+	self->r.reply = self->r.lines = NULL;
+	res = ftp_get_msg(self);
+	if(!SOCK_ERROR(res)) switch(self->prepared) {
+		case PREPARED_PORT:
+			if(self->r.code == 200) self->prepared = PREPARED_READY;
+			break;
+		case PREPARED_EPSV:
+			if((sport = parse_epsv_reply(&self->r))
+			  && socket_get_addr(self->sock->fd, &peer, 1) == ERR_FAILED)
+				sport = 0;
+			break;
+		case PREPARED_PASV:
+			if(self->r.code != 227) break;
+			parse_passive_string(self->r.message, &sip, &sport);
+			peer.family = AF_INET;
+			memcpy(peer.ip, &sip, 4);
+			break;
+	}
+	if(sport) {
+		printout(vDEBUG, "Remote server data port: %s:%d\n", printaddr(&peer), sport);
+		if((self->predata = socket_connect_start(&peer, sport)))
+			self->prepared = PREPARED_READY;
+	}
+	if(self->prepared != PREPARED_READY) {
+		printout(vMORE, _("Could not prepare the next data-connection (%s).\n"),
+			SOCK_ERROR(res) ? _("connection lost") : self->r.message);
+		ftp_drop_prepared(self);
+	}
+	
+	if(self->r.reply) free(self->r.reply);
+	if(self->r.lines) free(self->r.lines);
+	self->r = transfer;
+}
+
+/* forget about a prepared data-connection (whose reply has been read) */
+void ftp_drop_prepared(ftp_con * self) {
+	if(self->predata) socket_close(self->predata);
+	if(self->prepared && self->servsock) {
+		socket_close(self->servsock);
+		self->servsock = NULL;
+	}
+	self->predata  = NULL;
+	self->prepared = PREPARED_NONE;
+}
+
+/* EPSV (RFC 2428) gives just the port, the address is the one of the
+ * control-connection. this is the only way for ipv6 and saves us from
+ * servers that announce their private address behind a NAT */
+/* error-levels: ERR_RECONNECT, ERR_FAILED */
+static int ftp_do_epsv(ftp_con * self, wput_addr * peer) {
+	unsigned short sport;
+	int res;
+	
+	printout(vMORE, "==> EPSV ... ");
+	ftp_issue_cmd(self, "EPSV", NULL);
+	res = ftp_get_msg(self);
+	if(SOCK_ERROR(res)) return ERR_RECONNECT;
+	
+	if(!(sport = parse_epsv_reply(&self->r))) {
+		printout(vMORE, _("failed.\n"));
+		return ERR_FAILED;
+	}
+	printout(vMORE, _("done.\n"));
+	printout(vDEBUG, "Remote server data port: %s:%d\n", printaddr(peer), sport);
+	
+	self->datasock = socket_connect_addrs(peer, 1, sport, NULL);
+	if(!self->datasock) {
+		printout(vMORE, _("connection failed.\n"));
+		return ERR_FAILED;
+	}
 	return 0;
 }
+
 /* try building a connection in passive mode.
  * => connect to an ip/port that the server issued */
 /* error-levels: ERR_RECONNECT, ERR_FAILED */
 int ftp_do_passive(ftp_con * self) {
 	unsigned short sport = 0;
 	unsigned int   sip   = 0;
+	wput_addr      peer;
 	int res;
 	
+	/* through a proxy, the peer is the proxy and not the server */
+	if(self->ps->type == PROXY_OFF && socket_get_addr(self->sock->fd, &peer, 1) != ERR_FAILED
+	  && (peer.family == AF_INET6 || (self->features & FEAT_EPSV))) {
+		res = ftp_do_epsv(self, &peer);
+		/* PASV cannot do anything but ipv4 */
+		if(res != ERR_FAILED || peer.family == AF_INET6) return res;
+		self->features &= ~FEAT_EPSV;
+	}
+	
 	printout(vMORE, "==> PASV ... ");
 	ftp_issue_cmd(self, "PASV", NULL);
 	res = ftp_get_msg(self);
@@ -957,13 +1713,48 @@ int ftp_do_passive(ftp_con * self) {
 	return 0;
 }
 
+/* the same as PORT for an ipv6-address (RFC 2428) */
+/* error-levels: ERR_FAILED, SOCK_ERRORs */
+static int ftp_do_eprt(ftp_con * self, wput_addr * local) {
+	unsigned short sport = 0;
+	char * eprt;
+	int res;
+	
+	if(!(self->servsock = socket_listen(AF_INET6, 0, &sport)))
+		return ERR_FAILED;
+	printout(vMORE, "==> EPRT ... ");
+	printout(vDEBUG, "Local IP: %s\n", printaddr(local));
+	
+	eprt = malloc(strlen(printaddr(local)) + 12);
+	sprintf(eprt, "|2|%s|%d|", printaddr(local), sport);
+	ftp_issue_cmd(self, "EPRT", eprt);
+	free(eprt);
+	res = ftp_get_msg(self);
+	if(SOCK_ERROR(res)) return res;
+	
+	if(self->r.code != 200) {
+		printout(vMORE, _("failed.\n"));
+		socket_close(self->servsock);
+		self->servsock = NULL;
+		return ERR_FAILED;
+	}
+	printout(vMORE, _("done.\n"));
+	return 0;
+}
+
 /* listen locally (or on the proxy) and issue the PORT command */
 /* error-levels: ERR_FAILED, SOCK_ERRORs */
 int ftp_do_port(ftp_con * self){
 	unsigned short int sport = 0;
 	unsigned       int sip   = 0;
+	wput_addr          local;
 	int res;
 	
+	/* PORT cannot do anything but ipv4 */
+	if(self->ps->type == PROXY_OFF && socket_get_addr(self->sock->fd, &local, 0) != ERR_FAILED
+	  && local.family == AF_INET6)
+		return ftp_do_eprt(self, &local);
+	
 	/* if we somehow are in the situation that it could possibly
 	 * help listening on the proxy (which is extremely unstable
 	 * code, but has once worked...) well try it. you have been warned */
@@ -988,7 +1779,7 @@ int ftp_do_port(ftp_con * self){
 	}
 	
 	if(!self->servsock)
-		if(!(self->servsock = socket_listen(self->bindaddr, &sport)))
+		if(!(self->servsock = socket_listen(AF_INET, self->bindaddr, &sport)))
 			return ERR_FAILED;
 	
 	printout(vMORE, "==> PORT ... ");
@@ -1019,26 +1810,30 @@ int ftp_do_port(ftp_con * self){
 /* 2003-12-09 SMS.
  * Pseudo file read-line function for Wget ftp_parse_ls().
  * Argument is for compatibility only, and is ignored.
+ * The line stays valid until the next call.
  */
 char * read_whole_line( FILE *fp)
 {
-  static char *ls_line;
+  char *line;
   char *nl;
-  printout(vDEBUG, "read_whole_line. ls_next: %x\n", ls_next);
-  
-  ls_line = ls_next;
-  nl = strchr( ls_line, '\n');
 
-  if (nl == NULL)
+  while(!(nl = memchr(ls.buf + ls.scan, '\n', ls.end - ls.scan)))
   {
-    return NULL;
-  }
-  else
-  {
-    *nl = '\0';
-    ls_next = nl+ 1;
-    return ls_line;
+    ls.scan = ls.end;
+    if(!ls_fill())
+    {
+      /* the last line might lack its newline */
+      if(ls.start == ls.end)
+        return NULL;
+      nl = ls.buf + ls.end;
+      break;
+    }
   }
+  *nl = '\0';
+  line = ls.buf + ls.start;
+  ls.start = ls.scan = nl < ls.buf + ls.end ? nl - ls.buf + 1 : ls.end;
+  printout(vDEBUG, "%s\n", line);
+  return line;
 }
 
 /* 2003-12-09 SMS.
@@ -1046,7 +1841,15 @@ char * read_whole_line( FILE *fp)
  */
 char nextchr( void)
 {
-  return *ls_next;
+  if(ls.start == ls.end && !ls_fill())
+    return 0;
+  return ls.buf[ls.start];
+}
+
+/* put an entry parsed by ftp-ls.c into the listing */
+void ls_store(struct fileinfo *f)
+{
+  dircache_append(ls.ftp->dirs, ls.dir, f);
 }
 #ifdef WIN32
 void localtime_r(time_t * t, struct tm * res) {
@@ -1055,53 +1858,54 @@ void localtime_r(time_t * t, struct tm * res) {
 }
 #endif
 /* ******************** *
- * routines for managing the directory-listing-linked list *
+ * routines for managing the cache of directory-listings (dircache.c) *
  * this works together with ftp-ls.c */
-directory_list * directory_add_dir(char * current_directory, directory_list * A, struct fileinfo * K) {
-    if(A == NULL) {
-        A = (directory_list *) malloc(sizeof(directory_list));
-        A->list = K;
-        A->name = cpy(current_directory);
-        A->next = NULL;
-    } else
-        A->next = directory_add_dir(current_directory, A->next, K);
-    return A;
-}
-
 void ftp_fileinfo_free(ftp_con * self) {
-    directory_list  * K = self->directorylist;
-    directory_list  * L;
-    struct fileinfo * M;
-    struct fileinfo * N;
-    while(K != NULL) {
-        L = K->next;
-        free(K->name);
-        M = K->list;
-        while(M != NULL) {
-            N = M->next;
-            if(M->name) free(M->name);
-            free(M);
-            M = N;
-        }
-        free(K);
-        K = L;
-    }
+    dircache_free(self->dirs);
+    self->dirs = NULL;
 }
 
-struct fileinfo * fileinfo_find_file(struct fileinfo * F, char * name) {
-    while(F != NULL) {
-        if( !strcmp(F->name, name) ) return F;
-        F = F->next;
-    }
-    return NULL;
+static directory_list * ftp_current_directory(ftp_con * self) {
+    return dircache_find(self->dirs, FORCE_STR(self->current_directory));
+}
+/* the path of an entry of the current directory */
+static char * ftp_directory_path(ftp_con * self, char * parent, char * name) {
+    char * path = malloc(strlen(FORCE_STR(parent)) + strlen(name) + 2);
+    if(parent && *parent)
+        sprintf(path, "%s/%s", parent, name);
+    else
+        strcpy(path, name);
+    return path;
+}
+/* whether the current directory has been listed. the list itself is
+ * NULL for an empty directory */
+int ftp_has_directory_list(ftp_con * self) {
+    return ftp_current_directory(self) != NULL;
 }
 struct fileinfo * ftp_get_current_directory_list(ftp_con * self) {
-    directory_list * K = self->directorylist;
-    while(K != NULL) {
-        if( !strcmp(K->name, FORCE_STR(self->current_directory)) ) return K->list;
-        K = K->next;
-    }
-    return NULL;
+    directory_list * D = ftp_current_directory(self);
+    return D ? D->list : NULL;
+}
+static struct fileinfo * ftp_find_file(ftp_con * self, char * filename) {
+    directory_list * D = ftp_current_directory(self);
+    return D ? dircache_lookup(D, filename) : NULL;
+}
+/* a file has been stored. its time is set the way MDTM would report it */
+void ftp_cache_file(ftp_con * self, char * filename, off_t size) {
+    directory_list * D = ftp_current_directory(self);
+    time_t now = time(NULL);
+    if(D) dircache_set(self->dirs, D, filename, FT_PLAINFILE, size, mktime(gmtime(&now)));
+}
+/* a directory has been created. since it is empty, it does not need to be
+ * listed ever */
+void ftp_cache_mkd(ftp_con * self, char * parent, char * dirname) {
+    directory_list * D = dircache_find(self->dirs, FORCE_STR(parent));
+    char * path = ftp_directory_path(self, parent, dirname);
+    time_t now  = time(NULL);
+    if(!self->dirs) self->dirs = dircache_new();
+    if(D) dircache_set(self->dirs, D, dirname, FT_DIRECTORY, 0, mktime(gmtime(&now)));
+    dircache_begin(self->dirs, path);
+    free(path);
 }
 /* =================================== *
  * ============== utils ============== *
@@ -1,15 +1,46 @@
 #ifndef __FTPLIB_H
 #define __FTPLIB_H
 
+#include <stdio.h>
 #include "socketlib.h"
 #define SAVE_STRCMP(a,b) ((!a && !b) || (a && b && !strcmp(a,b)))
 
+/* the state of a data-connection that is prepared ahead */
+#define PREPARED_NONE  0
+#define PREPARED_PASV  1 /* PASV sent, its reply is outstanding */
+#define PREPARED_EPSV  2
+#define PREPARED_PORT  3 /* PORT or EPRT sent */
+#define PREPARED_READY 4 /* predata is connecting or servsock is listening */
+
 typedef struct _ftp_reply {
 	unsigned short int code;
 	char * reply;
 	char * message;
+	char * lines; /* the continuation lines of a multi-line reply */
 } ftp_reply;
 
+/* a reply that has been read ahead, because its command was pipelined */
+#define FTP_PREFETCH 3
+typedef struct _ftp_prefetched {
+	char * cmd;   /* command and argument, NULL if unused */
+	char * reply;
+	unsigned short int code;
+	int    res;   /* error-level of get_msg() */
+} ftp_prefetched;
+
+/* server extensions as announced by FEAT */
+#define FEAT_KNOWN       0x01
+#define FEAT_REST_STREAM 0x02
+#define FEAT_SIZE        0x04
+#define FEAT_MDTM        0x08
+#define FEAT_MODE_Z      0x10
+#define FEAT_XCRC        0x20
+#define FEAT_XMD5        0x40
+#define FEAT_XSHA1       0x80
+#define FEAT_RANG        0x100
+#define FEAT_MLST        0x200
+#define FEAT_EPSV        0x400
+
 typedef struct _host_type {
 	unsigned int ip;
 	char * hostname;
@@ -45,13 +76,10 @@ struct fileinfo
   char * linkto;
   struct fileinfo *prev;	/* ...and next structure. */
   struct fileinfo *next;	/* ...and next structure. */
+  struct fileinfo *hnext;	/* next one in the same bucket (dircache.c) */
 };
 
-typedef struct _directory_list {
-  char * name;
-  struct fileinfo * list;
-  struct _directory_list * next;
-} directory_list;
+typedef struct _directory_list directory_list;
 
 typedef struct _ftp_connection {
 	host_t      * host;
@@ -60,21 +88,44 @@ typedef struct _ftp_connection {
 	wput_socket * sock;
 	wput_socket * datasock;
 	wput_socket * servsock;
+	/* --pipeline: the data-connection of the next transfer, asked for while
+	 * the last one finished (PREPARED_*) */
+	wput_socket * predata;
+	unsigned char prepared;
 	ftp_reply     r;
 	char        * sbuf;
 	int           sbuflen;
+	
+	/* --pipeline: commands that go out with the next one, the number of
+	 * replies nobody waits for and the replies read ahead */
+	char        * qbuf;
+	int           qlen;
+	unsigned short int deferred;
+	ftp_prefetched prefetched[FTP_PREFETCH];
+	
+	/* the file of the last MLST and its facts, NULL if it does not exist */
+	char            * mlst_name;
+	struct fileinfo * mlst;
+	/* the number of files looked up in the current directory */
+	unsigned int  dir_lookups;
 	proxy_settings  * ps;
 	
-	directory_list  * directorylist;
+	struct _dircache * dirs; /* the listings of remote directories */
     char            * current_directory;
 	
 	unsigned int  local_ip;
 	unsigned int  bindaddr;
 	
+	unsigned int  features;
+	unsigned int  hash_algos; /* what HASH offers (HASH_* of checksum.h) */
+	
 	unsigned char needcwd     :1;
 	unsigned char loggedin    :1;
 	unsigned char portmode    :1;
 	         char current_type:2; /* -1 (undefined), 0 (ascii), 1 binary */
+	         char mode;           /* the transfer-mode: S, Z or B */
+	unsigned char no_mode_b   :1; /* the server refused MODE B */
+	unsigned char datakept    :1; /* MODE B: datasock is open from the last file */
 	unsigned char secure      :2; /* 1:tls required, 2:tls disabled */
 #ifdef HAVE_SSL
 	unsigned char datatls     :1;
@@ -94,6 +145,9 @@ void ftp_quit(ftp_con * self);
 /* basic send/recv-api */
 int  ftp_get_msg(ftp_con * self);
 void ftp_issue_cmd(ftp_con * self, char * cmd, char * value);
+void ftp_queue_cmd(ftp_con * self, char * cmd, char * value);
+int  ftp_do_cmd(ftp_con * self, char * cmd, char * value);
+int  ftp_pipeline_stat(ftp_con * self, int type, char * filename, int mdtm);
 
 /* ftp-functions */
 int  ftp_connect(ftp_con * self, proxy_settings * ps);
@@ -103,7 +157,9 @@ int  ftp_auth_tls(ftp_con * self);
 int  ftp_set_protection_level(ftp_con * self);
 #endif
 int  ftp_do_syst(ftp_con * self);
+int  ftp_do_feat(ftp_con * self);
 int  ftp_do_abor(ftp_con * self);
+int  ftp_do_noop(ftp_con * self);
 void ftp_do_quit(ftp_con * self);
 int  ftp_do_cwd(ftp_con * self, char * directory);
 int  ftp_do_mkd(ftp_con * self, char * directory);
@@ -111,10 +167,15 @@ int  ftp_do_chmod(ftp_con * self, char * lfile, char * rfile);
 
 int  ftp_get_modification_time(ftp_con * self, char * filename, time_t * timestamp);
 int  ftp_get_filesize(ftp_con * self, char * filename, off_t * filesize);
+int  ftp_do_size(ftp_con * self, char * filename, off_t * filesize);
+unsigned int ftp_hash_algos(ftp_con * self, int ranged);
+int  ftp_do_hash(ftp_con * self, char * filename, unsigned int algo, off_t from, off_t to, char ** hex);
 int  ftp_get_fileinfo(ftp_con * self, char * filename, struct fileinfo ** info);
+int  ftp_do_mlst(ftp_con * self, char * filename);
 int  ftp_set_type(ftp_con * self, int type);
+int  ftp_set_mode(ftp_con * self, char mode, int level);
 
-int  ftp_do_list(ftp_con * self);
+int  ftp_do_list(ftp_con * self, char * cmd);
 int  ftp_get_list(ftp_con * self);
 int  ftp_do_rest(ftp_con * self, off_t filesize);
 int  ftp_do_stor(ftp_con * self, char * filename/*, off_t filesize*/);
@@ -123,16 +184,25 @@ int  ftp_do_rmd(ftp_con * self, char * dirname);
 
 int  ftp_establish_data_connection(ftp_con * self);
 int  ftp_complete_data_connection(ftp_con * self);
+void ftp_prepare_data_connection(ftp_con * self);
+void ftp_prepared_reply(ftp_con * self);
+void ftp_drop_prepared(ftp_con * self);
+void ftp_close_data(ftp_con * self);
 
 int  ftp_do_passive(ftp_con * self);
 int  ftp_do_port(ftp_con * self);
 
-directory_list  * directory_add_dir(char * current_directory, directory_list * A, struct fileinfo * K);
-struct fileinfo * fileinfo_find_file(struct fileinfo * F, char * name);
-struct fileinfo * ftp_find_directory(ftp_con * self);
 void              ftp_fileinfo_free(ftp_con * self);
 struct fileinfo * ftp_get_current_directory_list(ftp_con * self);
+int               ftp_has_directory_list(ftp_con * self);
+/* keep the cached listing in line with what we did on the server */
+void              ftp_cache_file(ftp_con * self, char * filename, off_t size);
+void              ftp_cache_mkd(ftp_con * self, char * parent, char * dirname);
+/* the pseudo file the listing-parsers of ftp-ls.c read from */
+char *            read_whole_line(FILE * fp);
+void              ls_store(struct fileinfo * f);
 
 void parse_passive_string(char * msg, unsigned int * ip, unsigned short int * port);
+unsigned short parse_epsv_reply(ftp_reply * r);
 
 #endif
@@ -0,0 +1,209 @@
+/* the manifest of files uploaded by earlier runs
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* The manifest is a text-file with one line per upload:
+ *   <size> <mtime> <sha-256 or -> <user@host:port/path>
+ * New lines are only ever appended, each with a single write() to a file
+ * opened with O_APPEND, so --parallel workers can share it. When reading,
+ * the last line of a key wins. Once most lines are outdated, the file is
+ * rewritten with just the current ones. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "manifest.h"
+#include "constants.h"
+#include "utils.h"
+
+#define MANIFEST_LINE 8192
+
+typedef struct _manifest_entry {
+	char       * key;
+	unsigned int hash;
+	off_t        size;
+	time_t       mtime;
+	char         digest[65];
+	struct _manifest_entry * next;
+} manifest_entry;
+
+static manifest_entry ** table   = NULL;
+static unsigned int      buckets = 0;
+static unsigned int      entries = 0;
+static int               fd      = -1;
+
+/* FNV-1a */
+static unsigned int manifest_hash(const char * key) {
+	unsigned int h = 2166136261u;
+	while(*key) {
+		h ^= (unsigned char) *key++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static manifest_entry * manifest_find(const char * key, unsigned int h) {
+	manifest_entry * E;
+	if(!buckets) return NULL;
+	for(E = table[h & (buckets - 1)]; E; E = E->next)
+		if(E->hash == h && !strcmp(E->key, key))
+			return E;
+	return NULL;
+}
+
+/* double the number of buckets once there are more entries than buckets */
+static void manifest_grow(void) {
+	manifest_entry ** old = table;
+	manifest_entry  * E;
+	unsigned int      n   = buckets;
+	unsigned int      i;
+
+	buckets = buckets ? buckets * 2 : 1024;
+	table   = calloc(buckets, sizeof(manifest_entry *));
+	for(i = 0; i < n; i++)
+		while((E = old[i])) {
+			old[i]  = E->next;
+			E->next = table[E->hash & (buckets - 1)];
+			table[E->hash & (buckets - 1)] = E;
+		}
+	free(old);
+}
+
+/* add or update the entry in memory */
+static void manifest_set(const char * key, off_t size, time_t mtime, const char * digest) {
+	unsigned int     h = manifest_hash(key);
+	manifest_entry * E = manifest_find(key, h);
+
+	if(!E) {
+		if(entries >= buckets) manifest_grow();
+		E       = malloc(sizeof(manifest_entry));
+		E->key  = cpy((char *) key);
+		E->hash = h;
+		E->next = table[h & (buckets - 1)];
+		table[h & (buckets - 1)] = E;
+		entries++;
+	}
+	E->size  = size;
+	E->mtime = mtime;
+	snprintf(E->digest, sizeof(E->digest), "%s", digest ? digest : "-");
+}
+
+static int manifest_line(char * line, int len, const char * key, off_t size, time_t mtime, const char * digest) {
+	return snprintf(line, len, "%lld %lld %s %s\n", (long long) size, (long long) mtime,
+		digest ? digest : "-", key);
+}
+
+/* write all current entries to a new file and replace the old one by it */
+static void manifest_compact(char * fname) {
+	char           * tmp = malloc(strlen(fname) + 5);
+	char             line[MANIFEST_LINE];
+	manifest_entry * E;
+	FILE           * fp;
+	unsigned int     i;
+
+	sprintf(tmp, "%s.tmp", fname);
+	if(!(fp = fopen(tmp, "w"))) {
+		free(tmp);
+		return;
+	}
+	for(i = 0; i < buckets; i++)
+		for(E = table[i]; E; E = E->next)
+			if(manifest_line(line, sizeof(line), E->key, E->size, E->mtime, E->digest) < (int) sizeof(line))
+				fputs(line, fp);
+	if(fclose(fp) == 0 && rename(tmp, fname) == 0)
+		printout(vDEBUG, "manifest compacted to %d entries\n", entries);
+	else
+		unlink(tmp);
+	free(tmp);
+}
+
+int manifest_open(char * fname) {
+	char         line[MANIFEST_LINE];
+	char         digest[65];
+	long long    size, mtime;
+	int          pos;
+	unsigned int lines = 0;
+	size_t       len   = 0;
+	FILE       * fp;
+
+	if((fp = fopen(fname, "r"))) {
+		while(fgets(line, sizeof(line), fp)) {
+			len = strlen(line);
+			/* a line might be cut off, if a previous run got killed */
+			if(!len || line[len - 1] != '\n') continue;
+			line[len - 1] = 0;
+			lines++;
+			if(sscanf(line, "%lld %lld %64s %n", &size, &mtime, digest, &pos) < 3 || !line[pos])
+				continue;
+			manifest_set(line + pos, (off_t) size, (time_t) mtime, strcmp(digest, "-") ? digest : NULL);
+		}
+		fclose(fp);
+		printout(vMORE, _("Read %d entries from the manifest `%s'.\n"), entries, fname);
+		if(lines > 1024 && lines > 2 * entries) {
+			manifest_compact(fname);
+			len = 0;
+		}
+	}
+
+	fd = open(fname, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if(fd == -1) {
+		printout(vLESS, _("Warning: "));
+		printout(vLESS, _("Cannot open the manifest `%s' (%s).\n"), fname, strerror(errno));
+		return ERR_FAILED;
+	}
+	/* terminate a line that has been cut off, so the next one is readable */
+	if(len && line[len - 1] != '\n' && line[len - 1] != 0)
+		write(fd, "\n", 1);
+	return 0;
+}
+
+void manifest_close(void) {
+	manifest_entry * E;
+	unsigned int     i;
+
+	if(fd != -1) close(fd);
+	fd = -1;
+	for(i = 0; i < buckets; i++)
+		while((E = table[i])) {
+			table[i] = E->next;
+			free(E->key);
+			free(E);
+		}
+	free(table);
+	table   = NULL;
+	buckets = entries = 0;
+}
+
+int manifest_known(char * key, off_t size, time_t mtime) {
+	manifest_entry * E = manifest_find(key, manifest_hash(key));
+	return E && E->size == size && E->mtime == mtime;
+}
+
+void manifest_store(char * key, off_t size, time_t mtime, char * digest) {
+	char line[MANIFEST_LINE];
+	int  len;
+
+	if(fd == -1 || strchr(key, '\n')) return;
+	len = manifest_line(line, sizeof(line), key, size, mtime, digest);
+	if(len >= (int) sizeof(line)) return;
+	if(write(fd, line, len) != len)
+		printout(vMORE, _("Unable to write to the manifest (%s).\n"), strerror(errno));
+	manifest_set(key, size, mtime, digest);
+}
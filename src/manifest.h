@@ -0,0 +1,19 @@
+#ifndef __MANIFEST_H
+#define __MANIFEST_H
+
+#include "config.h"
+#include <sys/types.h>
+#include <time.h>
+
+/* read the manifest of earlier runs and open it for appending.
+ * returns ERR_FAILED if it cannot be opened */
+int  manifest_open(char * fname);
+void manifest_close(void);
+
+/* whether key (user@host:port/path) has been uploaded with this size and
+ * mtime before */
+int  manifest_known(char * key, off_t size, time_t mtime);
+/* note a successful upload. digest is the sha-256 of the file or NULL */
+void manifest_store(char * key, off_t size, time_t mtime, char * digest);
+
+#endif
@@ -0,0 +1,1006 @@
+/* many uploads at once on a single event-loop
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* With --multiplex, the fsessions are collected first (like --parallel
+ * does) and uploaded by up to N connections that are all driven by one
+ * event-loop (eventloop.c) instead of one process each. Every connection is
+ * a state machine: the handler of its control-connection reads what has
+ * arrived, takes each complete reply and sends the next command, the
+ * handler of the data-connection sends as much of the file as the socket
+ * takes. Nothing blocks, so a connection waiting for its server does not
+ * hold up the others and hundreds of transfers to many hosts can run at
+ * the same time.
+ * A connection that is done with its file takes the next one of the same
+ * account, so it keeps its login (and tls-session) for many files.
+ * This is the plain case only: binary files in passive mode without a
+ * proxy and none of the options that need the usual transfer path. The
+ * other fsessions stay in the queue and are processed the usual way. */
+
+#include <errno.h>
+#include <time.h>
+#include "wput.h"
+#include "ftp.h"
+#include "utils.h"
+#include "_queue.h"
+#include "multiplex.h"
+#include "eventloop.h"
+#include "resolve.h"
+#include "progress.h"
+
+#ifndef WIN32
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/resource.h>
+#endif
+
+#ifndef WIN32
+
+/* the longest reply-line that is taken */
+#define MX_LINE  1024
+/* what is read and sent at once if the file cannot be sendfile()d */
+#define MX_CHUNK 65536
+
+#define JOB_WAITING 0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+
+/* the states of the control-connection, named after the reply waited for */
+#define MX_CONNECT  0
+#define MX_GREETING 1
+#define MX_AUTH     2
+#define MX_TLS      3 /* the handshake */
+#define MX_USER     4
+#define MX_PASS     5
+#define MX_PBSZ     6
+#define MX_PROT     7
+#define MX_TYPE     8
+#define MX_MKD      9
+#define MX_SIZE    10
+#define MX_PASV    11
+#define MX_REST    12
+#define MX_STOR    13 /* the preliminary and the final reply */
+#define MX_DEAD    14
+
+/* the states of the data-connection */
+#define DATA_CONNECT 0
+#define DATA_WAIT    1 /* connected, but the server has not accepted STOR yet */
+#define DATA_TLS     2
+#define DATA_SEND    3
+#define DATA_CLOSE   4 /* the end of the file is to be sent */
+#define DATA_DRAIN   5 /* waiting for the server to close it as well */
+
+typedef struct _mx_con {
+	int           state;
+	int           dstate;
+	_fsession   * account; /* the fsession the connection logged in for */
+	int           job;     /* the index of the file being sent, -1 if none */
+	wput_socket * sock;
+	wput_socket * data;
+	time_t        last;    /* the last time anything happened */
+
+	/* the addresses of the server, tried one after the other */
+	wput_addr     addr[2 * RESOLVE_MAXADDR];
+	int           naddr;
+	int           curaddr;
+
+	/* what has been received of the next reply and the last one */
+	char          rbuf[MX_LINE];
+	int           rlen;
+	int           multi; /* the code of a multi-line reply going on */
+	int           code;
+	char          message[MX_LINE];
+
+	/* the file being sent */
+	char        * path;    /* target_dname/target_fname */
+	int           dirs;    /* where in path the next directory ends */
+	int           fd;
+	off_t         offset;
+	off_t         start;
+	struct wput_timer * timer;
+	char        * buf;     /* what is sent unless sendfile() can do it */
+	int           blen;
+	int           bpos;
+
+	unsigned char tls      :1;
+	unsigned char datatls  :1;
+	unsigned char epsv     :1;
+	unsigned char storok   :1; /* the preliminary reply to STOR arrived */
+	unsigned char final    :1; /* and the final one as well */
+	unsigned char nosendfile :1;
+	struct _mx_con * next;
+} mx_con;
+
+static ev_loop    * L;
+static mx_con     * cons;
+static int          live;
+static _fsession ** jobs;
+static time_t     * jobat;   /* when a job to be retried may start again */
+static char       * jobstate;
+static int          njobs;
+/* the directories created (or found to exist) as "user@host:port/path" */
+static char      ** dirs;
+static int          ndirs;
+
+static void mx_control(ev_loop * L, int fd, int events, void * data);
+static void mx_data(ev_loop * L, int fd, int events, void * data);
+static void mx_next_file(mx_con * C);
+static void mx_sized(mx_con * C);
+
+static int mx_same_account(_fsession * A, _fsession * B) {
+	return A->host->ip == B->host->ip && A->host->port == B->host->port
+		&& SAVE_STRCMP(A->host->hostname, B->host->hostname)
+		&& SAVE_STRCMP(A->user, B->user) && SAVE_STRCMP(A->pass, B->pass);
+}
+
+/* whether F can be sent this way. the options are checked by the caller */
+static int mx_eligible(_fsession * F) {
+	if(!F->local_fname || F->segment) return 0;
+	if(F->binary == TYPE_UNDEFINED)
+		F->binary = get_filemode(F->target_fname);
+	return F->binary == TYPE_I;
+}
+
+/* the next job that may start (for the account of C, or for any if C is
+ * NULL). returns its index or -1 */
+static int mx_take_job(mx_con * C) {
+	time_t now = time(NULL);
+	_fsession * F;
+	int i;
+
+	for(i = 0; i < njobs; i++) {
+		if(jobstate[i] != JOB_WAITING || jobat[i] > now) continue;
+		F = jobs[i];
+		if(C && !mx_same_account(C->account, F)) continue;
+		/* an account we could not log in to */
+		if(skiplist_find_entry(F->host->ip, F->host->hostname, F->host->port, F->user,
+				F->pass, F->target_dname)) {
+			printout(vLESS, _("-- Skipping file: `%s'\n"), F->local_fname);
+			jobstate[i] = JOB_DONE;
+			opt.failed++;
+			continue;
+		}
+		jobstate[i] = JOB_RUNNING;
+		return i;
+	}
+	return -1;
+}
+
+/* the file could not be sent. it is tried again after opt.retry_interval if
+ * there are retries left */
+static void mx_job_failed(int job) {
+	_fsession * F = jobs[job];
+
+	if(F->retry > 0) F->retry--;
+	if(F->retry > 0 || F->retry == -1) {
+		printout(vLESS, _("Retrying `%s' in %d seconds.\n"), F->local_fname, opt.retry_interval);
+		jobstate[job] = JOB_WAITING;
+		jobat[job]    = time(NULL) + opt.retry_interval;
+	} else {
+		printout(vLESS, _("Skipping this file\n"));
+		jobstate[job] = JOB_DONE;
+		opt.failed++;
+	}
+}
+
+static void mx_close_file(mx_con * C) {
+	if(C->data) {
+		ev_remove(L, C->data->fd);
+		socket_close(C->data);
+		C->data = NULL;
+	}
+	if(C->fd != -1) close(C->fd);
+	if(C->path)  free(C->path);
+	if(C->timer) free(C->timer);
+	C->fd    = -1;
+	C->path  = NULL;
+	C->timer = NULL;
+	C->job   = -1;
+}
+
+/* give up the connection. its file is retried unless retry is 0 */
+static void mx_drop(mx_con * C, int retry) {
+	if(C->state == MX_DEAD) return;
+	if(C->job != -1) {
+		if(retry) mx_job_failed(C->job);
+		else      jobstate[C->job] = JOB_DONE;
+	}
+	mx_close_file(C);
+	if(C->sock) {
+		ev_remove(L, C->sock->fd);
+		socket_close(C->sock);
+		C->sock = NULL;
+	}
+	C->state = MX_DEAD;
+	live--;
+}
+
+/* send a command and wait for the reply in state */
+/* error-levels: ERR_FAILED (the connection has been dropped) */
+static int mx_cmd(mx_con * C, int state, char * cmd, char * arg) {
+	char buf[MX_LINE];
+
+	snprintf(buf, sizeof(buf), arg ? "%s %s\r\n" : "%s\r\n", cmd, arg);
+	printout(vDEBUG, "[%d] --> %s %s\n", C->sock->fd, cmd,
+		!arg ? "" : strcmp(cmd, "PASS") ? arg : "xxxxx");
+	C->state = state;
+	if(socket_write(C->sock, buf, strlen(buf)) == ERR_FAILED) {
+		printout(vLESS, _("Error: "));
+		printout(vLESS, _("Lost the connection to %s.\n"), printaddr(&C->addr[C->curaddr]));
+		mx_drop(C, 1);
+		return ERR_FAILED;
+	}
+	return 0;
+}
+
+static int mx_dir_known(char * key) {
+	int i;
+	for(i = 0; i < ndirs; i++)
+		if(!strcmp(dirs[i], key)) return 1;
+	return 0;
+}
+
+static void mx_dir_add(char * key) {
+	if(mx_dir_known(key)) {
+		free(key);
+		return;
+	}
+	dirs = realloc(dirs, (ndirs + 1) * sizeof(char *));
+	dirs[ndirs++] = key;
+}
+
+/* the key of the directory C->path[0..end) */
+static char * mx_dir_key(mx_con * C, int end) {
+	_fsession * F = C->account;
+	char * key = malloc(strlen(F->user) + (F->host->hostname ? strlen(F->host->hostname) : 16) + end + 16);
+
+	sprintf(key, "%s@%s:%d/", F->user,
+		F->host->hostname ? F->host->hostname : printip((unsigned char *) &F->host->ip), F->host->port);
+	strncat(key, C->path, end);
+	return key;
+}
+
+/* create the directories of the path one after the other (ignoring the
+ * errors of those that exist), then ask for the size of the file. other
+ * connections might be creating the same ones at the moment, which does
+ * no harm */
+static void mx_next_dir(mx_con * C) {
+	_fsession * F = jobs[C->job];
+	char * key;
+	char * p;
+	int known;
+
+	while(!opt.no_directories && F->target_dname && C->dirs < (int) strlen(F->target_dname)) {
+		p = strchr(C->path + C->dirs + 1, '/');
+		C->dirs = p ? p - C->path : (int) strlen(F->target_dname);
+		key   = mx_dir_key(C, C->dirs);
+		known = mx_dir_known(key);
+		free(key);
+		if(known) continue;
+		C->path[C->dirs] = 0;
+		if(mx_cmd(C, MX_MKD, "MKD", C->path) == 0)
+			C->path[C->dirs] = '/';
+		return;
+	}
+
+	/* don't size if we are going to upload anyway */
+	if(F->resume_table->small_large == RESUME_TABLE_UPLOAD &&
+	   F->resume_table->large_large == RESUME_TABLE_UPLOAD &&
+	   F->resume_table->large_small == RESUME_TABLE_UPLOAD) {
+		F->target_fsize = -1;
+		mx_sized(C);
+		return;
+	}
+	mx_cmd(C, MX_SIZE, "SIZE", C->path);
+}
+
+/* the file C->job is the one to be sent next */
+static void mx_start_file(mx_con * C) {
+	_fsession * F = jobs[C->job];
+
+	printout(vLESS,
+		"--%s-- `%s'\n"
+		"    => ftp://%s:xxxxx@%s:%d/%s%s%s\n",
+		time_str(),
+		F->local_fname,
+		F->user,
+		F->host->ip ? printip((unsigned char *) &F->host->ip) : F->host->hostname,
+		F->host->port,
+		F->target_dname,
+		F->target_dname ? "/" : "",
+		F->target_fname);
+
+	if(F->target_dname) clear_path(F->target_dname);
+	C->path = malloc((F->target_dname ? strlen(F->target_dname) + 1 : 0) + strlen(F->target_fname) + 1);
+	sprintf(C->path, "%s%s%s", F->target_dname ? F->target_dname : "", F->target_dname ? "/" : "", F->target_fname);
+	C->dirs    = 0;
+	C->storok  = 0;
+	C->final   = 0;
+	C->blen    = 0;
+	C->bpos    = 0;
+	mx_next_dir(C);
+}
+
+/* ask for a data-connection */
+static void mx_passive(mx_con * C) {
+	mx_cmd(C, MX_PASV, C->epsv ? "EPSV" : "PASV", NULL);
+}
+
+/* the size of the remote file is known (or -1). apply the resume-rules the
+ * way fsession_process_file() does and start the transfer */
+static void mx_sized(mx_con * C) {
+	_fsession * F = jobs[C->job];
+
+	/* we cannot ask the server what made it, so the last block is resent */
+	if(F->target_fsize > 0 && F->target_fsize != F->local_fsize)
+		F->target_fsize = (F->target_fsize - 511) & ~0x1ff;
+
+	if((F->local_fsize < F->target_fsize && F->resume_table->small_large == RESUME_TABLE_SKIP) ||
+	   (F->local_fsize == F->target_fsize && F->resume_table->large_large == RESUME_TABLE_SKIP) ||
+	   (F->local_fsize  > F->target_fsize && F->resume_table->large_small == RESUME_TABLE_SKIP))
+	{
+		printout(vMORE, _("Skipping this file due to resume/upload/skip rules.\n"));
+		printout(vLESS, _("-- Skipping file: %s\n"), F->local_fname);
+		opt.skipped++;
+		jobstate[C->job] = JOB_DONE;
+		mx_close_file(C);
+		mx_next_file(C);
+		return;
+	}
+	set_resuming(F);
+
+	C->fd = open(F->local_fname, O_RDONLY);
+	if(C->fd == -1) {
+		printout(vLESS, _("Error: "));
+		printout(vLESS, _("Cannot open local source file to read\n"));
+		opt.failed++;
+		jobstate[C->job] = JOB_DONE;
+		mx_close_file(C);
+		mx_next_file(C);
+		return;
+	}
+	C->start  = F->target_fsize > 0 ? F->target_fsize : 0;
+	C->offset = C->start;
+	mx_passive(C);
+}
+
+/* the data-connection has been established and the server waits for the
+ * data. with tls it is resumed from the control-connection */
+static void mx_data_ready(mx_con * C) {
+	C->timer = wtimer_alloc();
+	wtimer_reset(C->timer);
+#ifdef HAVE_SSL
+	if(C->datatls) {
+		if(socket_tls_start(C->data, C->sock) == ERR_FAILED) {
+			mx_drop(C, 1);
+			return;
+		}
+		C->dstate = DATA_TLS;
+		mx_data(L, C->data->fd, 0, C);
+		return;
+	}
+#endif
+	C->dstate = DATA_SEND;
+	ev_modify(L, C->data->fd, EV_WRITE);
+}
+
+/* whether a connect has completed. returns 0 while it is going on */
+/* error-levels: ERR_FAILED (errno set) */
+static int mx_connected(int fd) {
+	struct sockaddr_storage sa;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) < 0) err = errno;
+	if(err) {
+		errno = err;
+		return ERR_FAILED;
+	}
+	/* an event might be left over from a descriptor closed meanwhile */
+	len = sizeof(sa);
+	if(getpeername(fd, (struct sockaddr *) &sa, &len) < 0)
+		return errno == ENOTCONN ? 0 : ERR_FAILED;
+	return 1;
+}
+
+/* start the data-connection after the reply to EPSV or PASV */
+static void mx_data_connect(mx_con * C) {
+	ftp_reply      r;
+	wput_addr      peer;
+	unsigned int   sip = 0;
+	unsigned short sport = 0;
+
+	r.code    = C->code;
+	r.message = C->message;
+	if(C->epsv && (sport = parse_epsv_reply(&r)))
+		peer = C->addr[C->curaddr];
+	else if(!C->epsv && C->code == 227) {
+		parse_passive_string(C->message, &sip, &sport);
+		peer.family = AF_INET;
+		memcpy(peer.ip, &sip, 4);
+	}
+	if(!sport) {
+		/* PASV cannot do anything but ipv4, EPSV is the other way to go */
+		if(!C->epsv) {
+			C->epsv = 1;
+			mx_passive(C);
+			return;
+		}
+		printout(vLESS, _("Error: "));
+		printout(vLESS, _("Cannot open a data-connection (%s).\n"), C->message);
+		mx_drop(C, 1);
+		return;
+	}
+	printout(vDEBUG, "Remote server data port: %s:%d\n", printaddr(&peer), sport);
+	C->data = socket_connect_start(&peer, sport);
+	if(!C->data || ev_add(L, C->data->fd, EV_WRITE, mx_data, C) == ERR_FAILED) {
+		printout(vLESS, _("Error: "));
+		printout(vLESS, _("Cannot open a data-connection (%s).\n"), strerror(errno));
+		mx_drop(C, 1);
+		return;
+	}
+	C->dstate = DATA_CONNECT;
+
+	/* STOR goes out while the connection is being established */
+	if(C->start > 0) {
+		char rest[32];
+		sprintf(rest, "%lld", (long long) C->start);
+		mx_cmd(C, MX_REST, "REST", rest);
+	} else
+		mx_cmd(C, MX_STOR, "STOR", C->path);
+}
+
+/* the file has been sent and the server confirmed it */
+static void mx_file_done(mx_con * C) {
+	_fsession * F = jobs[C->job];
+
+	printout(vNORMAL, "%s (%s) - `%s' [%l]\n",
+		time_str(),
+		calculate_transfer_rate(wtimer_elapsed(C->timer), C->offset - C->start, 0),
+		F->target_fname,
+		F->local_fsize);
+	opt.transfered_bytes += C->offset - C->start;
+	opt.transfered++;
+	jobstate[C->job] = JOB_DONE;
+	if(opt.unlink) {
+		printout(vMORE, _("Removing source file `%s'\n"), F->local_fname);
+		unlink(F->local_fname);
+	}
+	mx_close_file(C);
+	mx_next_file(C);
+}
+
+/* go on with the next file of the account, or log out */
+static void mx_next_file(mx_con * C) {
+	if((C->job = mx_take_job(C)) != -1) {
+		mx_start_file(C);
+		return;
+	}
+	printout(vDEBUG, "[%d] --> QUIT\n", C->sock->fd);
+	socket_write(C->sock, "QUIT\r\n", 6);
+	mx_drop(C, 0);
+}
+
+static void mx_login_failed(mx_con * C) {
+	_fsession * F = C->account;
+
+	printout(vLESS, _("Error: "));
+	printout(vLESS, _("Login-Sequence failed (%s)\n"), C->message);
+	printout(vLESS, _("Skipping all files from this account...\n"));
+	opt.skipdlist = skiplist_add_entry(opt.skipdlist, F->host->ip,
+		F->host->hostname ? cpy(F->host->hostname) : NULL,
+		F->host->port, cpy(F->user), F->pass ? cpy(F->pass) : NULL, NULL);
+	opt.failed++;
+	mx_drop(C, 0);
+}
+
+/* the next step of the handshake with the server. returns whether it is done */
+static int mx_handshake(mx_con * C) {
+#ifdef HAVE_SSL
+	int res = socket_tls_handshake(C->sock);
+	if(res == ERR_FAILED) {
+		mx_drop(C, 1);
+		return 0;
+	}
+	ev_modify(L, C->sock->fd, res ? res : EV_READ);
+	if(res) return 0;
+	C->tls = 1;
+#endif
+	return 1;
+}
+
+/* a reply has arrived (C->code and C->message). send what follows */
+static void mx_reply(mx_con * C) {
+	_fsession * F = C->account;
+
+	/* the preliminary replies carry nothing but for STOR */
+	if(C->code / 100 == 1 && C->state != MX_STOR) return;
+
+	switch(C->state) {
+	case MX_GREETING:
+		if(C->code != 220) {
+			printout(vLESS, _("Connection failed (%s)\n"), C->message);
+			mx_drop(C, 1);
+			return;
+		}
+#ifdef HAVE_SSL
+		if(opt.tls != 2) {
+			mx_cmd(C, MX_AUTH, "AUTH TLS", NULL);
+			return;
+		}
+#endif
+		mx_cmd(C, MX_USER, "USER", F->user);
+		return;
+#ifdef HAVE_SSL
+	case MX_AUTH:
+		if(C->code == 234) {
+			if(socket_tls_start(C->sock, NULL) == ERR_FAILED) {
+				mx_drop(C, 1);
+				return;
+			}
+			C->state = MX_TLS;
+			if(mx_handshake(C))
+				mx_cmd(C, MX_USER, "USER", F->user);
+			return;
+		}
+		if(opt.tls == 1) {
+			printout(vLESS, _("TLS encryption is explicitly required, but could not be established.\n"));
+			mx_drop(C, 1);
+			return;
+		}
+		mx_cmd(C, MX_USER, "USER", F->user);
+		return;
+#endif
+	case MX_USER:
+		if(C->code == 331) {
+			mx_cmd(C, MX_PASS, "PASS", F->pass ? F->pass : "");
+			return;
+		}
+		/* fall through */
+	case MX_PASS:
+		if(C->code != 230) {
+			mx_login_failed(C);
+			return;
+		}
+		if(C->tls)
+			mx_cmd(C, MX_PBSZ, "PBSZ 0", NULL);
+		else
+			mx_cmd(C, MX_TYPE, "TYPE I", NULL);
+		return;
+	case MX_PBSZ:
+		if(C->code != 200) {
+			printout(vMORE, "PBSZ failed.\n");
+			mx_cmd(C, MX_TYPE, "TYPE I", NULL);
+		} else
+			mx_cmd(C, MX_PROT, "PROT P", NULL);
+		return;
+	case MX_PROT:
+		C->datatls = C->code == 200;
+		if(!C->datatls && opt.tls == 1) {
+			printout(vLESS, _("TLS encryption is explicitly required, but could not be established.\n"));
+			mx_drop(C, 1);
+			return;
+		}
+		mx_cmd(C, MX_TYPE, "TYPE I", NULL);
+		return;
+	case MX_TYPE:
+		if(C->code != 200)
+			printout(vMORE, _("Unable to set transfer mode. Assuming binary\n"));
+		mx_start_file(C);
+		return;
+	case MX_MKD:
+		/* only now the other connections may rely on it */
+		mx_dir_add(mx_dir_key(C, C->dirs));
+		mx_next_dir(C);
+		return;
+	case MX_SIZE:
+		jobs[C->job]->target_fsize = C->code == 213 ? (off_t) strtoll(C->message, NULL, 10) : -1;
+		mx_sized(C);
+		return;
+	case MX_PASV:
+		mx_data_connect(C);
+		return;
+	case MX_REST:
+		if(C->code != 350) {
+			printout(vMORE, _("REST failed. Restarting at 0\n"));
+			C->start = C->offset = 0;
+		}
+		mx_cmd(C, MX_STOR, "STOR", C->path);
+		return;
+	case MX_STOR:
+		if(C->code / 100 == 1) {
+			C->storok = 1;
+			if(C->dstate == DATA_WAIT) mx_data_ready(C);
+			return;
+		}
+		/* a server that confirms before it got everything lost something */
+		if(C->code / 100 != 2 || !C->storok || (C->data && C->dstate < DATA_CLOSE)) {
+			printout(vLESS, _("Send Failed (%s) "), C->message);
+			mx_job_failed(C->job);
+			mx_close_file(C);
+			mx_next_file(C);
+			return;
+		}
+		C->final = 1;
+		if(!C->data) mx_file_done(C);
+		return;
+	}
+}
+
+/* take the complete replies out of what has been received */
+static void mx_replies(mx_con * C) {
+	char * nl;
+	int len;
+
+	while(C->state != MX_DEAD && C->state != MX_TLS && (nl = memchr(C->rbuf, '\n', C->rlen))) {
+		len = nl - C->rbuf;
+		if(len > 0 && C->rbuf[len - 1] == '\r') len--;
+		C->rbuf[len] = 0;
+		printout(vDEBUG, "[%d] <-- %s\n", C->sock->fd, C->rbuf);
+
+		/* a multi-line reply ends with its code followed by a space */
+		if(len >= 3 && (!C->multi || (atoi(C->rbuf) == C->multi && C->rbuf[3] != '-'))) {
+			if(!C->multi && C->rbuf[3] == '-')
+				C->multi = atoi(C->rbuf);
+			else {
+				C->multi = 0;
+				C->code  = atoi(C->rbuf);
+				strcpy(C->message, len > 4 ? C->rbuf + 4 : "");
+			}
+		}
+		C->rlen -= nl + 1 - C->rbuf;
+		memmove(C->rbuf, nl + 1, C->rlen);
+		if(C->code) {
+			mx_reply(C);
+			if(C->state != MX_DEAD) C->code = 0;
+		}
+	}
+}
+
+static void mx_control(ev_loop * L, int fd, int events, void * data) {
+	mx_con * C = data;
+	int res;
+
+	C->last = time(NULL);
+	if(C->state == MX_CONNECT) {
+		if((res = mx_connected(fd)) == 0) return;
+		if(res == ERR_FAILED) {
+			printout(vMORE, "[%s]", strerror(errno));
+			/* the next address of the server */
+			ev_remove(L, fd);
+			socket_close(C->sock);
+			C->sock = NULL;
+			while(!C->sock && ++C->curaddr < C->naddr)
+				if((C->sock = socket_connect_start(&C->addr[C->curaddr], C->account->host->port))
+				  && ev_add(L, C->sock->fd, EV_WRITE, mx_control, C) == ERR_FAILED) {
+					socket_close(C->sock);
+					C->sock = NULL;
+				}
+			if(!C->sock) {
+				printout(vLESS, _("Error: "));
+				printout(vLESS, _("Cannot connect to %s:%d.\n"),
+					C->account->host->ip ? printip((unsigned char *) &C->account->host->ip) : C->account->host->hostname,
+					C->account->host->port);
+				mx_drop(C, 1);
+			}
+			return;
+		}
+		printout(vDEBUG, "[%d] connected to %s\n", fd, printaddr(&C->addr[C->curaddr]));
+		/* PASV cannot do anything but ipv4 */
+		C->epsv  = C->addr[C->curaddr].family == AF_INET6;
+		C->state = MX_GREETING;
+		ev_modify(L, fd, EV_READ);
+		return;
+	}
+	if(C->state == MX_TLS) {
+		if(mx_handshake(C))
+			mx_cmd(C, MX_USER, "USER", C->account->user);
+		return;
+	}
+
+	/* gnutls may keep what it decrypted, so read until nothing is left */
+	while(C->state != MX_DEAD && C->state != MX_TLS) {
+		res = socket_try_read(C->sock, C->rbuf + C->rlen, sizeof(C->rbuf) - 1 - C->rlen);
+		if(res == 0) break;
+		if(res < 0) {
+			printout(vLESS, _("Error: "));
+			printout(vLESS, _("Lost the connection to %s.\n"), printaddr(&C->addr[C->curaddr]));
+			mx_drop(C, 1);
+			return;
+		}
+		C->rlen += res;
+		mx_replies(C);
+		if(C->rlen == sizeof(C->rbuf) - 1) {
+			printout(vLESS, _("Error: "));
+			printout(vLESS, _("Reply too long.\n"));
+			mx_drop(C, 1);
+			return;
+		}
+	}
+}
+
+/* send as much of the file as the socket takes. returns 0 once all is sent,
+ * 1 if there is more */
+/* error-levels: ERR_FAILED */
+static int mx_send(mx_con * C) {
+	off_t end = jobs[C->job]->local_fsize;
+	int res;
+
+	while(C->offset < end || C->bpos < C->blen) {
+#ifdef HAVE_SENDFILE
+#  ifdef HAVE_SSL
+		if(!C->nosendfile && (!C->data->ssl || C->data->ktls)) {
+#  else
+		if(!C->nosendfile) {
+#  endif
+			res = socket_try_sendfile(C->data, C->fd, &C->offset,
+				end - C->offset > 0x7fff0000 ? 0x7fff0000 : end - C->offset);
+			if(res == ERR_FAILED && (errno == EINVAL || errno == ENOSYS)) {
+				C->nosendfile = 1;
+				continue;
+			}
+			if(res <= 0) return res == 0 ? 1 : ERR_FAILED;
+			continue;
+		}
+#endif
+		if(C->bpos == C->blen) {
+			if(!C->buf) C->buf = malloc(MX_CHUNK);
+			res = pread(C->fd, C->buf, end - C->offset > MX_CHUNK ? MX_CHUNK : end - C->offset, C->offset);
+			if(res <= 0) {
+				if(res == 0) errno = ENODATA;
+				return ERR_FAILED;
+			}
+			C->offset += res;
+			C->blen    = res;
+			C->bpos    = 0;
+		}
+		res = socket_try_write(C->data, C->buf + C->bpos, C->blen - C->bpos);
+		if(res <= 0) return res == 0 ? 1 : ERR_FAILED;
+		C->bpos += res;
+	}
+	return 0;
+}
+
+static void mx_data(ev_loop * L, int fd, int events, void * data) {
+	mx_con * C = data;
+	char buf[512];
+	int res;
+
+	C->last = time(NULL);
+	switch(C->dstate) {
+	case DATA_CONNECT:
+		if((res = mx_connected(fd)) == 0) return;
+		if(res == ERR_FAILED) {
+			printout(vLESS, _("Error: "));
+			printout(vLESS, _("Cannot open a data-connection (%s).\n"), strerror(errno));
+			mx_drop(C, 1);
+			return;
+		}
+		C->dstate = DATA_WAIT;
+		ev_modify(L, fd, 0);
+		if(C->storok) mx_data_ready(C);
+		return;
+	case DATA_WAIT:
+		/* the server gave up on it */
+		if(events & EV_ERROR) {
+			printout(vLESS, _("Error: "));
+			printout(vLESS, _("The server closed the data-connection.\n"));
+			mx_drop(C, 1);
+		}
+		return;
+#ifdef HAVE_SSL
+	case DATA_TLS:
+		if((res = socket_tls_handshake(C->data)) == ERR_FAILED) {
+			mx_drop(C, 1);
+			return;
+		}
+		if(res) {
+			ev_modify(L, fd, res);
+			return;
+		}
+#  ifdef HAVE_KTLS
+		socket_ktls_tx(C->data);
+#  endif
+		C->dstate = DATA_SEND;
+		ev_modify(L, fd, EV_WRITE);
+		/* fall through */
+#endif
+	case DATA_SEND:
+		if((res = mx_send(C)) == ERR_FAILED) {
+			printout(vLESS, _("Error: "));
+			printout(vLESS, _("Error encountered during uploading data (%s)\n"), strerror(errno));
+			mx_drop(C, 1);
+			return;
+		}
+		if(res) return;
+		C->dstate = DATA_CLOSE;
+		/* fall through */
+	case DATA_CLOSE:
+		if(socket_shutdown_write(C->data)) return;
+		C->dstate = DATA_DRAIN;
+		ev_modify(L, fd, EV_READ);
+		return;
+	case DATA_DRAIN:
+		/* what the server sends (like tls-tickets) is thrown away */
+		while((res = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) ;
+		if(res == -1 && (errno == EAGAIN || errno == EINTR)) return;
+		ev_remove(L, fd);
+		socket_close(C->data);
+		C->data = NULL;
+		if(C->final) mx_file_done(C);
+		return;
+	}
+}
+
+/* open a connection for job */
+static void mx_open(int job) {
+	_fsession * F = jobs[job];
+	mx_con * C = malloc(sizeof(mx_con));
+
+	memset(C, 0, sizeof(mx_con));
+	C->account = F;
+	C->job     = -1;
+	C->fd      = -1;
+	C->last    = time(NULL);
+	C->state   = MX_CONNECT;
+	C->next    = cons;
+	cons       = C;
+	live++;
+
+	C->naddr = resolve_candidates(F->host->ip, F->host->hostname, C->addr);
+	for(C->curaddr = 0; C->curaddr < C->naddr; C->curaddr++)
+		if((C->sock = socket_connect_start(&C->addr[C->curaddr], F->host->port))) {
+			if(ev_add(L, C->sock->fd, EV_WRITE, mx_control, C) == 0) break;
+			socket_close(C->sock);
+			C->sock = NULL;
+		}
+	C->job = job;
+	if(!C->sock) {
+		printout(vLESS, _("Error: "));
+		printout(vLESS, _("Cannot connect to %s:%d.\n"),
+			F->host->ip ? printip((unsigned char *) &F->host->ip) : F->host->hostname, F->host->port);
+		mx_drop(C, 1);
+	}
+}
+
+/* raise the limit of open descriptors if connections would exceed it. each
+ * one needs two. returns how many connections are possible */
+static int mx_fd_limit(int connections) {
+	struct rlimit r;
+	rlim_t need = 2 * (rlim_t) connections + 32;
+
+	if(getrlimit(RLIMIT_NOFILE, &r) < 0 || r.rlim_cur >= need) return connections;
+	r.rlim_cur = r.rlim_max == RLIM_INFINITY || r.rlim_max >= need ? need : r.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &r);
+	getrlimit(RLIMIT_NOFILE, &r);
+	if(r.rlim_cur >= need) return connections;
+	printout(vMORE, _("Warning: "));
+	printout(vMORE, _("Only %d descriptors may be open, using %d connections.\n"),
+		(int) r.rlim_cur, (int) (r.rlim_cur - 32) / 2);
+	return r.rlim_cur > 34 ? (r.rlim_cur - 32) / 2 : 1;
+}
+#endif
+
+void fsession_process_multiplex(void) {
+#ifndef WIN32
+	_fsession *  F;
+	_fsession *  rest = NULL;
+	_fsession ** tail = &rest;
+	mx_con    *  C;
+	mx_con    ** P;
+	int connections;
+	int timeout = socket_get_default_timeout() / 10 + 1;
+	int i, job;
+	time_t now;
+
+	/* these need what the usual transfer-path does */
+	if(opt.wdel || opt.ps.type != PROXY_OFF || opt.portmode || opt.compress || opt.verify || opt.checksum_file
+	  || opt.timestamping || opt.manifest || opt.segments > 1 || opt.chmod || opt.block_mode
+	  || opt.speed_limit || opt.wait) {
+		printout(vMORE, _("Warning: "));
+		printout(vMORE, _("--multiplex does not work with these options. Uploading the usual way.\n"));
+		return;
+	}
+
+	for(F = fsession_queue_entry_point; F != NULL; F = F->next)
+		if(mx_eligible(F)) njobs++;
+	if(njobs < 2 || !(L = ev_new())) {
+		njobs = 0;
+		return;
+	}
+	jobs     = malloc(njobs * sizeof(_fsession *));
+	jobat    = malloc(njobs * sizeof(time_t));
+	jobstate = malloc(njobs);
+	memset(jobat, 0, njobs * sizeof(time_t));
+	memset(jobstate, JOB_WAITING, njobs);
+	/* the others are left in the queue in their order */
+	for(i = 0, F = fsession_queue_entry_point; F != NULL; F = F->next)
+		if(mx_eligible(F))
+			jobs[i++] = F;
+		else {
+			*tail = F;
+			tail  = &F->next;
+		}
+	*tail = NULL;
+
+	connections = mx_fd_limit(opt.multiplex < njobs ? opt.multiplex : njobs);
+	printout(vNORMAL, _("Uploading %d files using up to %d connections.\n"), njobs, connections);
+	fflush(opt.output);
+
+	for(;;) {
+		/* every job that may start and has no connection gets one */
+		while(live < connections && (job = mx_take_job(NULL)) != -1)
+			mx_open(job);
+		for(i = 0; i < njobs && jobstate[i] == JOB_DONE; i++) ;
+		if(i == njobs) break;
+
+		if(ev_run(L, 10) == ERR_FAILED) {
+			printout(vLESS, _("Error: "));
+			printout(vLESS, _("The event-loop failed (%s).\n"), strerror(errno));
+			for(C = cons; C; C = C->next)
+				mx_drop(C, 0);
+			for(i = 0; i < njobs; i++)
+				if(jobstate[i] != JOB_DONE) opt.failed++;
+			break;
+		}
+
+		now = time(NULL);
+		for(C = cons; C; C = C->next)
+			if(C->state != MX_DEAD && now - C->last > timeout) {
+				printout(vLESS, _("Error: "));
+				printout(vLESS, _("Timeout on the connection to %s.\n"), printaddr(&C->addr[C->curaddr]));
+				mx_drop(C, 1);
+			}
+		/* the dead connections are freed here, because the loop might still
+		 * have had an event for them */
+		for(P = &cons; *P; )
+			if((*P)->state == MX_DEAD) {
+				C  = *P;
+				*P = C->next;
+				if(C->buf) free(C->buf);
+				free(C);
+			} else
+				P = &(*P)->next;
+	}
+	fflush(opt.output);
+
+	for(P = &cons; *P; ) {
+		C  = *P;
+		*P = C->next;
+		if(C->buf) free(C->buf);
+		free(C);
+	}
+	for(i = 0; i < njobs; i++) {
+		/* free_fsession() takes the first one of the queue */
+		jobs[i]->next = NULL;
+		fsession_queue_entry_point = jobs[i];
+		free_fsession(jobs[i]);
+	}
+	fsession_queue_entry_point = rest;
+	for(i = 0; i < ndirs; i++)
+		free(dirs[i]);
+	free(dirs);
+	free(jobs);
+	free(jobat);
+	free(jobstate);
+	ev_free(L);
+	dirs  = NULL;
+	ndirs = 0;
+	njobs = 0;
+	L     = NULL;
+#endif
+}
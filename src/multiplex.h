@@ -0,0 +1,11 @@
+#ifndef __MULTIPLEX_H
+#define __MULTIPLEX_H
+
+#include "wput.h"
+
+/* uploads the fsession-queue using up to opt.multiplex connections driven
+ * by one event-loop. fsessions that need the usual transfer-path (or if
+ * there are less than two) remain in the queue */
+void fsession_process_multiplex(void);
+
+#endif
@@ -0,0 +1,183 @@
+/* pool of logged-in control-connections
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* When the next file goes to another server or account, the connection of
+ * the previous one is parked here instead of being closed, so input-lists
+ * that alternate between servers do not connect and log in for each file.
+ * Parked connections are kept alive with NOOP and closed once they have
+ * been idle for opt.pool_idle seconds. The TLS-mode is the same for all
+ * connections of a run, so the key is host, port, user and password. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "pool.h"
+#include "utils.h"
+
+/* seconds of silence after which a parked connection gets a NOOP */
+#define POOL_KEEPALIVE 30
+
+typedef struct _pool_entry {
+	ftp_con * ftp;
+	time_t    since;  /* parked at */
+	time_t    active; /* the last command sent */
+	struct _pool_entry * next;
+} pool_entry;
+
+/* the most recently parked first */
+static pool_entry * pool = NULL;
+
+int pool_match(ftp_con * ftp, host_t * host, char * user, char * pass) {
+	if(ftp->host->ip != host->ip || ftp->host->port != host->port ||
+	   !SAVE_STRCMP(ftp->host->hostname, host->hostname))
+		return POOL_OTHER;
+	if(ftp->loggedin && SAVE_STRCMP(ftp->user, user) && SAVE_STRCMP(ftp->pass, pass))
+		return POOL_ACCOUNT;
+	return POOL_HOST;
+}
+
+/* unlink *P from the pool and close its connection */
+static void pool_drop(pool_entry ** P, char * reason) {
+	pool_entry * E = *P;
+	printout(vDEBUG, "Closing pooled connection to %s:%d (%s)\n",
+		E->ftp->host->hostname ? E->ftp->host->hostname : printip((unsigned char *) &E->ftp->host->ip),
+		E->ftp->host->port, reason);
+	*P = E->next;
+	ftp_quit(E->ftp);
+	free(E);
+}
+
+ftp_con * pool_get(host_t * host, char * user, char * pass) {
+	pool_entry ** P = &pool;
+	pool_entry  * E;
+	ftp_con     * ftp;
+
+	if(!opt.pool) return NULL;
+	while((E = *P)) {
+		if(pool_match(E->ftp, host, user, pass) != POOL_ACCOUNT) {
+			P = &E->next;
+			continue;
+		}
+		/* the server might have dropped it meanwhile */
+		if(time(NULL) - E->active >= POOL_KEEPALIVE && ftp_do_noop(E->ftp) != 0) {
+			pool_drop(P, "dead");
+			continue;
+		}
+		*P  = E->next;
+		ftp = E->ftp;
+		free(E);
+		printout(vMORE, _("Reusing the connection to %s:%d.\n"),
+			ftp->host->hostname ? ftp->host->hostname : printip((unsigned char *) &ftp->host->ip),
+			ftp->host->port);
+		return ftp;
+	}
+	return NULL;
+}
+
+void pool_put(ftp_con * ftp) {
+	pool_entry ** P;
+	pool_entry  * E;
+	pool_entry  * O;
+	int count = 0;
+	int same;
+
+	if(!ftp) return;
+	/* an idle data-connection of block mode is not worth keeping */
+	if(ftp->datakept) ftp_close_data(ftp);
+	if(!opt.pool || !ftp->sock || !ftp->loggedin || ftp->datasock) {
+		ftp_quit(ftp);
+		return;
+	}
+	/* the server would not wait for it that long */
+	ftp_drop_prepared(ftp);
+	E = malloc(sizeof(pool_entry));
+	E->ftp    = ftp;
+	E->since  = E->active = time(NULL);
+	E->next   = pool;
+	pool      = E;
+
+	/* the newer ones are kept, since they are the ones most likely needed */
+	for(P = &pool; (E = *P); ) {
+		for(same = 0, O = pool; O != E; O = O->next)
+			if(pool_match(O->ftp, E->ftp->host, NULL, NULL) != POOL_OTHER)
+				same++;
+		if(count >= opt.pool || same >= opt.pool_per_host) {
+			pool_drop(P, "limit");
+			continue;
+		}
+		count++;
+		P = &E->next;
+	}
+}
+
+void pool_maintain(void) {
+	pool_entry ** P = &pool;
+	pool_entry  * E;
+	time_t now = time(NULL);
+
+	if(!opt.pool) return;
+	while((E = *P)) {
+		if(now - E->since >= opt.pool_idle) {
+			pool_drop(P, "idle");
+			continue;
+		}
+		if(now - E->active >= POOL_KEEPALIVE) {
+			if(ftp_do_noop(E->ftp) != 0) {
+				pool_drop(P, "dead");
+				continue;
+			}
+			E->active = now;
+		}
+		P = &E->next;
+	}
+}
+
+void pool_prewarm(_fsession * F) {
+	ftp_con * ftp;
+	pool_entry * E;
+	int count = 0;
+	int same;
+
+	for(; F && count < opt.prewarm && count < opt.pool; F = F->next) {
+		/* the account is there already or another one would push it out */
+		for(same = 0, E = pool; E; E = E->next) {
+			int match = pool_match(E->ftp, F->host, F->user, F->pass);
+			if(match == POOL_ACCOUNT) break;
+			if(match == POOL_HOST) same++;
+		}
+		if(E || same >= opt.pool_per_host) continue;
+		count++;
+		ftp = ftp_new(ftp_new_host(F->host->ip, F->host->hostname ? cpy(F->host->hostname) : NULL, F->host->port), opt.tls);
+		if(ftp_connect(ftp, &opt.ps) == ERR_FAILED) {
+			ftp_quit(ftp);
+			continue;
+		}
+		ftp->portmode = opt.portmode;
+		ftp->bindaddr = opt.bindaddr;
+		if(ftp_login(ftp, F->user, F->pass) < 0) {
+			ftp_quit(ftp);
+			continue;
+		}
+		pool_put(ftp);
+	}
+}
+
+void pool_close(void) {
+	while(pool)
+		pool_drop(&pool, "done");
+}
@@ -0,0 +1,26 @@
+#ifndef __POOL_H
+#define __POOL_H
+
+#include "wput.h"
+
+/* how much a connection has in common with an account */
+#define POOL_OTHER   0
+#define POOL_HOST    1 /* same server, but another login */
+#define POOL_ACCOUNT 2
+
+int       pool_match(ftp_con * ftp, host_t * host, char * user, char * pass);
+
+/* take a logged-in connection of this account out of the pool, NULL if
+ * there is none */
+ftp_con * pool_get(host_t * host, char * user, char * pass);
+/* keep a connection that is no longer needed for later. connections beyond
+ * the limits of opt.pool and opt.pool_per_host are closed, oldest first */
+void      pool_put(ftp_con * ftp);
+/* send a NOOP on connections that have been idle for a while and close
+ * the ones idle for longer than opt.pool_idle */
+void      pool_maintain(void);
+/* log in to the first opt.prewarm accounts of the fsession-queue */
+void      pool_prewarm(_fsession * F);
+void      pool_close(void);
+
+#endif
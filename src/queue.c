@@ -37,6 +37,7 @@
 #include "utils.h"
 #include "progress.h"
 #include "ftp.h"
+#include "resolve.h"
 
 typedef struct input_queue {
   char * url;
@@ -68,6 +69,8 @@ void queue_add_url(char * url) {
   _queue * K = queue_entry_point;
 
   printout(vDEBUG, "Added URL `%s' to queue.\n", url);
+  /* the host is looked up while the other urls are read */
+  resolve_url(url);
 
   /* save the url, for maybe url-less files that might belong to it */
   /* we do it here since we only want 'real' urls to be known and not
@@ -104,6 +107,7 @@ void wdel_queue_add_entry(char * file, char * url) {
 	if (url != NULL) {
 		M->url = url;
 		printout(vDEBUG, "Added URL `%s' to queue.\n", M->url);
+		resolve_url(M->url);
 		/* save the url, for maybe url-less files that might belong to it */
 		/* we do it here since we only want 'real' urls to be known and not
 		 * generated urls (e.g. by the recur-dir-function) */
@@ -187,7 +191,7 @@ void queue_process(int force) {
 	while(queue_entry_point != NULL && queue_entry_point->url != NULL && (queue_entry_point->file != NULL || force)) {
 		_fsession * F = build_fsession(queue_entry_point->file, queue_entry_point->url);
 		if(F && F != (void *) -2) {
-			if(!opt.sorturls) {
+			if(!opt.sorturls && opt.parallel < 2 && opt.multiplex < 2) {
 				res = fsession_process_file(F, opt.curftp);
 				if(res == -1) {
 					opt.failed++;
@@ -420,6 +424,7 @@ void free_fsession(_fsession * F) {
     if(F->target_fname) free(F->target_fname);
     if(F->user)         free(F->pass);
     if(F->pass)         free(F->user);
+    if(F->digest)       free(F->digest);
     free(F);
 }
 /* build fsession.
@@ -0,0 +1,85 @@
+/* token-bucket for --limit-rate
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* The bucket fills with rate bytes per second up to burst bytes. Sending
+ * takes bytes out of it and may drive it below zero, in which case we sleep
+ * just as long as it takes to refill the debt. So the data goes out in
+ * bursts of at most burst bytes, evenly spaced, no matter how long the
+ * transfer has been running.
+ * There is one bucket per process, which all transfers share. Forked
+ * workers get an equal part of the limit each (see ratelimit_split()). */
+
+#include <unistd.h>
+#include "wput.h"
+#include "progress.h"
+#include "ratelimit.h"
+
+/* default burst: what the rate allows within 20ms, but at least this */
+#define BURST_MIN 4096
+
+static struct {
+	int    share;
+	double tokens;
+	double last;
+	struct wput_timer * timer;
+} bucket = { 1, 0, 0, NULL };
+
+void ratelimit_split(int n) {
+	if(n > 0) bucket.share *= n;
+}
+
+void ratelimit_join(int n) {
+	if(n > 0) bucket.share /= n;
+}
+
+unsigned int ratelimit_rate(void) {
+	return opt.speed_limit / bucket.share;
+}
+
+static double ratelimit_burst(void) {
+	unsigned int burst = opt.rate_burst ? opt.rate_burst / bucket.share : ratelimit_rate() / 50;
+	return burst > BURST_MIN ? burst : BURST_MIN;
+}
+
+size_t ratelimit_chunk(size_t size) {
+	if(!ratelimit_rate() || size <= ratelimit_burst()) return size;
+	return ratelimit_burst();
+}
+
+void ratelimit_take(size_t bytes) {
+	double rate = ratelimit_rate();
+	double burst;
+	double now;
+
+	if(!rate) return;
+	burst = ratelimit_burst();
+	if(!bucket.timer) {
+		bucket.timer  = wtimer_alloc();
+		wtimer_reset(bucket.timer);
+		bucket.tokens = burst;
+	}
+	now = wtimer_elapsed(bucket.timer);
+	bucket.tokens += (now - bucket.last) * rate / 1000;
+	bucket.last    = now;
+	if(bucket.tokens > burst)
+		bucket.tokens = burst;
+
+	bucket.tokens -= bytes;
+	if(bucket.tokens < 0)
+		usleep(-bucket.tokens * 1000000 / rate);
+}
@@ -0,0 +1,18 @@
+#ifndef __RATELIMIT_H
+#define __RATELIMIT_H
+
+#include "config.h"
+#include <sys/types.h>
+
+/* split this process' part of the limit (opt.speed_limit) among n
+ * processes uploading at once. ratelimit_join(n) undoes it */
+void         ratelimit_split(int n);
+void         ratelimit_join(int n);
+/* the rate in bytes per second this process may use, 0 if unlimited */
+unsigned int ratelimit_rate(void);
+/* the largest chunk that should be sent at once */
+size_t       ratelimit_chunk(size_t size);
+/* account for bytes being sent, sleeping as long as the bucket is empty */
+void         ratelimit_take(size_t bytes);
+
+#endif
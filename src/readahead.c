@@ -0,0 +1,160 @@
+/* read-ahead thread for uploads
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* On storage with a high latency per read() (NFS, busy raids) reading and
+ * sending should overlap. A reader thread fills a ring of buffers while
+ * do_send() drains it into the socket.
+ * There is exactly one producer and one consumer, so the ring-indices need
+ * no locking: only the reader advances head, only the sender advances tail.
+ * The two semaphores are only used to sleep while the ring is full / empty. */
+
+#include <stdlib.h>
+#include <errno.h>
+#include "readahead.h"
+
+#ifdef HAVE_PTHREAD
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+typedef struct _ra_slot {
+	char * buf;
+	int    len; /* bytes, 0 for EOF, -1 for an error */
+	int    err;
+} ra_slot;
+
+struct _readahead {
+	int       fd;
+	size_t    bufsize;
+	int       count;
+	off_t     limit;
+
+	ra_slot * slot;
+	unsigned  head; /* next slot to fill. written by the reader only */
+	unsigned  tail; /* next slot to drain. written by the sender only */
+	int       held; /* the sender still uses slot[tail - 1] */
+
+	sem_t     filled;
+	sem_t     empty;
+	volatile int stop;
+	int       running;
+	pthread_t thread;
+};
+
+static void * readahead_run(void * arg) {
+	readahead * R = arg;
+	ra_slot   * S;
+	size_t      len;
+	int         res;
+
+	while(!R->stop) {
+		while(sem_wait(&R->empty) == -1 && errno == EINTR) ;
+		if(R->stop) break;
+
+		S   = &R->slot[R->head % R->count];
+		len = R->bufsize;
+		if(R->limit >= 0 && (off_t) len > R->limit)
+			len = R->limit;
+
+		do
+			res = len ? read(R->fd, S->buf, len) : 0;
+		while(res == -1 && errno == EINTR);
+		S->len = res;
+		S->err = errno;
+		if(res > 0 && R->limit >= 0)
+			R->limit -= res;
+
+		/* make the data visible before the slot */
+		__sync_synchronize();
+		R->head++;
+		sem_post(&R->filled);
+		/* nothing more to come after EOF or an error */
+		if(res <= 0) break;
+	}
+	return NULL;
+}
+
+readahead * readahead_start(int fd, size_t bufsize, int count, off_t limit) {
+	readahead * R = calloc(1, sizeof(readahead));
+	int i;
+
+	R->fd      = fd;
+	R->bufsize = bufsize;
+	R->count   = count;
+	R->limit   = limit;
+	R->slot    = calloc(count, sizeof(ra_slot));
+	for(i = 0; i < count; i++)
+		R->slot[i].buf = malloc(bufsize);
+	sem_init(&R->filled, 0, 0);
+	sem_init(&R->empty,  0, count);
+
+	if(pthread_create(&R->thread, NULL, readahead_run, R) != 0) {
+		readahead_stop(R);
+		return NULL;
+	}
+	R->running = 1;
+	return R;
+}
+
+int readahead_get(readahead * R, char ** buf) {
+	ra_slot * S;
+
+	/* give the previous buffer back to the reader */
+	if(R->held) {
+		R->held = 0;
+		sem_post(&R->empty);
+	}
+	while(sem_wait(&R->filled) == -1 && errno == EINTR) ;
+	__sync_synchronize();
+
+	S = &R->slot[R->tail % R->count];
+	if(S->len <= 0) {
+		/* stay at the final slot, so that further calls return the same */
+		sem_post(&R->filled);
+		errno = S->err;
+		return S->len;
+	}
+	R->tail++;
+	R->held = 1;
+	*buf = S->buf;
+	return S->len;
+}
+
+void readahead_stop(readahead * R) {
+	int i;
+
+	R->stop = 1;
+	if(R->running) {
+		/* wake the reader up if it waits for a free slot */
+		sem_post(&R->empty);
+		pthread_join(R->thread, NULL);
+	}
+	sem_destroy(&R->filled);
+	sem_destroy(&R->empty);
+	for(i = 0; i < R->count; i++)
+		free(R->slot[i].buf);
+	free(R->slot);
+	free(R);
+}
+#else
+readahead * readahead_start(int fd, size_t bufsize, int count, off_t limit) {
+	return NULL;
+}
+int  readahead_get(readahead * R, char ** buf) { return 0; }
+void readahead_stop(readahead * R) { }
+#endif
@@ -0,0 +1,21 @@
+#ifndef __READAHEAD_H
+#define __READAHEAD_H
+
+#include "config.h"
+#include <sys/types.h>
+
+typedef struct _readahead readahead;
+
+/* start a reader thread that fills count buffers of bufsize bytes from fd.
+ * at most limit bytes are read (-1 means until EOF).
+ * returns NULL if no thread can be used, the caller has to read() itself then */
+readahead * readahead_start(int fd, size_t bufsize, int count, off_t limit);
+
+/* get the next filled buffer. it stays valid until the next call.
+ * returns the number of bytes, 0 on EOF or -1 on a read-error (errno set) */
+int         readahead_get(readahead * R, char ** buf);
+
+/* stop the reader thread and free everything */
+void        readahead_stop(readahead * R);
+
+#endif
@@ -0,0 +1,412 @@
+/* cache and background-lookups of hostnames
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* Every file of a recursive upload is parsed from its own url, so each
+ * hostname is looked up once per file unless the answer is kept. Answers
+ * (failures as well) are cached for opt.dns_ttl seconds together with all
+ * ipv4- and ipv6-addresses of the host, which socket_timeout_connect() tries
+ * one after the other. Addresses that did not answer are tried last by the
+ * following connects.
+ * URLs are handed to resolve_url() as soon as they are read, and up to
+ * RESOLVE_THREADS threads look the hosts up meanwhile. Whoever needs an
+ * address that is still queued looks it up on its own rather than waiting
+ * for a thread to take it. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "resolve.h"
+#include "constants.h"
+#include "utils.h"
+#include "windows.h"
+
+#ifndef WIN32
+#  include <sys/socket.h>
+#  include <netinet/in.h>
+#  include <netdb.h>
+#endif
+#ifdef HAVE_PTHREAD
+#  include <pthread.h>
+#endif
+
+#define RESOLVE_BUCKETS 64
+#define ALL_FAILED(failed, n) (((failed) & ((1 << (n)) - 1)) == (1 << (n)) - 1)
+#define RESOLVE_THREADS 4
+
+/* the states of an entry */
+#define RS_NEW    0 /* has to be looked up */
+#define RS_QUEUED 1 /* waits for a thread */
+#define RS_BUSY   2 /* being looked up */
+#define RS_DONE   3
+
+typedef struct _resolve_entry {
+	char         * name;
+	unsigned int   addr[RESOLVE_MAXADDR];
+	unsigned char  naddr;
+	unsigned char  failed;   /* bit i: addr[i] could not be connected */
+	wput_addr      addr6[RESOLVE_MAXADDR];
+	unsigned char  naddr6;   /* naddr and naddr6 0: cannot be resolved */
+	unsigned char  failed6;
+	unsigned char  prefer6;  /* the resolver sorted ipv6 first */
+	unsigned char  state;
+	unsigned char  reported;
+	time_t         expires;
+	struct _resolve_entry * next;  /* in the same bucket */
+	struct _resolve_entry * qnext; /* waiting for a thread */
+} resolve_entry;
+
+static resolve_entry * cache[RESOLVE_BUCKETS];
+static resolve_entry * queue_head = NULL;
+static resolve_entry * queue_tail = NULL;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t lock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  done   = PTHREAD_COND_INITIALIZER;
+static int threads = 0;
+static int idle    = 0;
+static int atfork  = 0;
+#  define LOCK()   pthread_mutex_lock(&lock)
+#  define UNLOCK() pthread_mutex_unlock(&lock)
+#else
+#  define LOCK()
+#  define UNLOCK()
+#endif
+
+/* FNV-1a, hostnames are case-insensitive */
+static unsigned int resolve_hash(const char * s) {
+	unsigned int h = 2166136261u;
+	while(*s) {
+		h ^= (unsigned char) tolower(*s++);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static resolve_entry * resolve_find(const char * name, int create) {
+	unsigned int b = resolve_hash(name) % RESOLVE_BUCKETS;
+	resolve_entry * E;
+
+	for(E = cache[b]; E; E = E->next)
+		if(!strcasecmp(E->name, name))
+			return E;
+	if(!create) return NULL;
+	E = calloc(1, sizeof(resolve_entry));
+	E->name  = cpy((char *) name);
+	E->next  = cache[b];
+	cache[b] = E;
+	return E;
+}
+
+/* the actual lookup into T. it does not touch the cache, so it runs unlocked */
+static void resolve_lookup(const char * name, resolve_entry * T) {
+	int i;
+#ifndef WIN32
+	struct addrinfo hints, * res, * A;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(name, NULL, &hints, &res) != 0)
+		return;
+	T->prefer6 = res->ai_family == AF_INET6;
+	for(A = res; A; A = A->ai_next) {
+		if(A->ai_family == AF_INET && T->naddr < RESOLVE_MAXADDR) {
+			unsigned int ip = ((struct sockaddr_in *) A->ai_addr)->sin_addr.s_addr;
+			for(i = 0; i < T->naddr && T->addr[i] != ip; i++) ;
+			if(i == T->naddr) T->addr[T->naddr++] = ip;
+		} else if(A->ai_family == AF_INET6 && T->naddr6 < RESOLVE_MAXADDR) {
+			wput_addr * W = &T->addr6[T->naddr6];
+			memset(W, 0, sizeof(wput_addr));
+			W->family = AF_INET6;
+			memcpy(W->ip, &((struct sockaddr_in6 *) A->ai_addr)->sin6_addr, 16);
+			for(i = 0; i < T->naddr6 && memcmp(T->addr6[i].ip, W->ip, 16); i++) ;
+			if(i == T->naddr6) T->naddr6++;
+		}
+	}
+	freeaddrinfo(res);
+#else
+	struct hostent * ht;
+
+	T->addr[0] = inet_addr(name);
+	if(T->addr[0] && T->addr[0] != 0xffffffff) {
+		T->naddr = 1;
+		return;
+	}
+	ht = gethostbyname(name);
+	if(!ht) return;
+	for(i = 0; i < RESOLVE_MAXADDR && ht->h_addr_list[i]; i++)
+		memcpy(&T->addr[T->naddr++], ht->h_addr_list[i], 4);
+#endif
+}
+
+/* look E up. called locked with E in RS_BUSY, the lock is released meanwhile */
+static void resolve_run(resolve_entry * E) {
+	resolve_entry T;
+
+	memset(&T, 0, sizeof(T));
+	UNLOCK();
+	resolve_lookup(E->name, &T);
+	LOCK();
+	memcpy(E->addr,  T.addr,  sizeof(T.addr));
+	memcpy(E->addr6, T.addr6, sizeof(T.addr6));
+	E->naddr    = T.naddr;
+	E->naddr6   = T.naddr6;
+	E->prefer6  = T.prefer6;
+	E->failed   = 0;
+	E->failed6  = 0;
+	E->reported = 0;
+	E->expires  = time(NULL) + opt.dns_ttl;
+	E->state    = RS_DONE;
+#ifdef HAVE_PTHREAD
+	pthread_cond_broadcast(&done);
+#endif
+}
+
+#ifdef HAVE_PTHREAD
+static void queue_unlink(resolve_entry * E) {
+	resolve_entry ** P = &queue_head;
+	queue_tail = NULL;
+	while(*P) {
+		if(*P == E) *P = E->qnext;
+		else queue_tail = *P, P = &(*P)->qnext;
+	}
+}
+
+static void * resolve_thread(void * arg) {
+	resolve_entry * E;
+
+	LOCK();
+	for(;;) {
+		while(!queue_head) {
+			idle++;
+			pthread_cond_wait(&queued, &lock);
+			idle--;
+		}
+		E = queue_head;
+		queue_head = E->qnext;
+		if(!queue_head) queue_tail = NULL;
+		E->state = RS_BUSY;
+		resolve_run(E);
+	}
+	return NULL;
+}
+
+/* a forked child has the lock and the cache, but none of the threads */
+static void resolve_prefork(void) { LOCK(); }
+static void resolve_parent(void)  { UNLOCK(); }
+static void resolve_child(void) {
+	resolve_entry * E;
+	int b;
+
+	threads = idle = 0;
+	queue_head = queue_tail = NULL;
+	for(b = 0; b < RESOLVE_BUCKETS; b++)
+		for(E = cache[b]; E; E = E->next)
+			if(E->state == RS_QUEUED || E->state == RS_BUSY)
+				E->state = RS_NEW;
+	UNLOCK();
+}
+#endif
+
+void resolve_start(const char * hostname) {
+#ifdef HAVE_PTHREAD
+	resolve_entry * E;
+	pthread_t thread;
+
+	LOCK();
+	E = resolve_find(hostname, 1);
+	if(E->state == RS_NEW || (E->state == RS_DONE && E->expires <= time(NULL))) {
+		E->state = RS_QUEUED;
+		E->qnext = NULL;
+		if(queue_tail) queue_tail->qnext = E;
+		else           queue_head = E;
+		queue_tail = E;
+		if(!idle && threads < RESOLVE_THREADS) {
+			if(!atfork)
+				atfork = !pthread_atfork(resolve_prefork, resolve_parent, resolve_child);
+			if(pthread_create(&thread, NULL, resolve_thread, NULL) == 0) {
+				pthread_detach(thread);
+				threads++;
+			}
+		} else
+			pthread_cond_signal(&queued);
+	}
+	UNLOCK();
+#endif
+}
+
+void resolve_url(const char * url) {
+	const char * host, * end, * p;
+	char * name;
+
+	if(strncmp(url, "ftp://", 6) != 0) return;
+	url += 6;
+	/* the same split as parse_url() does */
+	end = strchr(url, '/');
+	if(!end) end = url + strlen(url);
+	for(host = p = url; p < end; p++)
+		if(*p == '@') host = p + 1;
+	if(*host == '[' && (p = memchr(host, ']', end - host)))
+		host++;
+	else
+		for(p = host; p < end && *p != ':'; p++) ;
+	if(p == host) return;
+
+	name = malloc(p - host + 1);
+	memcpy(name, host, p - host);
+	name[p - host] = 0;
+	resolve_start(name);
+	free(name);
+}
+
+int resolve_host(const char * hostname, unsigned int * ip) {
+	resolve_entry * E;
+	int i, res = ERR_FAILED;
+
+	LOCK();
+	E = resolve_find(hostname, 1);
+#ifdef HAVE_PTHREAD
+	while(E->state == RS_BUSY)
+		pthread_cond_wait(&done, &lock);
+	if(E->state == RS_QUEUED)
+		queue_unlink(E);
+#endif
+	if(E->state != RS_DONE || E->expires <= time(NULL)) {
+		E->state = RS_BUSY;
+		resolve_run(E);
+	}
+
+	if(E->naddr || E->naddr6) {
+		*ip = E->naddr ? E->addr[0] : 0;
+		res = 0;
+	}
+	if(!E->reported && opt.verbose >= vDEBUG) {
+		for(i = 0; i < E->naddr6; i++)
+			printout(vDEBUG, "IP of `%s' is `%s'\n", hostname, printaddr(&E->addr6[i]));
+		for(i = 0; i < E->naddr; i++)
+			printout(vDEBUG, "IP of `%s' is `%s'\n", hostname, printip((unsigned char *) &E->addr[i]));
+		E->reported = 1;
+	}
+	UNLOCK();
+	return res;
+}
+
+/* the entry a host is known by. of several names with this address the
+ * one with the most addresses is taken. called locked */
+static resolve_entry * resolve_entry_of(unsigned int ip, const char * hostname) {
+	resolve_entry * E, * H = NULL;
+	int b, i;
+
+	if(hostname) {
+		E = resolve_find(hostname, 0);
+		return E && E->state == RS_DONE ? E : NULL;
+	}
+	for(b = 0; b < RESOLVE_BUCKETS; b++)
+		for(E = cache[b]; E; E = E->next)
+			for(i = 0; E->state == RS_DONE && i < E->naddr; i++)
+				if(E->addr[i] == ip && (!H || E->naddr + E->naddr6 > H->naddr + H->naddr6))
+					H = E;
+	return H;
+}
+
+/* append the addresses of a family: the ones that did not fail first */
+static int resolve_order(wput_addr * A, int n, unsigned int * addr, wput_addr * addr6,
+                         int count, unsigned char failed, unsigned int first) {
+	int pass, i;
+
+	for(pass = 0; pass < 3; pass++)
+		for(i = 0; i < count; i++) {
+			int bad = (failed & (1 << i)) != 0;
+			/* the address the host is known by comes first */
+			int top = addr && addr[i] == first;
+			if((pass == 0 && (!top || bad)) || (pass == 1 && (top || bad)) || (pass == 2 && !bad))
+				continue;
+			memset(&A[n], 0, sizeof(wput_addr));
+			if(addr) {
+				A[n].family = AF_INET;
+				memcpy(A[n].ip, &addr[i], 4);
+			} else
+				A[n] = addr6[i];
+			n++;
+		}
+	return n;
+}
+
+int resolve_candidates(unsigned int ip, const char * hostname, wput_addr * A) {
+	wput_addr v4[RESOLVE_MAXADDR];
+	wput_addr v6[RESOLVE_MAXADDR];
+	wput_addr * first, * second;
+	int n4, n6, nfirst, nsecond, n = 0, i;
+	resolve_entry * E;
+
+	LOCK();
+	E = resolve_entry_of(ip, hostname);
+	if(!E) {
+		UNLOCK();
+		if(!ip) return 0;
+		memset(A, 0, sizeof(wput_addr));
+		A->family = AF_INET;
+		memcpy(A->ip, &ip, 4);
+		return 1;
+	}
+	n4 = resolve_order(v4, 0, E->addr, NULL, E->naddr, E->failed, ip);
+	n6 = resolve_order(v6, 0, NULL, E->addr6, E->naddr6, E->failed6, 0);
+	/* the family preferred, unless none of its addresses answered before */
+	if(E->prefer6 ? !ALL_FAILED(E->failed6, E->naddr6) || ALL_FAILED(E->failed, E->naddr)
+	              :  ALL_FAILED(E->failed, E->naddr) && !ALL_FAILED(E->failed6, E->naddr6))
+		first = v6, nfirst = n6, second = v4, nsecond = n4;
+	else
+		first = v4, nfirst = n4, second = v6, nsecond = n6;
+	UNLOCK();
+
+	/* the families take turns */
+	for(i = 0; i < nfirst || i < nsecond; i++) {
+		if(i < nfirst)  A[n++] = first[i];
+		if(i < nsecond) A[n++] = second[i];
+	}
+	return n;
+}
+
+void resolve_report(wput_addr * A, int n, signed char * status) {
+	resolve_entry * E;
+	int b, i, j;
+
+	LOCK();
+	for(b = 0; b < RESOLVE_BUCKETS; b++)
+		for(E = cache[b]; E; E = E->next) {
+			if(E->state != RS_DONE) continue;
+			for(j = 0; j < n; j++) {
+				if(!status[j]) continue;
+				if(A[j].family == AF_INET) {
+					for(i = 0; i < E->naddr; i++)
+						if(!memcmp(&E->addr[i], A[j].ip, 4)) {
+							if(status[j] < 0) E->failed |= 1 << i;
+							else              E->failed &= ~(1 << i);
+						}
+				} else
+					for(i = 0; i < E->naddr6; i++)
+						if(!memcmp(E->addr6[i].ip, A[j].ip, 16)) {
+							if(status[j] < 0) E->failed6 |= 1 << i;
+							else              E->failed6 &= ~(1 << i);
+						}
+			}
+		}
+	UNLOCK();
+}
@@ -0,0 +1,28 @@
+#ifndef __RESOLVE_H
+#define __RESOLVE_H
+
+#include "config.h"
+#include "socketlib.h"
+
+/* the addresses kept per hostname and family */
+#define RESOLVE_MAXADDR 8
+
+/* start resolving the host of an ftp-url in the background, unless it is
+ * known already */
+void resolve_url(const char * url);
+void resolve_start(const char * hostname);
+
+/* the first ipv4-address of hostname (0 if it has ipv6-addresses only).
+ * waits for a lookup that is in progress. returns ERR_FAILED if the host
+ * cannot be resolved */
+int  resolve_host(const char * hostname, unsigned int * ip);
+
+/* all addresses of a host (known by its name or one of its ipv4-addresses)
+ * in the order they should be tried: the families alternate, starting with
+ * the one preferred, and addresses that failed before come last. A has to
+ * have room for 2 * RESOLVE_MAXADDR. returns how many there are */
+int  resolve_candidates(unsigned int ip, const char * hostname, wput_addr * A);
+/* tell the outcome of connecting to them (see socket_timeout_connect()) */
+void resolve_report(wput_addr * A, int n, signed char * status);
+
+#endif
@@ -43,9 +43,37 @@
 
 #include "constants.h"
 #include "socketlib.h"
+#include "eventloop.h"
 #include "windows.h"
 
+#ifdef HAVE_SENDFILE
+#  include <sys/sendfile.h>
+#endif
+#ifndef WIN32
+#  include <netinet/tcp.h>
+#endif
+#ifdef HAVE_KTLS
+#  include <linux/tls.h>
+#  ifndef SOL_TLS
+#    define SOL_TLS 282
+#  endif
+#  ifndef TCP_ULP
+#    define TCP_ULP 31
+#  endif
+#endif
+#if defined(HAVE_SPLICE) && !defined(SPLICE_F_MOVE)
+/* splice() is declared for _GNU_SOURCE only, which clashes with our basename() */
+#  define SPLICE_F_MOVE 1
+#  define SPLICE_F_MORE 4
+extern ssize_t splice(int fd_in, long long * off_in, int fd_out, long long * off_out, size_t len, unsigned int flags);
+#endif
+
 #define ipaddr h_addr_list[0]
+/* the delay (10th-seconds) before the next address is tried, RFC 8305
+ * recommends 250ms */
+#define CONNECT_ATTEMPT_DELAY 2
+/* start-size of the receive-buffer of socket_read_line() */
+#define SOCKET_RBUF 4096
 
 #ifndef WIN32
 #include <netdb.h>
@@ -74,64 +102,98 @@ void socket_set_default_timeout(int timeout) {
 	default_timeout = timeout;
 }
 
+int socket_get_default_timeout(void) {
+	return default_timeout;
+}
+
+/* fill a sockaddr for an address and a port. returns its length */
+static socklen_t socket_sockaddr(wput_addr * A, unsigned short port, struct sockaddr_storage * sa) {
+	memset(sa, 0, sizeof(struct sockaddr_storage));
+	if(A->family == AF_INET6) {
+		struct sockaddr_in6 * s6 = (struct sockaddr_in6 *) sa;
+		s6->sin6_family = AF_INET6;
+		s6->sin6_port   = htons(port);
+		memcpy(&s6->sin6_addr, A->ip, 16);
+		return sizeof(struct sockaddr_in6);
+	} else {
+		struct sockaddr_in * s4 = (struct sockaddr_in *) sa;
+		s4->sin_family  = AF_INET;
+		s4->sin_port    = htons(port);
+		memcpy(&s4->sin_addr, A->ip, 4);
+		return sizeof(struct sockaddr_in);
+	}
+}
+
 wput_socket *  socket_connect(const unsigned int ip, const unsigned short port){
-	struct sockaddr_in remote_addr;
-	wput_socket * sock = socket_new();
-	
-	memset((char *)&remote_addr,0,sizeof(remote_addr));
-	remote_addr.sin_family      = AF_INET;
-	remote_addr.sin_addr.s_addr = ip;
-	remote_addr.sin_port        = htons((unsigned short) port);
-	
-	/*
-	* Open a TCP socket(an internet stream socket).
-	*/
-	
-	if( (sock->fd = socket(AF_INET,SOCK_STREAM,0)) < 0)
-	#ifdef WIN32
-	{ printf("%d", GetLastError()); exit(4); }
-	#else
-	perror(_("client: can't open stream socket"));
-	#endif
-	printout(vDEBUG, "c_sock: %x\n", sock->fd);
+	wput_addr A;
+	A.family = AF_INET;
+	memcpy(A.ip, &ip, 4);
+	return socket_timeout_connect(&A, 1, port, default_timeout, NULL);
+}
+
+wput_socket * socket_connect_addrs(wput_addr * A, int n, unsigned short port, signed char * status) {
+	return socket_timeout_connect(A, n, port, default_timeout, status);
+}
+
+/* the local address of a socket, or its peer's. returns the port or ERR_FAILED */
+int socket_get_addr(int fd, wput_addr * A, int peer) {
+	struct sockaddr_storage sa;
+	socklen_t len = sizeof(sa);
 	
-	/* do the actual connection */
-	if(!socket_timeout_connect(sock,(struct sockaddr *)&remote_addr,sizeof(remote_addr), default_timeout)) {
-		socket_close(sock);
-		return NULL;
+	if((peer ? getpeername(fd, (struct sockaddr *) &sa, &len)
+	         : getsockname(fd, (struct sockaddr *) &sa, &len)) < 0)
+		return ERR_FAILED;
+	memset(A, 0, sizeof(wput_addr));
+	A->family = sa.ss_family;
+	if(sa.ss_family == AF_INET6) {
+		memcpy(A->ip, &((struct sockaddr_in6 *) &sa)->sin6_addr, 16);
+		return ntohs(((struct sockaddr_in6 *) &sa)->sin6_port);
 	}
-	return sock;
+	memcpy(A->ip, &((struct sockaddr_in *) &sa)->sin_addr, 4);
+	return ntohs(((struct sockaddr_in *) &sa)->sin_port);
+}
+
+char * printaddr(wput_addr * A) {
+#ifndef WIN32
+	static char rv[INET6_ADDRSTRLEN];
+	if(A->family == AF_INET6)
+		return (char *) inet_ntop(AF_INET6, A->ip, rv, sizeof(rv));
+#endif
+	return printip(A->ip);
 }
 
-wput_socket * socket_listen(unsigned bindaddr, unsigned short * s_port) {
-	struct sockaddr_in serv_addr;
+/* family is AF_INET or AF_INET6. bindaddr is used for AF_INET only */
+wput_socket * socket_listen(int family, unsigned bindaddr, unsigned short * s_port) {
+	struct sockaddr_storage serv_addr;
+	socklen_t addrlen;
+	wput_addr A;
 	wput_socket * sock = socket_new();
 	
 	/*
 	* Open a TCP socket(an Internet STREAM socket)
 	*/
-	if ((sock->fd = socket(AF_INET, SOCK_STREAM, 0))<0)
+	if ((sock->fd = socket(family, SOCK_STREAM, 0))<0)
 		perror(_("server: can't open new socket"));
 	/*
 	* Bind out local address so that the client can send to us
 	*/
-	memset((void *)&serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family            = AF_INET;
-	serv_addr.sin_port              = htons(*s_port);
-	serv_addr.sin_addr.s_addr       = htonl(bindaddr);
+	memset(&A, 0, sizeof(A));
+	A.family = family;
+	if(family == AF_INET) {
+		bindaddr = htonl(bindaddr);
+		memcpy(A.ip, &bindaddr, 4);
+	}
+	addrlen = socket_sockaddr(&A, *s_port, &serv_addr);
 	
-	if(bind(sock->fd,(struct sockaddr *)&serv_addr,sizeof(serv_addr)) <0){
+	if(bind(sock->fd,(struct sockaddr *)&serv_addr,addrlen) <0){
 		printout(vLESS, _("Error: "));
 		printout(vLESS, _("server: can't bind local address\n"));
 		exit(0);
 	}
 	if (!*s_port)
 		{
-		/* #### addrlen should be a 32-bit type, which int is not
-			guaranteed to be.  Oh, and don't try to make it a size_t,
-			because that can be 64-bit.  */
-		socklen_t addrlen = sizeof (struct sockaddr_in);
-		if (getsockname (sock->fd, (struct sockaddr *)&serv_addr, &addrlen) < 0)
+		int port = socket_get_addr(sock->fd, &A, 0);
+		if (port == ERR_FAILED)
 			{
 			if(sock->fd != -1) {
 				close (sock->fd);
@@ -140,7 +202,7 @@ wput_socket * socket_listen(unsigned bindaddr, unsigned short * s_port) {
 			printout(vDEBUG, "Failed to open server socket.\n");
 			return NULL;
 			}
-		*s_port = ntohs (serv_addr.sin_port);
+		*s_port = port;
 		}
 	
 	/* TODO USS install a signal handler to clean up if user interrupt the server */
@@ -154,7 +216,7 @@ wput_socket * socket_listen(unsigned bindaddr, unsigned short * s_port) {
  * connection */
 wput_socket * socket_accept(wput_socket * sock){
   socklen_t clilen;
-  struct sockaddr_in client_addr;
+  struct sockaddr_storage client_addr;
   wput_socket * child = socket_new();
 
   clilen = sizeof( client_addr);
@@ -167,11 +229,58 @@ wput_socket * socket_accept(wput_socket * sock){
   return child;
 }
 #ifdef HAVE_SSL
-int socket_transform_to_ssl(wput_socket * sock) {
+#ifdef WIN32
+/* one context for all connections of the process */
+static SSL_CTX * ssl_ctx = NULL;
+#else
+/* the credentials and the priorities are shared by all connections of the
+ * process. the shortcuts pick the cipher that is fastest on the cpu:
+ * AES-GCM with AES-NI, ChaCha20 without. both can be handed to the kernel */
+static gnutls_certificate_credentials_t ssl_cred = NULL;
+static gnutls_priority_t ssl_prio = NULL;
+static struct {
+	char * name;
+	char * priority;
+} ssl_ciphers[] = {
+	{"aes-gcm",  "NORMAL:-CIPHER-ALL:+AES-128-GCM:+AES-256-GCM"},
+	{"chacha20", "NORMAL:-CIPHER-ALL:+CHACHA20-POLY1305"},
+	{NULL, NULL}
+};
+#endif
+
+/* set the GnuTLS priority-string (or one of the shortcuts) for tls */
+/* error-levels: ERR_FAILED (the old one is kept) */
+int socket_set_tls_priority(char * priority) {
+#ifndef WIN32
+	gnutls_priority_t prio;
+	const char * err;
+	int i;
+	
+	for(i = 0; ssl_ciphers[i].name; i++)
+		if(!strcasecmp(priority, ssl_ciphers[i].name))
+			priority = ssl_ciphers[i].priority;
+	if(gnutls_priority_init(&prio, priority, &err) < 0) {
+		printout(vLESS, _("Error: "));
+		printout(vLESS, _("Invalid TLS priority `%s' (at `%s').\n"), priority, err);
+		return ERR_FAILED;
+	}
+	if(ssl_prio) gnutls_priority_deinit(ssl_prio);
+	ssl_prio = prio;
+#endif
+	return 0;
+}
+
+/* resume: a connection whose session should be resumed (or NULL). data-
+ * connections resume the one of their control-connection: that saves the
+ * expensive part of the handshake and some servers insist on it */
+int socket_transform_to_ssl(wput_socket * sock, wput_socket * resume) {
 	int res;
-	sock->ctx = SSL_CTX_new(SSLv23_client_method());
-	SSL_CTX_set_verify(sock->ctx, SSL_VERIFY_NONE, NULL);
-	sock->ssl = SSL_new(sock->ctx);
+#ifdef WIN32
+	if(!ssl_ctx) {
+		ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+		SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+	}
+	sock->ssl = SSL_new(ssl_ctx);
 	SSL_set_fd(sock->ssl, sock->fd);
 	/* sometimes this failes with SSL_ERROR_ZERO_RETURN, but for no obvious reason
 	 * it works fine when connecting through a proxy. works fine on some machines
@@ -181,13 +290,154 @@ int socket_transform_to_ssl(wput_socket * sock) {
 		printout(vNORMAL, _("TLS handshake failed\n"));
 		if(res == 6) printout(vNORMAL, "SSL_ERROR_ZERO_RETURN-Bug\n");
 		SSL_free(sock->ssl);
-		SSL_CTX_free(sock->ctx);
 		sock->ssl  = NULL;
-		sock->ctx  = NULL;
 		return ERR_FAILED;
 	}
+#else
+	if(socket_tls_start(sock, resume) == ERR_FAILED)
+		return ERR_FAILED;
+	/* the socket blocks, so only a signal makes it return early */
+	while((res = socket_tls_handshake(sock)) > 0) ;
+	if(res < 0) return ERR_FAILED;
+#endif
+	return 0;
+}
+
+#ifndef WIN32
+/* set up the tls-session of a connection without doing the handshake, which
+ * is left to socket_tls_handshake() */
+/* error-levels: ERR_FAILED */
+int socket_tls_start(wput_socket * sock, wput_socket * resume) {
+	gnutls_datum_t session;
+	
+	/* the certificate is not verified, so there is nothing to load */
+	if(!ssl_cred)
+		gnutls_certificate_allocate_credentials(&ssl_cred);
+	if(!ssl_prio && socket_set_tls_priority("NORMAL") == ERR_FAILED)
+		return ERR_FAILED;
+	
+	gnutls_init(&sock->ssl, GNUTLS_CLIENT);
+	gnutls_priority_set(sock->ssl, ssl_prio);
+	gnutls_credentials_set(sock->ssl, GNUTLS_CRD_CERTIFICATE, ssl_cred);
+	if(resume && resume->ssl && gnutls_session_get_data2(resume->ssl, &session) == 0) {
+		gnutls_session_set_data(sock->ssl, session.data, session.size);
+		gnutls_free(session.data);
+	}
+	gnutls_transport_set_int(sock->ssl, sock->fd);
+	gnutls_handshake_set_timeout(sock->ssl, default_timeout * 100);
+	return 0;
+}
+
+/* go on with the handshake as far as the socket allows. returns 0 once it
+ * is done, or EV_READ / EV_WRITE if it has to be called again as soon as
+ * the socket is ready for that */
+/* error-levels: ERR_FAILED (the tls-session is gone) */
+int socket_tls_handshake(wput_socket * sock) {
+	int res = gnutls_handshake(sock->ssl);
+	
+	if(res < 0 && !gnutls_error_is_fatal(res))
+		return gnutls_record_get_direction(sock->ssl) ? EV_WRITE : EV_READ;
+	if(res < 0) {
+		printout(vNORMAL, _("TLS handshake failed (%s)\n"), gnutls_strerror(res));
+		gnutls_deinit(sock->ssl);
+		sock->ssl = NULL;
+		return ERR_FAILED;
+	}
+	printout(vDEBUG, "TLS: %s, %s (%s)\n",
+		gnutls_protocol_get_name(gnutls_protocol_get_version(sock->ssl)),
+		gnutls_cipher_get_name(gnutls_cipher_get(sock->ssl)),
+		gnutls_session_is_resumed(sock->ssl) ? "resumed" : "full handshake");
+	return 0;
+}
+#endif
+
+#ifdef HAVE_KTLS
+/* the key-material of gnutls in the layout of the kernel. tls 1.2 takes the
+ * explicit part of the nonce from the sequence-number, tls 1.3 has it all
+ * in the iv */
+#define KTLS_GCM(I, N) do { \
+		I.info.cipher_type = TLS_CIPHER_AES_GCM_##N; \
+		memcpy(I.iv, I.info.version == TLS_1_2_VERSION ? seq : iv.data + TLS_CIPHER_AES_GCM_##N##_SALT_SIZE, \
+			TLS_CIPHER_AES_GCM_##N##_IV_SIZE); \
+		memcpy(I.salt, iv.data, TLS_CIPHER_AES_GCM_##N##_SALT_SIZE); \
+		memcpy(I.key, key.data, TLS_CIPHER_AES_GCM_##N##_KEY_SIZE); \
+		memcpy(I.rec_seq, seq, TLS_CIPHER_AES_GCM_##N##_REC_SEQ_SIZE); \
+		size = sizeof(I); \
+	} while(0)
+
+/* hand the keys for sending to the kernel. from then on everything written
+ * to the socket is encrypted there, so sendfile() works on the connection
+ * and the data does not pass through gnutls anymore. receiving stays with
+ * gnutls. only tls 1.2 and 1.3 with AES-GCM or ChaCha20 can be offloaded */
+/* error-levels: ERR_FAILED (errno set, the connection works as before) */
+int socket_ktls_tx(wput_socket * sock) {
+	union {
+		struct tls_crypto_info                     info;
+		struct tls12_crypto_info_aes_gcm_128       gcm128;
+		struct tls12_crypto_info_aes_gcm_256       gcm256;
+		struct tls12_crypto_info_chacha20_poly1305 chacha;
+	} C;
+	gnutls_datum_t mac, iv, key;
+	unsigned char  seq[8];
+	socklen_t size;
+	int res;
+	
+	if(sock->ktls) return 0;
+	memset(&C, 0, sizeof(C));
+	switch(gnutls_protocol_get_version(sock->ssl)) {
+		case GNUTLS_TLS1_2: C.info.version = TLS_1_2_VERSION; break;
+		case GNUTLS_TLS1_3: C.info.version = TLS_1_3_VERSION; break;
+		default: errno = EPROTONOSUPPORT; return ERR_FAILED;
+	}
+	if(gnutls_record_get_state(sock->ssl, 0, &mac, &iv, &key, seq) < 0) {
+		errno = EINVAL;
+		return ERR_FAILED;
+	}
+	switch(gnutls_cipher_get(sock->ssl)) {
+		case GNUTLS_CIPHER_AES_128_GCM: KTLS_GCM(C.gcm128, 128); break;
+		case GNUTLS_CIPHER_AES_256_GCM: KTLS_GCM(C.gcm256, 256); break;
+		case GNUTLS_CIPHER_CHACHA20_POLY1305:
+			C.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+			memcpy(C.chacha.iv, iv.data, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+			memcpy(C.chacha.key, key.data, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+			memcpy(C.chacha.rec_seq, seq, TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+			size = sizeof(C.chacha);
+			break;
+		default: errno = ENOPROTOOPT; return ERR_FAILED;
+	}
+	res = setsockopt(sock->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"));
+	if(res == 0)
+		res = setsockopt(sock->fd, SOL_TLS, TLS_TX, &C, size);
+	memset(&C, 0, sizeof(C));
+	if(res < 0) return ERR_FAILED;
+	sock->ktls = 1;
+	printout(vDEBUG, "TLS: sending through the kernel\n");
 	return 0;
 }
+
+/* the kernel has the keys, so the alert has to go through it as well */
+static int socket_ktls_close_notify(wput_socket * sock) {
+	unsigned char  alert[2] = {1, 0}; /* warning, close_notify */
+	char           cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct iovec   io;
+	struct msghdr  msg;
+	struct cmsghdr * cmsg;
+	
+	memset(&msg, 0, sizeof(msg));
+	io.iov_base        = alert;
+	io.iov_len         = sizeof(alert);
+	msg.msg_iov        = &io;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level   = SOL_TLS;
+	cmsg->cmsg_type    = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len     = CMSG_LEN(sizeof(unsigned char));
+	*CMSG_DATA(cmsg)   = 21; /* alert */
+	return sendmsg(sock->fd, &msg, 0);
+}
+#endif
 #endif
 void socket_close(wput_socket * sock) {
 	printout(vDEBUG, "Closing socket %x\n", sock);
@@ -195,69 +445,161 @@ void socket_close(wput_socket * sock) {
 #ifdef HAVE_SSL
 	if(sock->ssl) {
 		printout(vDEBUG, "Freeing SSL-Socket (%x)... ", sock->ssl);
+#  ifdef WIN32
 		SSL_free(sock->ssl);
-		SSL_CTX_free(sock->ctx);
+#  else
+		gnutls_deinit(sock->ssl);
+#  endif
 		printout(vDEBUG, "done\n");
 	}
 #endif
 	closesocket(sock->fd);
+	if(sock->rbuf) free(sock->rbuf);
 	free(sock);
 }
 
+/* tell the other side that nothing follows (close_notify with tls). returns
+ * 0, or EV_WRITE if a non-blocking socket is full and it has to be called
+ * again once it is writeable */
+int socket_shutdown_write(wput_socket * sock) {
+#ifdef HAVE_SSL
+#  ifdef WIN32
+	if(sock->ssl) SSL_shutdown(sock->ssl);
+#  else
+#    ifdef HAVE_KTLS
+	if(sock->ktls) {
+		if(socket_ktls_close_notify(sock) == -1 && errno == EAGAIN)
+			return EV_WRITE;
+	} else
+#    endif
+	if(sock->ssl && gnutls_bye(sock->ssl, GNUTLS_SHUT_WR) == GNUTLS_E_AGAIN)
+		return EV_WRITE;
+#  endif
+#endif
+	shutdown(sock->fd, 1);
+	return 0;
+}
+
+/* close a connection that data has been sent through once the other side
+ * has seen the end of it. closing it right away with something unread (like
+ * the session-tickets of tls 1.3) makes the kernel reset the connection,
+ * throwing away the data that is still on its way */
+void socket_finish(wput_socket * sock) {
+	char buf[512];
+	socket_shutdown_write(sock);
+	while(socket_is_data_readable(sock->fd, default_timeout) && recv(sock->fd, buf, sizeof(buf), 0) > 0) ;
+	socket_close(sock);
+}
+
 /* =================================== *
  * ============ basic IO ============= *
  * =================================== */
 
-/* reads a line from socket. terminating \r\n is replace by \0 */
+static int socket_recv(wput_socket * sock, void *buf, size_t len);
+
+/* reads a line from socket. terminating \r\n is replace by \0.
+ * the socket is read in large chunks and the line is returned in place,
+ * so it is only valid until the next read from this socket */
 /* error-levels: NULL (fatal read-error), ERR_TIMEOUT */
 char * socket_read_line(wput_socket * sock) {
-	int length  = 0;
-	int bufsize = 82;
-	char * buf  = malloc(bufsize+1);
+	char * line;
+	char * nl;
+	int scan = sock->rstart;
 	int res;
 	
-	while( (res = socket_read(sock, buf+length, 1)) > 0) {
+	if(!sock->rbuf) {
+		sock->rsize = SOCKET_RBUF;
+		sock->rbuf  = malloc(sock->rsize + 1);
+	}
+	while(1) {
 		/* if multiline-messages can be like 220 Everything fine\nGreat\r\n
-		 * reading the next answer will certainly fail and we'll get bug-reports */
-		if(buf[length] == '\n')
-			/* rfc states that lines have to end with CRLF. so remove the \r too */
-			if(buf[length-1] == '\r') {
-				buf[length-1] = 0;
-				return buf;
+		 * reading the next answer will certainly fail and we'll get bug-reports.
+		 * rfc states that lines have to end with CRLF, so only take those */
+		while( (nl = memchr(sock->rbuf + scan, '\n', sock->rend - scan)) ) {
+			scan = nl - sock->rbuf + 1;
+			if(nl > sock->rbuf + sock->rstart && nl[-1] == '\r') {
+				nl[-1] = 0;
+				line = sock->rbuf + sock->rstart;
+				sock->rstart = scan;
+				return line;
 			}
-
-		if(length == bufsize) {
-			bufsize <<= 1;
-			buf = realloc(buf, bufsize+1);
 		}
-		length++;
+		scan = sock->rend;
+		
+		/* make room for the next chunk */
+		if(sock->rstart) {
+			memmove(sock->rbuf, sock->rbuf + sock->rstart, sock->rend - sock->rstart);
+			sock->rend  -= sock->rstart;
+			scan        -= sock->rstart;
+			sock->rstart = 0;
+		}
+		if(sock->rend == sock->rsize) {
+			sock->rsize <<= 1;
+			sock->rbuf    = realloc(sock->rbuf, sock->rsize + 1);
+		}
+		res = socket_recv(sock, sock->rbuf + sock->rend, sock->rsize - sock->rend);
+		if(res <= 0) break;
+		sock->rend += res;
 	}
 	/* this should never be reached. 
 	 * however, make sure there is some debug-output if reading fails */
-	buf[length] = 0;
+	sock->rbuf[sock->rend] = 0;
+	line = sock->rbuf + sock->rstart;
+	sock->rstart = sock->rend = 0;
 	
 	if(res == ERR_TIMEOUT) {
-		printout(vNORMAL, _("Receive-Warning: read() timed out. Read '%s' so far.\n"), buf);
-		free(buf);
+		printout(vNORMAL, _("Receive-Warning: read() timed out. Read '%s' so far.\n"), line);
 		return (char *) ERR_TIMEOUT;
 	}
 	
-	printout(vLESS, _("Receive-Error: read() failed. Read '%s' so far. (errno: %s (%d))\n"), buf, strerror(errno), errno);
-	free(buf);
+	printout(vLESS, _("Receive-Error: read() failed. Read '%s' so far. (errno: %s (%d))\n"), line, strerror(errno), errno);
 	return NULL;
 }
-/* recv, but take care of read-timeouts and read-interuptions */
+/* hand out what socket_read_line() has received already, before reading
+ * from the socket itself */
 /* error-levels: ERR_TIMEOUT, ERR_FAILED */
 int socket_read(wput_socket * sock, void *buf, size_t len) {
+	if(sock->rstart < sock->rend) {
+		if(len > (size_t) (sock->rend - sock->rstart))
+			len = sock->rend - sock->rstart;
+		memcpy(buf, sock->rbuf + sock->rstart, len);
+		sock->rstart += len;
+		return len;
+	}
+	return socket_recv(sock, buf, len);
+}
+/* recv, but take care of read-timeouts and read-interuptions */
+/* error-levels: ERR_TIMEOUT, ERR_FAILED */
+static int socket_recv(wput_socket * sock, void *buf, size_t len) {
 
   int res;
+#ifdef MSG_DONTWAIT
+  /* try first and wait only if there is nothing yet. that is one system-call
+   * per read as long as data keeps coming in */
+#ifdef HAVE_SSL
+  if(!sock->ssl)
+#endif
+  {
+    do
+      res = recv(sock->fd, buf, len, MSG_DONTWAIT);
+    while(res == -1 && errno == WPUT_EINTR);
+    if(res > 0) return res;
+    if(res == 0) return ERR_FAILED;
+    if(errno != EAGAIN && errno != EWOULDBLOCK) return ERR_FAILED;
+  }
+#endif
   /* TODO NRV looks like a possible bug to me. when there is no data pending,
    * TODO NRV but already data received (but not the complete ssl-block),
    * TODO NRV the next receive might fail, but we are in blocking read and
    * TODO NRV won't detect the connection-break-down. */
+  while(1) {
   if( 
 #ifdef HAVE_SSL
+#  ifdef WIN32
 	(sock->ssl && SSL_pending(sock->ssl) > 0) ||  
+#  else
+	(sock->ssl && gnutls_record_check_pending(sock->ssl) > 0) ||
+#  endif
 #endif
 	socket_is_data_readable(sock->fd, default_timeout) ) ;
   else {
@@ -267,32 +609,174 @@ int socket_read(wput_socket * sock, void *buf, size_t len) {
   }
   do {
 #ifdef HAVE_SSL
+#  ifdef WIN32
     if(sock->ssl) res = SSL_read(sock->ssl, buf, len);
+#  else
+    if(sock->ssl) res = gnutls_record_recv(sock->ssl, buf, len);
+#  endif
 	else
 #endif
 	res = recv(sock->fd, buf, len, 0);
   } while( (res == -1 && errno == WPUT_EINTR) );
+#if defined(HAVE_SSL) && !defined(WIN32)
+  /* that is what a record without data (e.g. a session-ticket of tls 1.3)
+   * gives. so wait for the data itself */
+  if(sock->ssl && (res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED)) continue;
+  if(sock->ssl && res < 0) return ERR_FAILED;
+#endif
+  break;
+  }
   //printout(vDEBUG, "fd: %d\tssl: %x\tbuf: %s\tlen:%d\n", fd, ssl, buf, len);
 //  while ((res == -1 && errno == EINTR) || (res == -1 && errno == EINPROGRESS));
   if(res == 0) return ERR_FAILED;
   return res;
 }
-/* simple function to send through the socket
+/* send the whole buffer through the socket. short writes (signals, full
+ * socket-buffers) are continued until everything is sent or a timeout occurs.
  * if ssl is available send through the ssl-module */
+/* error-levels: ERR_FAILED, otherwise len is returned */
 int socket_write(wput_socket * sock, void * buf, size_t len) {
-  if(socket_is_data_writeable(sock->fd, default_timeout)) {
+  size_t sent = 0;
+  int    res;
+  while(sent < len) {
 #ifdef HAVE_SSL
-    if(sock->ssl) return SSL_write(sock->ssl, buf, len);
-    else	
+    /* gnutls makes a full-sized record (16k) of each piece. with ktls the
+     * kernel does the encryption and it is written like any other */
+    if(sock->ssl && !sock->ktls) {
+      if(!socket_is_data_writeable(sock->fd, default_timeout))
+        return ERR_FAILED;
+#  ifdef WIN32
+      res = SSL_write(sock->ssl, (char *) buf + sent, len - sent);
+#  else
+      res = gnutls_record_send(sock->ssl, (char *) buf + sent, len - sent);
+      if(res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED) continue;
+#  endif
+      if(res <= 0) return ERR_FAILED;
+    } else
 #endif
-    return send(sock->fd, buf, len, 0);
-  } else
+    {
+#ifdef MSG_DONTWAIT
+      /* wait only when the socket-buffer is full */
+      res = send(sock->fd, (char *) buf + sent, len - sent, MSG_DONTWAIT);
+      if(res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if(!socket_is_data_writeable(sock->fd, default_timeout))
+          return ERR_FAILED;
+        continue;
+      }
+#else
+      if(!socket_is_data_writeable(sock->fd, default_timeout))
+        return ERR_FAILED;
+      res = send(sock->fd, (char *) buf + sent, len - sent, 0);
+#endif
+      if(res == -1 && (errno == WPUT_EINTR || errno == EAGAIN)) continue;
+      if(res <= 0) return ERR_FAILED;
+    }
+    sent += res;
+  }
+  return len;
+}
+#ifdef HAVE_SENDFILE
+/* zero-copy variant of read() + socket_write(). sends up to len bytes from
+ * fd (at its current position) without copying them to userspace. pipes
+ * cannot be sendfile()d and need splice() instead.
+ * a tls-connection has to be encrypted by the kernel (see socket_ktls_tx()).
+ * returns the number of bytes sent or 0 if fd is at its end */
+/* error-levels: ERR_FAILED (errno EINVAL or ENOSYS if the kernel does not
+ * support it for these descriptors) */
+int socket_sendfile(wput_socket * sock, int fd, size_t len, int ispipe) {
+  ssize_t res;
+  if(!socket_is_data_writeable(sock->fd, default_timeout))
     return ERR_FAILED;
+  do {
+#ifdef HAVE_SPLICE
+    if(ispipe)
+      res = splice(fd, NULL, sock->fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+    else
+#endif
+      res = sendfile(sock->fd, fd, NULL, len);
+  } while(res == -1 && errno == WPUT_EINTR);
+  return res < 0 ? ERR_FAILED : res;
 }
+#endif
+
+#ifndef WIN32
+/* the non-blocking forms of reading and writing for the event-loop (see
+ * multiplex.c). they return what has been transfered or 0 if the socket is
+ * not ready. a write that returned 0 has to be repeated with the same data
+ * once the socket is writeable, because tls may have taken part of it */
+/* error-levels: ERR_FAILED (including the end of the connection) */
+int socket_try_read(wput_socket * sock, void * buf, size_t len) {
+  int res;
+#ifdef HAVE_SSL
+  if(sock->ssl) {
+    res = gnutls_record_recv(sock->ssl, buf, len);
+    if(res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED) return 0;
+    return res > 0 ? res : ERR_FAILED;
+  }
+#endif
+  res = recv(sock->fd, buf, len, MSG_DONTWAIT);
+  if(res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+  return res > 0 ? res : ERR_FAILED;
+}
+
+int socket_try_write(wput_socket * sock, void * buf, size_t len) {
+  int res;
+#ifdef HAVE_SSL
+  if(sock->ssl && !sock->ktls) {
+    res = gnutls_record_send(sock->ssl, buf, len);
+    if(res == GNUTLS_E_AGAIN || res == GNUTLS_E_INTERRUPTED) return 0;
+    return res > 0 ? res : ERR_FAILED;
+  }
+#endif
+  res = send(sock->fd, buf, len, MSG_DONTWAIT);
+  if(res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+  return res > 0 ? res : ERR_FAILED;
+}
+
+#ifdef HAVE_SENDFILE
+/* sends up to len bytes of fd from *offset on, which is advanced. the
+ * socket has to be non-blocking */
+int socket_try_sendfile(wput_socket * sock, int fd, off_t * offset, size_t len) {
+  ssize_t res = sendfile(sock->fd, fd, offset, len);
+  if(res == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+  if(res == 0) errno = ENODATA; /* the file is shorter than it was */
+  return res > 0 ? res : ERR_FAILED;
+}
+#endif
+#endif
 /* =================================== *
  * ============= utils =============== *
  * =================================== */
 
+/* the smoothed round-trip-time of the connection in microseconds.
+ * returns 0 if the os does not tell us */
+unsigned int socket_get_rtt(wput_socket * sock) {
+#ifdef TCP_INFO
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	if(getsockopt(sock->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+		return info.tcpi_rtt;
+#endif
+	return 0;
+}
+
+/* have the kernel send no more than rate bytes per second.
+ * returns -1 (errno set) if it is not able to */
+int socket_set_pacing(wput_socket * sock, unsigned int rate) {
+#ifdef SO_MAX_PACING_RATE
+	return setsockopt(sock->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+#else
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
+
+/* send small writes at once instead of waiting for the ack of the last one */
+int socket_set_nodelay(wput_socket * sock) {
+	int on = 1;
+	return setsockopt(sock->fd, IPPROTO_TCP, TCP_NODELAY, (void *) &on, sizeof(on));
+}
+
 int get_ip_addr(char* hostname, unsigned int * ip){ 
 	struct hostent *ht;
 #ifdef WIN32
@@ -362,49 +846,159 @@ int socket_set_blocking(int sock, unsigned char block) {
 #endif
 }
 
-/* check whether a specific file-descriptor has data that can be read or written within timeout seconds */
+/* check whether a specific file-descriptor has data that can be read or written
+ * within timeout 10th-seconds. this is poll() (see eventloop.c), so there is no
+ * limit on the value of the descriptor */
 int socket_is_data_writeable(int s, int timeout) {
-	struct timeval t;
-	int res = 0;
-	int errno_saved;
-	fd_set inSet;
-	FD_ZERO(&inSet);
-	t.tv_sec = timeout / 10;
-	t.tv_usec= (timeout % 10) * 100;
-	FD_SET(s, &inSet);
+	int res;
 	printout(vDEBUG, "Checking whether %d is writable... ", s);
-	errno = 0;
-	res = select(s+1, NULL, &inSet, NULL, &t);
-	errno_saved = errno;
-	printout(vDEBUG, "%d (%d:%s)\n", res, errno, strerror(errno));
-	if(errno_saved > 0 && errno_saved != EINPROGRESS)
-		return 0;
+	res = ev_wait(s, EV_WRITE, timeout) != 0;
+	printout(vDEBUG, "%d\n", res);
 	return res;
 }
 int socket_is_data_readable(int s, int timeout) {
-      struct timeval t;
-      fd_set inSet;
-      FD_ZERO(&inSet);
-      t.tv_sec = timeout / 10;
-      t.tv_usec= (timeout % 10) * 100;
-      FD_SET(s, &inSet);
-      return select(s+1, &inSet, NULL, NULL, &t);
-}
-
-/* this is for not getting hanged up when a connection cannot be established in time */
-wput_socket * socket_timeout_connect(wput_socket * sock, struct sockaddr *remote_addr, size_t size, int timeout) {
-  int c = 0;
-  printout(vDEBUG, "initiating timeout connect (%d)\n", timeout);
-  socket_set_blocking(sock->fd, 0);
-  c = connect(sock->fd,remote_addr,size);
-  if(c < 0 && errno > 0 && errno != EINPROGRESS) {
-	printout(vMORE, "[%s]", strerror(errno));
-	return NULL;
-  }
-  /* DEBUG if(c == -1) perror("connect"); */
-  socket_set_blocking(sock->fd, 1);
-  c = socket_is_data_writeable(sock->fd, timeout);
-  return c < 1 ? NULL : sock;
+	return ev_wait(s, EV_READ, timeout) != 0;
+}
+
+/* the attempts of socket_timeout_connect() */
+typedef struct _connect_race {
+	int         * fd;
+	signed char * status;
+	int           n;
+	int           pending;
+	int           winner;
+} connect_race;
+
+/* start a non-blocking connect. returns the descriptor or -1 */
+static int connect_start(wput_addr * A, unsigned short port) {
+	struct sockaddr_storage sa;
+	socklen_t len = socket_sockaddr(A, port, &sa);
+	int fd;
+	
+	if((fd = socket(A->family, SOCK_STREAM, 0)) < 0) {
+		printout(vMORE, "[%s]", strerror(errno));
+		return -1;
+	}
+	printout(vDEBUG, "c_sock: %x (%s)\n", fd, printaddr(A));
+	socket_set_blocking(fd, 0);
+	if(connect(fd, (struct sockaddr *) &sa, len) < 0 && errno > 0 && errno != EINPROGRESS) {
+		printout(vMORE, "[%s]", strerror(errno));
+		closesocket(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void connect_ready(ev_loop * L, int fd, int events, void * data) {
+	connect_race * R = data;
+	socklen_t len = sizeof(int);
+	int err = 0;
+	int i;
+	
+	for(i = 0; R->fd[i] != fd; i++) ;
+	ev_remove(L, fd);
+	R->pending--;
+	/* a refused connection is writeable as well, but flagged as error */
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) < 0) err = errno;
+	if(!err && !(events & EV_ERROR) && R->winner < 0) {
+		R->winner = i;
+		return;
+	}
+	if(err) printout(vMORE, "[%s]", strerror(err));
+	closesocket(fd);
+	R->fd[i]     = -1;
+	R->status[i] = -1;
+}
+
+/* connect to one of n addresses, in this order (RFC 8305, happy eyeballs).
+ * the next address is tried as soon as the previous attempt failed or did
+ * not succeed within CONNECT_ATTEMPT_DELAY, without giving up the attempts
+ * still pending. the first connection established wins. so an address (or a
+ * whole address family) that does not answer costs a fraction of a second
+ * instead of the timeout.
+ * status (if not NULL) tells for each address whether it connected (1),
+ * failed or was slower than the winner (-1) or was not tried (0) */
+wput_socket * socket_timeout_connect(wput_addr * A, int n, unsigned short port, int timeout, signed char * status) {
+	ev_loop     * L = ev_new();
+	wput_socket * sock = NULL;
+	connect_race  R;
+	int next = 0;
+	int i, res;
+	
+	printout(vDEBUG, "initiating timeout connect (%d)\n", timeout);
+	if(!L || n < 1) {
+		ev_free(L);
+		return NULL;
+	}
+	R.fd      = malloc(n * sizeof(int));
+	R.status  = status ? status : malloc(n);
+	R.n       = n;
+	R.pending = 0;
+	R.winner  = -1;
+	memset(R.status, 0, n);
+	
+	while(R.winner < 0 && (next < n || R.pending)) {
+		if(next < n) {
+			i = next++;
+			R.fd[i] = connect_start(&A[i], port);
+			if(R.fd[i] == -1 || ev_add(L, R.fd[i], EV_WRITE, connect_ready, &R) < 0) {
+				if(R.fd[i] != -1) closesocket(R.fd[i]);
+				R.fd[i]     = -1;
+				R.status[i] = -1;
+				continue;
+			}
+			R.pending++;
+		}
+		res = ev_run(L, next < n ? CONNECT_ATTEMPT_DELAY : timeout);
+		if(res < 0 || (res == 0 && next >= n)) break;
+	}
+	
+	/* the slower ones are dropped */
+	for(i = 0; i < next; i++)
+		if(R.fd[i] != -1 && i != R.winner) {
+			closesocket(R.fd[i]);
+			R.status[i] = -1;
+		}
+	if(R.winner >= 0) {
+		R.status[R.winner] = 1;
+		sock = socket_new();
+		sock->fd = R.fd[R.winner];
+		socket_set_blocking(sock->fd, 1);
+		if(n > 1) printout(vDEBUG, "connected to %s\n", printaddr(&A[R.winner]));
+	}
+	free(R.fd);
+	if(!status) free(R.status);
+	ev_free(L);
+	return sock;
+}
+
+/* a connect that goes on in the background. the socket can be handed to
+ * socket_connect_finish() once it is needed */
+wput_socket * socket_connect_start(wput_addr * A, unsigned short port) {
+	wput_socket * sock;
+	int fd = connect_start(A, port);
+	
+	if(fd == -1) return NULL;
+	sock = socket_new();
+	sock->fd = fd;
+	return sock;
+}
+
+/* wait for the connect of socket_connect_start() to complete */
+/* error-levels: ERR_FAILED */
+int socket_connect_finish(wput_socket * sock) {
+	socklen_t len = sizeof(int);
+	int err = 0;
+	
+	if(ev_wait(sock->fd, EV_WRITE, default_timeout) <= 0)
+		return ERR_FAILED;
+	if(getsockopt(sock->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) < 0) err = errno;
+	if(err) {
+		printout(vMORE, "[%s]", strerror(err));
+		return ERR_FAILED;
+	}
+	socket_set_blocking(sock->fd, 1);
+	return 0;
 }
 
 /* =================================== *
@@ -5,7 +5,7 @@
 
 #ifdef HAVE_SSL
 # ifndef WIN32
-#  include <gnutls/openssl.h>
+#  include <gnutls/gnutls.h>
 # endif
 #endif
 
@@ -33,35 +33,80 @@ typedef struct _proxy_settings {
 	unsigned int   type:2;
 } proxy_settings;
 
+/* an ipv4- or ipv6-address */
+typedef struct _wput_addr {
+	unsigned short family; /* AF_INET or AF_INET6 */
+	unsigned char  ip[16]; /* network byte-order, AF_INET uses 4 bytes */
+} wput_addr;
+
 typedef struct _wput_socket {
 	int fd;
+	/* what has been received, but not read yet: rbuf[rstart..rend) */
+	char * rbuf;
+	int    rstart;
+	int    rend;
+	int    rsize;
 #ifdef HAVE_SSL
+#  ifdef WIN32
 	SSL     * ssl;
-	SSL_CTX * ctx;
+#  else
+	gnutls_session_t ssl;
+#  endif
+	unsigned char    ktls; /* the kernel encrypts what is sent */
 #endif
 } wput_socket;
 
 wput_socket * socket_new();
 void          socket_set_default_timeout(int timeout);
+int           socket_get_default_timeout(void);
 wput_socket * socket_connect(const unsigned int ip, const unsigned short port);
-wput_socket * socket_listen(unsigned bindaddr, unsigned short * s_port);
+wput_socket * socket_connect_addrs(wput_addr * A, int n, unsigned short port, signed char * status);
+wput_socket * socket_listen(int family, unsigned bindaddr, unsigned short * s_port);
 wput_socket * socket_accept(wput_socket * sock);
 void          socket_close(wput_socket * sock);
+void          socket_finish(wput_socket * sock);
+int           socket_shutdown_write(wput_socket * sock);
 #ifdef HAVE_SSL
-int           socket_transform_to_ssl(wput_socket * sock);
+int           socket_transform_to_ssl(wput_socket * sock, wput_socket * resume);
+int           socket_set_tls_priority(char * priority);
+#  ifndef WIN32
+int           socket_tls_start(wput_socket * sock, wput_socket * resume);
+int           socket_tls_handshake(wput_socket * sock);
+#  endif
+#  ifdef HAVE_KTLS
+int           socket_ktls_tx(wput_socket * sock);
+#  endif
 #endif
 
 char * socket_read_line(wput_socket * sock);
 int    socket_read (wput_socket * sock, void *buf, size_t len);
 int    socket_write(wput_socket * sock, void *buf, size_t len);
+#ifdef HAVE_SENDFILE
+int    socket_sendfile(wput_socket * sock, int fd, size_t len, int ispipe);
+#endif
+#ifndef WIN32
+int    socket_try_read (wput_socket * sock, void *buf, size_t len);
+int    socket_try_write(wput_socket * sock, void *buf, size_t len);
+#  ifdef HAVE_SENDFILE
+int    socket_try_sendfile(wput_socket * sock, int fd, off_t * offset, size_t len);
+#  endif
+#endif
+
+unsigned int socket_get_rtt(wput_socket * sock);
+int socket_set_pacing(wput_socket * sock, unsigned int rate);
+int socket_set_nodelay(wput_socket * sock);
 
 int get_ip_addr(char* hostname, unsigned int * ip);
 int get_local_ip(int sockfd, char * local_ip);
+int socket_get_addr(int fd, wput_addr * A, int peer);
+char * printaddr(wput_addr * A);
 
 int socket_set_blocking(int sock, unsigned char block);
 int socket_is_data_writeable(int s, int timeout);
 int socket_is_data_readable(int s, int timeout);
-wput_socket * socket_timeout_connect(wput_socket * sock, struct sockaddr *remote_addr, size_t size, int timeout);
+wput_socket * socket_timeout_connect(wput_addr * A, int n, unsigned short port, int timeout, signed char * status);
+wput_socket * socket_connect_start(wput_addr * A, unsigned short port);
+int           socket_connect_finish(wput_socket * sock);
 wput_socket * proxy_init(proxy_settings * ps);
 wput_socket * proxy_listen(proxy_settings * ps, unsigned int * ip, unsigned short * port);
 wput_socket * proxy_accept(wput_socket * server);
@@ -0,0 +1,376 @@
+/* io_uring based transfer engine
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* Instead of read() and send() for every chunk, the reads of the local file
+ * and the sends into the data-connection are queued to the kernel through
+ * io_uring. We use the raw system calls, so there is no need for liburing.
+ *
+ * Reads are queued ahead for all free buffers. Sends have to stay in order,
+ * so there is only one in flight at a time. If the buffer that is to be sent
+ * next has not been read yet, its read and send are queued as a linked pair,
+ * so the kernel sends the data as soon as it has been read. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "uring.h"
+#include "utils.h"
+#include "constants.h"
+
+#ifdef HAVE_IO_URING
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* buffer states */
+#define UB_FREE    0
+#define UB_READING 1
+#define UB_READY   2
+#define UB_SENDING 3
+
+/* user_data of the queue entries: buffer-index and operation */
+#define UD_READ  0x10000
+#define UD_SEND  0x20000
+
+struct _uring {
+	int        fd;
+	unsigned   entries;
+
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	unsigned * sq_array;
+	unsigned   sq_local_tail;
+	unsigned   to_submit;
+	struct io_uring_sqe * sqes;
+
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	struct io_uring_cqe * cqes;
+
+	void     * sq_ring;
+	size_t     sq_ring_len;
+	void     * cq_ring;
+	size_t     cq_ring_len;
+	size_t     sqes_len;
+
+	int        fixed; /* buffers are registered */
+	int        nbufs;
+	size_t     bufsize;
+	char     * buf;
+	struct {
+		int   state;
+		off_t pos;
+		int   len;
+	} * b;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params * p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+static int sys_io_uring_enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+static int sys_io_uring_register(int fd, unsigned op, void * arg, unsigned n) {
+	return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/* IORING_OP_READ and IORING_OP_WRITE (like the probe itself) came with linux
+ * 5.6, linked requests with 5.3. older kernels set up the ring, but fail each
+ * of these requests with EINVAL */
+static int uring_supported(uring * R) {
+	struct io_uring_probe * P;
+	int read  = R->fixed ? IORING_OP_READ_FIXED  : IORING_OP_READ;
+	int write = R->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	int ok;
+
+	P  = calloc(1, sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+	ok = sys_io_uring_register(R->fd, IORING_REGISTER_PROBE, P, IORING_OP_LAST) == 0
+		&& read  <= P->last_op && (P->ops[read].flags  & IO_URING_OP_SUPPORTED)
+		&& write <= P->last_op && (P->ops[write].flags & IO_URING_OP_SUPPORTED);
+	free(P);
+	return ok;
+}
+
+uring * uring_new(size_t bufsize, int nbufs) {
+	struct io_uring_params p;
+	struct iovec * iov;
+	uring * R;
+	char  * sq;
+	char  * cq;
+	int     i;
+
+	memset(&p, 0, sizeof(p));
+	/* each buffer needs at most a read and a send at once */
+	i = sys_io_uring_setup(2 * nbufs, &p);
+	if(i < 0) return NULL;
+
+	R = calloc(1, sizeof(uring));
+	R->fd      = i;
+	R->entries = p.sq_entries;
+
+	R->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	R->cq_ring_len = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(R->cq_ring_len > R->sq_ring_len) R->sq_ring_len = R->cq_ring_len;
+		R->cq_ring_len = 0;
+	}
+	R->sq_ring = mmap(NULL, R->sq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, R->fd, IORING_OFF_SQ_RING);
+	if(R->sq_ring == MAP_FAILED) {
+		close(R->fd);
+		free(R);
+		return NULL;
+	}
+	R->cq_ring = R->sq_ring;
+	if(R->cq_ring_len) {
+		R->cq_ring = mmap(NULL, R->cq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, R->fd, IORING_OFF_CQ_RING);
+		if(R->cq_ring == MAP_FAILED) {
+			R->cq_ring = NULL;
+			uring_free(R);
+			return NULL;
+		}
+	}
+	R->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	R->sqes = mmap(NULL, R->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, R->fd, IORING_OFF_SQES);
+	if(R->sqes == MAP_FAILED) {
+		R->sqes = NULL;
+		uring_free(R);
+		return NULL;
+	}
+
+	sq = R->sq_ring;
+	cq = R->cq_ring;
+	R->sq_head  = (unsigned *) (sq + p.sq_off.head);
+	R->sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+	R->sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+	R->sq_array = (unsigned *) (sq + p.sq_off.array);
+	R->cq_head  = (unsigned *) (cq + p.cq_off.head);
+	R->cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+	R->cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+	R->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	R->sq_local_tail = *R->sq_tail;
+
+	R->nbufs   = nbufs;
+	R->bufsize = bufsize;
+	R->buf     = malloc(bufsize * nbufs);
+	R->b       = calloc(nbufs, sizeof(*R->b));
+
+	/* registered buffers save the kernel from mapping them for every request.
+	 * this may fail due to the locked-memory limit, so go on without then */
+	iov = malloc(nbufs * sizeof(struct iovec));
+	for(i = 0; i < nbufs; i++) {
+		iov[i].iov_base = R->buf + i * bufsize;
+		iov[i].iov_len  = bufsize;
+	}
+	R->fixed = sys_io_uring_register(R->fd, IORING_REGISTER_BUFFERS, iov, nbufs) == 0;
+	free(iov);
+	if(!uring_supported(R)) {
+		printout(vDEBUG, "io_uring: the kernel lacks the read- and write-operations\n");
+		uring_free(R);
+		return NULL;
+	}
+	printout(vDEBUG, "io_uring: %d entries, %d buffers of %d bytes (%sregistered)\n",
+		R->entries, nbufs, (int) bufsize, R->fixed ? "" : "not ");
+	return R;
+}
+
+void uring_free(uring * R) {
+	if(R->sqes)    munmap(R->sqes, R->sqes_len);
+	if(R->cq_ring && R->cq_ring_len) munmap(R->cq_ring, R->cq_ring_len);
+	munmap(R->sq_ring, R->sq_ring_len);
+	close(R->fd);
+	if(R->buf) free(R->buf);
+	if(R->b)   free(R->b);
+	free(R);
+}
+
+static struct io_uring_sqe * uring_get_sqe(uring * R) {
+	struct io_uring_sqe * sqe;
+	unsigned idx;
+	if(R->sq_local_tail - __atomic_load_n(R->sq_head, __ATOMIC_ACQUIRE) >= R->entries)
+		return NULL;
+	idx = R->sq_local_tail & *R->sq_mask;
+	R->sq_array[idx] = idx;
+	R->sq_local_tail++;
+	R->to_submit++;
+	sqe = &R->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* wait for the completion of what is still in flight and throw it away.
+ * returns -1 if the kernel does not let us wait anymore */
+static int uring_drain(uring * R, int inflight) {
+	unsigned head;
+	int res;
+
+	while(inflight > 0) {
+		do
+			res = sys_io_uring_enter(R->fd, 0, 1, IORING_ENTER_GETEVENTS);
+		while(res == -1 && errno == EINTR);
+		if(res < 0) return -1;
+		head = *R->cq_head;
+		while(head != __atomic_load_n(R->cq_tail, __ATOMIC_ACQUIRE)) {
+			head++;
+			inflight--;
+		}
+		__atomic_store_n(R->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/* queue a read or send of buffer i */
+static void uring_prep(uring * R, int i, int fd, int send, int link) {
+	struct io_uring_sqe * sqe = uring_get_sqe(R);
+	if(R->fixed) {
+		sqe->opcode    = send ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = i;
+	} else
+		sqe->opcode    = send ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd        = fd;
+	sqe->addr      = (unsigned long) (R->buf + i * R->bufsize);
+	sqe->len       = R->b[i].len;
+	/* sockets have no position */
+	sqe->off       = send ? (__u64) -1 : (__u64) R->b[i].pos;
+	sqe->flags     = link ? IOSQE_IO_LINK : 0;
+	sqe->user_data = (send ? UD_SEND : UD_READ) | i;
+}
+
+off_t uring_send_file(uring * R, wput_socket * sock, int fd, off_t offset, off_t length,
+                      void (*progress)(void * arg, int bytes), void * arg) {
+	struct io_uring_cqe * cqe;
+	off_t    readpos  = offset;
+	off_t    sendpos  = offset;
+	off_t    end      = offset + length;
+	int      sending  = -1;
+	int      inflight = 0;
+	int      err      = 0;
+	int      i, res;
+	unsigned head;
+
+	for(i = 0; i < R->nbufs; i++)
+		R->b[i].state = UB_FREE;
+
+	while(1) {
+		/* queue reads for all free buffers. the one that is to be sent next
+		 * gets its send linked to the read */
+		for(i = 0; i < R->nbufs && !err && readpos < end; i++) {
+			if(R->b[i].state != UB_FREE) continue;
+			R->b[i].pos = readpos;
+			R->b[i].len = end - readpos < (off_t) R->bufsize ? end - readpos : R->bufsize;
+			readpos    += R->b[i].len;
+			if(sending == -1 && R->b[i].pos == sendpos) {
+				uring_prep(R, i, fd, 0, 1);
+				uring_prep(R, i, sock->fd, 1, 0);
+				R->b[i].state = UB_SENDING;
+				sending = i;
+				inflight += 2;
+			} else {
+				uring_prep(R, i, fd, 0, 0);
+				R->b[i].state = UB_READING;
+				inflight++;
+			}
+		}
+		/* otherwise send the next buffer as soon as it is read */
+		for(i = 0; i < R->nbufs && !err && sending == -1; i++)
+			if(R->b[i].state == UB_READY && R->b[i].pos == sendpos) {
+				uring_prep(R, i, sock->fd, 1, 0);
+				R->b[i].state = UB_SENDING;
+				sending = i;
+				inflight++;
+			}
+
+		if(inflight == 0) break;
+
+		__atomic_store_n(R->sq_tail, R->sq_local_tail, __ATOMIC_RELEASE);
+		do
+			res = sys_io_uring_enter(R->fd, R->to_submit, 1, IORING_ENTER_GETEVENTS);
+		while(res == -1 && errno == EINTR);
+		if(res < 0) {
+			/* what is not submitted yet never will be, but the requests of
+			 * earlier rounds still use the buffers */
+			if(!err) err = errno;
+			if(uring_drain(R, inflight - R->to_submit) < 0) {
+				/* leave the buffers to the kernel rather than free them under it */
+				printout(vDEBUG, "io_uring: cannot wait for the requests in flight\n");
+				R->buf = NULL;
+			}
+			break;
+		}
+		R->to_submit -= res;
+
+		head = *R->cq_head;
+		while(head != __atomic_load_n(R->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &R->cqes[head & *R->cq_mask];
+			i   = cqe->user_data & 0xffff;
+			res = cqe->res;
+			head++;
+			inflight--;
+
+			if(cqe->user_data & UD_READ) {
+				/* a short read means that the file has shrunk */
+				if(res != R->b[i].len) {
+					if(!err) err = res < 0 ? -res : EIO;
+				} else if(R->b[i].state == UB_READING)
+					R->b[i].state = UB_READY;
+				continue;
+			}
+
+			/* send-completions. -ECANCELED is the result of a failed linked read */
+			sending = -1;
+			R->b[i].state = UB_FREE;
+			if(res < 0) {
+				if(!err) err = -res;
+				continue;
+			}
+			/* a short send is completed the usual way */
+			if(res < R->b[i].len &&
+			   socket_write(sock, R->buf + i * R->bufsize + res, R->b[i].len - res) != R->b[i].len - res) {
+				if(!err) err = errno ? errno : EIO;
+				continue;
+			}
+			sendpos += R->b[i].len;
+			if(progress) progress(arg, R->b[i].len);
+		}
+		__atomic_store_n(R->cq_head, head, __ATOMIC_RELEASE);
+
+		/* after an error, only wait for what is still in flight */
+		if(err && inflight == 0) break;
+	}
+	if(err) {
+		errno = err;
+		return ERR_FAILED;
+	}
+	return sendpos - offset;
+}
+#else
+uring * uring_new(size_t bufsize, int nbufs) {
+	return NULL;
+}
+void uring_free(uring * R) { }
+off_t uring_send_file(uring * R, wput_socket * sock, int fd, off_t offset, off_t length,
+                      void (*progress)(void * arg, int bytes), void * arg) {
+	return ERR_FAILED;
+}
+#endif
@@ -0,0 +1,20 @@
+#ifndef __URING_H
+#define __URING_H
+
+#include "config.h"
+#include "socketlib.h"
+
+typedef struct _uring uring;
+
+/* set up an io_uring with nbufs (registered) buffers of bufsize bytes.
+ * returns NULL if the kernel does not support io_uring */
+uring * uring_new(size_t bufsize, int nbufs);
+void    uring_free(uring * R);
+
+/* send length bytes of fd, starting at offset, through the socket.
+ * progress is called with the number of bytes after each completed send.
+ * returns the number of bytes sent or ERR_FAILED (errno set) */
+off_t   uring_send_file(uring * R, wput_socket * sock, int fd, off_t offset, off_t length,
+                        void (*progress)(void * arg, int bytes), void * arg);
+
+#endif
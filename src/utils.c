@@ -74,10 +74,11 @@ char * int64toa(off_t num, char * buf, int con_unit){
 
 char * get_port_fmt(int ip, unsigned int port) {
     unsigned char b[6];
+    unsigned short p = htons(port);
     static char buf[6 * 4];
     /* TODO USS have we got an endian problem here for the ip-address */
     *         (int *) b    = ip;
-    *(unsigned int *)(b+4) = htons(port);
+    memcpy(b + 4, &p, 2);
     sprintf(buf, "%d,%d,%d,%d,%d,%d", b[0], b[1], b[2], b[3], b[4], b[5]);
     return buf;        
 }
@@ -35,4 +35,8 @@ enum log_options { LOG_VERBOSE, LOG_NOTQUIET, LOG_NONVERBOSE, LOG_ALWAYS };
 
 char *read_whole_line( FILE *);
 
+/* Entries are handed to wput's directory cache as they are parsed. */
+struct fileinfo;
+void ls_store( struct fileinfo *);
+
 char nextchr();
@@ -0,0 +1,322 @@
+/* worker processes for parallel uploads
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* When --parallel is given, all fsessions are collected first (just like
+ * in sorted mode). Then N worker processes are forked, each one having its
+ * own control-connection. They pull the next fsession from a job-counter
+ * that lives in shared memory, so a worker keeps its connection (and thus
+ * its CWD and TYPE state) for all files it uploads.
+ * The outcome of every job is written back to its slot, so the parent can
+ * put the statistics together once all workers are finished.
+ *
+ * With --segments a single large file is split into ranges that are sent
+ * at once over several connections using REST+STOR. The leading range is
+ * sent by ourselves, the others by child processes, which are held back
+ * until our STOR has been accepted (it might truncate the remote file). */
+
+#include <errno.h>
+#include "wput.h"
+#include "ftp.h"
+#include "utils.h"
+#include "_queue.h"
+#include "worker.h"
+#include "ratelimit.h"
+#include "pool.h"
+
+#ifndef WIN32
+#  include <sys/mman.h>
+#  include <sys/wait.h>
+#endif
+
+#ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* splitting smaller pieces does not pay off the additional logins */
+#define SEGMENT_MIN_SIZE (1024 * 1024)
+
+#define SLOT_FREE    0
+#define SLOT_CLAIMED 1
+#define SLOT_DONE    2
+
+typedef struct _worker_slot {
+	int   state;
+	int   res;
+	int   transfered;
+	off_t transfered_bytes;
+} worker_slot;
+
+typedef struct _worker_queue {
+	int         next;  /* index of the next unclaimed job */
+	int         count;
+	worker_slot slot[1];
+} worker_queue;
+
+#ifndef WIN32
+/* the worker loop. takes jobs until the queue is empty and exits afterwards */
+static void worker_run(worker_queue * Q, _fsession ** jobs) {
+	ftp_con * ftp = NULL;
+	int i;
+
+	while( (i = __sync_fetch_and_add(&Q->next, 1)) < Q->count) {
+		unsigned short transfered = opt.transfered;
+		off_t          bytes      = opt.transfered_bytes;
+
+		Q->slot[i].state = SLOT_CLAIMED;
+		Q->slot[i].res   = fsession_process_file(jobs[i], ftp);
+		/* keep the connection for the next job, exactly like the sorted loop does */
+		ftp = jobs[i]->ftp;
+
+		Q->slot[i].transfered       = opt.transfered - transfered;
+		Q->slot[i].transfered_bytes = opt.transfered_bytes - bytes;
+		__sync_synchronize();
+		Q->slot[i].state = SLOT_DONE;
+	}
+	if(ftp) ftp_quit(ftp);
+	pool_close();
+	fflush(opt.output);
+	_exit(0);
+}
+#endif
+
+void fsession_process_parallel(void) {
+#ifndef WIN32
+	_fsession *  F;
+	_fsession ** jobs;
+	_fsession *  rest = NULL;
+	worker_queue * Q;
+	pid_t * pids;
+	size_t qsize;
+	int count = 0;
+	int workers;
+	int i;
+	unsigned char backupbarstyle = opt.barstyle;
+
+	for(F = fsession_queue_entry_point; F != NULL; F = F->next)
+		count++;
+	if(count < 2) return;
+
+	workers = opt.parallel < count ? opt.parallel : count;
+	jobs    = malloc(count * sizeof(_fsession *));
+	pids    = malloc(workers * sizeof(pid_t));
+	for(i = 0, F = fsession_queue_entry_point; F != NULL; F = F->next)
+		jobs[i++] = F;
+
+	qsize = sizeof(worker_queue) + (count - 1) * sizeof(worker_slot);
+	Q = mmap(NULL, qsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(Q == MAP_FAILED) {
+		printout(vMORE, _("Warning: "));
+		printout(vMORE, _("Cannot create the job-queue (%s). Uploading sequentially.\n"), strerror(errno));
+		free(jobs);
+		free(pids);
+		return;
+	}
+	memset(Q, 0, qsize);
+	Q->count = count;
+
+	printout(vNORMAL, _("Uploading %d files using %d connections.\n"), count, workers);
+	/* several processes writing to the same terminal would garble the
+	 * progressbar. also flush, so that no output gets duplicated by fork() */
+	opt.barstyle = 0;
+	fflush(opt.output);
+	fflush(stdout);
+	ratelimit_split(workers);
+
+	for(i = 0; i < workers; i++) {
+		pids[i] = fork();
+		if(pids[i] == 0)
+			worker_run(Q, jobs);
+		if(pids[i] == -1) {
+			printout(vMORE, _("Warning: "));
+			printout(vMORE, _("Cannot start worker process (%s).\n"), strerror(errno));
+			break;
+		}
+	}
+	/* the workers took their parts of the limit along */
+	ratelimit_join(workers);
+	workers = i;
+
+	for(i = 0; i < workers; i++)
+		while(waitpid(pids[i], NULL, 0) == -1 && errno == EINTR) ;
+
+	opt.barstyle = backupbarstyle;
+
+	/* collect the statistics. fsessions that have not been claimed (e.g.
+	 * if we were unable to fork at all) stay in the queue */
+	for(i = count - 1; i >= 0; i--) {
+		worker_slot * S = &Q->slot[i];
+		if(S->state == SLOT_FREE) {
+			jobs[i]->next = rest;
+			rest = jobs[i];
+			continue;
+		}
+		if(S->state == SLOT_CLAIMED) {
+			printout(vLESS, _("Error: "));
+			printout(vLESS, _("Worker died while uploading `%s'.\n"), jobs[i]->local_fname);
+			opt.failed++;
+		} else if(S->res == -1) opt.failed++;
+		else if(S->res == -2)   opt.skipped++;
+		opt.transfered       += S->transfered;
+		opt.transfered_bytes += S->transfered_bytes;
+		free_fsession(jobs[i]);
+	}
+	fsession_queue_entry_point = rest;
+
+	munmap(Q, qsize);
+	free(jobs);
+	free(pids);
+#endif
+}
+
+#ifndef WIN32
+/* upload the range [from, to) of F on a connection of our own */
+static void segment_run(_fsession * F, off_t from, off_t to, int go) {
+	_fsession S = *F;
+	int res;
+
+	S.ftp          = NULL;
+	S.host         = ftp_new_host(F->host->ip, F->host->hostname ? cpy(F->host->hostname) : NULL, F->host->port);
+	S.target_fsize = from;
+	S.local_fsize  = to;
+	S.segment      = SEGMENT_TRAILING;
+	S.segment_go   = go;
+	S.done         = 0;
+	S.next         = NULL;
+
+	/* the file is not complete unless all segments are done, which is the
+	 * parents task to check. progress-output is left to the parent as well */
+	opt.unlink   = 0;
+	opt.chmod    = 0;
+	opt.wait     = 0;
+	opt.barstyle = 0;
+	/* the pooled connections belong to the parent */
+	opt.pool     = 0;
+	if(opt.verbose == vNORMAL) opt.verbose = vLESS;
+
+	res = fsession_process_file(&S, NULL);
+	if(S.ftp) ftp_quit(S.ftp);
+	fflush(opt.output);
+	_exit(res == 0 ? 0 : 1);
+}
+#endif
+
+int fsession_send_segments(_fsession * F) {
+#ifndef WIN32
+	off_t start = F->target_fsize > 0 ? F->target_fsize : 0;
+	off_t fsize = F->local_fsize;
+	off_t seglen;
+	off_t size  = -1;
+	pid_t * pids;
+	int   go[2];
+	int   segments = opt.segments;
+	int   failed   = 0;
+	int   status;
+	int   res;
+	int   i, j;
+	unsigned char backupunlink = opt.unlink;
+
+	if(F->binary != TYPE_I || !F->local_fname) return 1;
+	if((fsize - start) / SEGMENT_MIN_SIZE < segments)
+		segments = (fsize - start) / SEGMENT_MIN_SIZE;
+	if(segments < 2) return 1;
+
+	/* only servers that honour REST for STOR without truncating are
+	 * usable, which is what REST STREAM promises */
+	res = ftp_do_feat(F->ftp);
+	if(SOCK_ERROR(res)) return res;
+	if(!(F->ftp->features & FEAT_REST_STREAM)) {
+		printout(vMORE, _("Server does not announce REST STREAM. Not splitting the file.\n"));
+		return 1;
+	}
+	if(pipe(go) == -1) return 1;
+
+	seglen = (fsize - start) / segments;
+	printout(vNORMAL, _("Uploading in %d segments of %s bytes.\n"), segments, legible(seglen));
+	fflush(opt.output);
+	fflush(stdout);
+	/* all segments together stay within the limit */
+	ratelimit_split(segments);
+
+	pids = malloc(segments * sizeof(pid_t));
+	for(i = 1; i < segments; i++) {
+		pids[i] = fork();
+		if(pids[i] == 0) {
+			close(go[1]);
+			segment_run(F, start + i * seglen, i == segments - 1 ? fsize : start + (i + 1) * seglen, go[0]);
+		}
+		if(pids[i] == -1) {
+			printout(vMORE, _("Warning: "));
+			printout(vMORE, _("Cannot start worker process (%s).\n"), strerror(errno));
+			failed++;
+			break;
+		}
+	}
+	close(go[0]);
+
+	/* the leading segment uses the existing connection */
+	F->segment     = SEGMENT_LEADING;
+	F->segment_go  = go[1];
+	F->local_fsize = start + seglen;
+	opt.unlink     = 0;
+	while((res = do_send(F)) == ERR_RETRY) {
+		retry_wait(F);
+		if(!( F->retry > 0 || F->retry == -1)) {
+			res = ERR_FAILED;
+			break;
+		}
+	}
+	/* release the others in any case, so that we can wait for them */
+	if(F->segment_go != -1) close(F->segment_go);
+	F->segment     = SEGMENT_NONE;
+	F->local_fsize = fsize;
+	opt.unlink     = backupunlink;
+	ratelimit_join(segments);
+
+	for(j = 1; j < i; j++) {
+		while(waitpid(pids[j], &status, 0) == -1 && errno == EINTR) ;
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+	free(pids);
+
+	if(res < 0) return res;
+
+	if(!failed) {
+		res = ftp_do_size(F->ftp, F->target_fname, &size);
+		if(SOCK_ERROR(res)) return res;
+	}
+	if(failed || size != fsize) {
+		printout(vLESS, _("Segmented upload failed. Sending the file as a whole.\n"));
+		opt.transfered--;
+		F->target_fsize = -1;
+		F->done         = 0;
+		return 1;
+	}
+	/* do_send() counted the leading segment only */
+	opt.transfered_bytes += fsize - start - seglen;
+	printout(vNORMAL, _("All %d segments sent. Remote size is %l bytes.\n"), segments, size);
+	F->done = 1;
+	if(opt.unlink) {
+		printout(vMORE, _("Removing source file `%s'\n"), F->local_fname);
+		unlink(F->local_fname);
+	}
+	return 0;
+#else
+	return 1;
+#endif
+}
@@ -0,0 +1,14 @@
+#ifndef __WORKER_H
+#define __WORKER_H
+
+#include "wput.h"
+
+/* uploads the fsession-queue using opt.parallel worker processes.
+ * fsessions that could not be handed to a worker remain in the queue */
+void fsession_process_parallel(void);
+
+/* uploads a large file in opt.segments pieces at once.
+ * error-levels: 1 (send the file the usual way), ERR_FAILED, SOCK_ERRORs */
+int  fsession_send_segments(_fsession * F);
+
+#endif
@@ -53,6 +53,10 @@
 #include "progress.h"
 #include "_queue.h"
 #include "utils.h"
+#include "worker.h"
+#include "multiplex.h"
+#include "manifest.h"
+#include "pool.h"
 
 extern char *optarg;
 
@@ -107,7 +111,11 @@ int main(int argc, char *argv[]){
 
 	/* create the ssl framework */
 #ifdef HAVE_SSL
+#  ifdef WIN32
 	SSL_library_init();
+#  else
+	gnutls_global_init();
+#  endif
 #endif
 
 	opt.sbuf      = malloc(82);
@@ -122,6 +130,10 @@ int main(int argc, char *argv[]){
 	opt.bindaddr  = INADDR_ANY;
 	opt.barstyle  = 1;
 	opt.ps.bind   = 1;
+	opt.pool      = 4;
+	opt.pool_per_host = 1;
+	opt.pool_idle = 60;
+	opt.dns_ttl   = 300;
 	opt.session_start = wtimer_alloc();
 	
 	opt.resume_table.small_large = RESUME_TABLE_UPLOAD;
@@ -188,6 +200,9 @@ int main(int argc, char *argv[]){
 		opt.ps.type = PROXY_OFF;
 	}
 	
+	if(opt.manifest && manifest_open(opt.manifest) == ERR_FAILED)
+		opt.manifest = NULL;
+	
         /* WDEL separate the urls from a potential file and ensure that the urls end in a '/' */
         if(opt.wdel) separate_urls();
         
@@ -202,8 +217,14 @@ int main(int argc, char *argv[]){
         else queue_process(0); /* later process in WDEL */
 	
 	/* now we've everything we need or are already done */
-	if(opt.sorturls) {
+	if(opt.sorturls || opt.parallel > 1 || opt.multiplex > 1) {
+		/* the workers leave anything they could not process in the queue */
+		if(opt.multiplex > 1)
+			fsession_process_multiplex();
+		if(opt.parallel > 1)
+			fsession_process_parallel();
 		printout(vDEBUG, "Transmitting sorted fsessions\n");
+		if(opt.prewarm) pool_prewarm(fsession_queue_entry_point);
 		while(fsession_queue_entry_point != NULL) {
 				int res = fsession_process_file(fsession_queue_entry_point, opt.curftp);
 				if(res == -1)      opt.failed++;
@@ -215,6 +236,8 @@ int main(int argc, char *argv[]){
 
 	/* finally close any existing connections */
 	if(opt.curftp) ftp_quit(opt.curftp);
+	pool_close();
+	if(opt.manifest) manifest_close();
 	
 	if(opt.transfered == 0 && opt.skipped == 0 && opt.failed == 0)
 		printout(vNORMAL, _("Nothing done. Try `%s --help'.\n"), argv[0]);
@@ -316,7 +339,15 @@ int set_option(char * com, char * val) {
             return -1;
       return 0;
   case 'b':
-      if(!strncasecmp(com, "bind-address", 13)) {
+      if(!strncasecmp(com, "buffer_size", 12)) {
+          opt.buffer_size = atoi(val);
+          while(*val) {
+            if(*val == 'K') opt.buffer_size *= 1024;
+            if(*val == 'M') opt.buffer_size *= 1024 * 1024;
+            val++;
+          }
+          return 0;
+      } else if(!strncasecmp(com, "bind-address", 13)) {
             if(get_ip_addr(optarg, &opt.bindaddr) == -1) {
 				printout(vMORE, _("Error: "));
 				printout(vMORE, _("`%s' could not be resolved. "), optarg);
@@ -324,6 +355,9 @@ int set_option(char * com, char * val) {
                 exit(4);
             }
             return 0;
+      } else if(!strncasecmp(com, "block_mode", 11)) {
+          opt.block_mode = !strncasecmp(val, "on", 3);
+          return 0;
         } else return -1;
   case 'c':
       if(!strncasecmp(com, "connection_mode", 16)) {
@@ -342,7 +376,27 @@ int set_option(char * com, char * val) {
           if ((*endptr == '\0') && ((m & 0777777) == m)) /* is valid mode */
               opt.chmod = m;
           else return -2;
-      } else return -1;
+      } else if(!strncasecmp(com, "compress", 9)) {
+          if(opt.wdel) return 0; /* disabled for wdel */
+          if(!strncasecmp(val, "on", 3))
+              opt.compress = 6;
+          else if(!strncasecmp(val, "off", 4))
+              opt.compress = 0;
+          else if(atoi(val) >= 1 && atoi(val) <= 9)
+              opt.compress = atoi(val);
+          else return -2;
+      } else if(!strncasecmp(com, "compress_skip", 14))
+          opt.compress_skip = cpy(val);
+      else if(!strncasecmp(com, "checksum_file", 14)) {
+          if(opt.wdel) return 0; /* disabled for wdel */
+          opt.checksum_file = cpy(val);
+      }
+      else return -1;
+      return 0;
+  case 'd':
+      if(!strncasecmp(com, "dns_ttl", 8))
+          opt.dns_ttl = atoi(val);
+      else return -1;
       return 0;
 #ifdef HAVE_SSL
   case 'f':
@@ -352,9 +406,22 @@ int set_option(char * com, char * val) {
           return -1;
       return 0;
 #endif
+  case 'k':
+      if(!strncasecmp(com, "kernel_pacing", 14))
+          opt.kernel_pacing = !strncasecmp(val, "on", 3);
+      else return -1;
+      return 0;
   case 'm':
       if(!strncmp(com, "email_address", 13))
           opt.email_address = cpy(val);
+      else if(!strncasecmp(com, "manifest", 9)) {
+          if(opt.wdel) return 0; /* disabled for wdel */
+          opt.manifest = cpy(val);
+      }
+      else if(!strncasecmp(com, "multiplex", 10)) {
+          if(opt.wdel) return 0; /* disabled for wdel */
+          opt.multiplex = atoi(val);
+      }
       else return -1;
       return 0;
   case 'p':
@@ -382,8 +449,24 @@ int set_option(char * com, char * val) {
           opt.ps.pass = cpy(val);
       else if(!strncasecmp(com, "proxy_bind", 11))
           opt.ps.bind = !strncasecmp(val, "on", 3);
+      else if(!strncasecmp(com, "parallel", 9)) {
+          if(opt.wdel) return 0; /* disabled for wdel */
+          opt.parallel = atoi(val);
+      }
       else if(!strncasecmp(com, "passwordfile", 13) || !strncasecmp(com, "password_file", 14))
           read_password_file(val);
+      else if(!strncasecmp(com, "pipeline", 9))
+          opt.pipeline = !strncasecmp(val, "on", 3);
+      else if(!strncasecmp(com, "prefetch_listing", 17))
+          opt.prefetch_listing = !strncasecmp(val, "on", 3);
+      else if(!strncasecmp(com, "pool", 5))
+          opt.pool = atoi(val);
+      else if(!strncasecmp(com, "pool_per_host", 14))
+          opt.pool_per_host = atoi(val) > 0 ? atoi(val) : 1;
+      else if(!strncasecmp(com, "pool_idle", 10))
+          opt.pool_idle = atoi(val);
+      else if(!strncasecmp(com, "prewarm", 8))
+          opt.prewarm = atoi(val);
       else return -1;
       return 0;
     case 'r':
@@ -396,16 +479,34 @@ int set_option(char * com, char * val) {
             val++;
           }
           printout(vDEBUG, "Rate-Limit is set to %d Bytes per second\n", opt.speed_limit);
+        } else if(!strncasecmp(com, "rate_burst", 11)) {
+          opt.rate_burst = atoi(val);
+          while(*val) {
+            if(*val == 'K') opt.rate_burst *= 1024;
+            if(*val == 'M') opt.rate_burst *= 1024 * 1024;
+            val++;
+          }
         } else if(!strncasecmp(com, "retry_count", 12))
             opt.retry = atoi(val);
+        else if(!strncasecmp(com, "read_ahead", 11))
+            opt.read_ahead = atoi(val);
         else return -1;
         return 0;
+  case 'i':
+      if(!strncasecmp(com, "io_uring", 9))
+          opt.io_uring = !strncasecmp(val, "on", 3);
+      else return -1;
+      return 0;
   case 's':
       //if(!strncmp(com, "script_file", 12))
         //load_script(val);
       //else
       if(!strncasecmp(com, "sort_urls", 10))
         opt.sorturls = !strncasecmp(val, "on", 3);
+      else if(!strncasecmp(com, "segments", 9)) {
+          if(opt.wdel) return 0; /* disabled for wdel */
+          opt.segments = atoi(val);
+      }
       else return -1;
       return 0;
   case 't':
@@ -418,6 +519,15 @@ int set_option(char * com, char * val) {
         opt.time_offset     = atoi(val);
       else if(!strncasecmp(com, "timedeviation", 14))
         opt.time_deviation  = atoi(val);
+#ifdef HAVE_SSL
+      else if(!strncasecmp(com, "tls_priority", 13)) {
+        /* another cipher than the one asked for is no fallback */
+        if(socket_set_tls_priority(val) == ERR_FAILED) {
+          printout(vLESS, _("Exiting.\n"));
+          exit(4);
+        }
+      }
+#endif
       else if(!strncasecmp(com, "transfer_type", 14)) {
 	if(opt.wdel) return 0; /* disabled for wdel */
         if(!strncasecmp(val, "auto", 5)) opt.binary = TYPE_UNDEFINED;
@@ -427,7 +537,11 @@ int set_option(char * com, char * val) {
       } else return -1;
       return 0;
   case 'v':
-      if(!strncasecmp(com, "verbosity", 10)) {
+      if(!strncasecmp(com, "verify", 7)) {
+          if(opt.wdel) return 0; /* disabled for wdel */
+          opt.verify = !strncasecmp(val, "on", 3);
+          return 0;
+      } else if(!strncasecmp(com, "verbosity", 10)) {
         char * levels[] = {"quite", "less", "normal", "more", "debug"};
         int i;
         for(i=0;i<5;i++)
@@ -635,7 +749,29 @@ void commandlineoptions(int argc, char * argv[]){
 		{"waitretry", 1, 0, 0},         
 		{"chmod", 2, 0, 'm'},
 		{"disable-tls", 0, 0, 0},
-		{0, 0, 0, 0}                    //40
+		{"parallel", 1, 0, 0},           //40
+		{"segments", 1, 0, 0},
+		{"buffer-size", 1, 0, 0},
+		{"read-ahead", 1, 0, 0},
+		{"io-uring", 0, 0, 0},
+		{"limit-burst", 1, 0, 0},        //45
+		{"kernel-pacing", 0, 0, 0},
+		{"compress", 2, 0, 0},
+		{"compress-skip", 1, 0, 0},
+		{"verify", 0, 0, 0},
+		{"checksum-file", 1, 0, 0},      //50
+		{"manifest", 1, 0, 0},           //51
+		{"pipeline", 0, 0, 0},           //52
+		{"prefetch-listing", 0, 0, 0},   //53
+		{"pool", 1, 0, 0},
+		{"pool-per-host", 1, 0, 0},      //55
+		{"pool-idle", 1, 0, 0},
+		{"prewarm", 1, 0, 0},
+		{"dns-ttl", 1, 0, 0},
+		{"block-mode", 0, 0, 0},
+		{"tls-priority", 1, 0, 0},       //60
+		{"multiplex", 1, 0, 0},
+		{0, 0, 0, 0}
       };
     while (1)
     {
@@ -669,6 +805,12 @@ void commandlineoptions(int argc, char * argv[]){
 #endif
 #ifdef HAVE_SSL
                 fprintf(opt.output, "HAVE_SSL\n");
+#endif
+#ifdef HAVE_KTLS
+                fprintf(opt.output, "HAVE_KTLS\n");
+#endif
+#ifdef HAVE_ZLIB
+                fprintf(opt.output, "HAVE_ZLIB\n");
 #endif
                 fprintf(opt.output, "\nUsing %d-Bytes for off_t\n", (int) sizeof(off_t));
                 exit(0);
@@ -692,6 +834,28 @@ void commandlineoptions(int argc, char * argv[]){
                 opt.retry_interval = atoi(optarg);                  break;
 	    case 39: //disable-tls
 		    opt.tls = 2;                                    break;
+            case 40: set_option("parallel", optarg);         break;
+            case 41: set_option("segments", optarg);         break;
+            case 42: set_option("buffer_size", optarg);      break;
+            case 43: set_option("read_ahead", optarg);       break;
+            case 44: set_option("io_uring", "on");           break;
+            case 45: set_option("rate_burst", optarg);       break;
+            case 46: set_option("kernel_pacing", "on");      break;
+            case 47: set_option("compress", optarg ? optarg : "on"); break;
+            case 48: set_option("compress_skip", optarg);    break;
+            case 49: set_option("verify", "on");             break;
+            case 50: set_option("checksum_file", optarg);    break;
+            case 51: set_option("manifest", optarg);         break;
+            case 52: set_option("pipeline", "on");           break;
+            case 53: set_option("prefetch_listing", "on");   break;
+            case 54: set_option("pool", optarg);             break;
+            case 55: set_option("pool_per_host", optarg);    break;
+            case 56: set_option("pool_idle", optarg);        break;
+            case 57: set_option("prewarm", optarg);          break;
+            case 58: set_option("dns_ttl", optarg);          break;
+            case 59: set_option("block_mode", "on");         break;
+            case 60: set_option("tls_priority", optarg);     break;
+            case 61: set_option("multiplex", optarg);        break;
             default:
                 fprintf(stderr, _("Option %s should not appear here :|\n"), long_options[option_index].name);
             }
@@ -797,11 +961,33 @@ void commandlineoptions(int argc, char * argv[]){
 "       --skip-larger           do not upload files if remote size is larger\n"
 "       --skip-existing         do not upload files that exist remotely\n"
 "  -N,  --timestamping          don't re-upload files unless newer than remote\n"
+"       --manifest=FILE         skip files that did not change since they were\n"
+"                               uploaded by a run with the same FILE\n"
 "  -T,  --timeout=10th-SECONDS  set various timeouts to 10th-SECONDS\n"
 "  -w,  --wait=10th-SECONDS     wait 10th-SECONDS between uploads. (default: 0)\n"
 "       --random-wait           wait from 0...2*WAIT secs between uploads.\n"
 "       --waitretry=SECONDS     wait SECONDS between retries of an upload\n"
+"       --pipeline              send independent commands without waiting\n"
+"       --block-mode            keep the data-connection open using MODE B\n"
+"       --prefetch-listing      read whole directories using MLSD if possible\n"
+"       --pool=N                keep up to N idle logins for reuse (def. 4)\n"
+"       --pool-per-host=N       keep at most N of them per server (def. 1)\n"
+"       --pool-idle=SECONDS     close them after SECONDS of idleness (def. 60)\n"
+"       --prewarm=N             log in to the first N accounts in advance\n"
+"       --dns-ttl=SECONDS       reuse resolved hostnames for SECONDS (def. 300)\n"
 "  -l,  --limit-rate=RATE       limit upload rate to RATE\n"
+"       --limit-burst=SIZE      send at most SIZE bytes at once when limited\n"
+"       --kernel-pacing         let the kernel pace the data when limited\n"
+"       --compress[=LEVEL]      compress the data using MODE Z if possible\n"
+"       --compress-skip=EXTS    do not compress files ending in EXTS (a,b,...)\n"
+"       --verify                let the server confirm the checksum of each file\n"
+"       --checksum-file=FILE    append the SHA-256 of each file sent to FILE\n"
+"       --buffer-size=SIZE      read and send SIZE bytes at once (def. auto)\n"
+"       --read-ahead=N          read up to N buffers ahead in a separate thread\n"
+"       --io-uring              let the kernel read and send files via io_uring\n"
+"       --parallel=N            upload N files at once using N connections\n"
+"       --multiplex=N           upload up to N files at once in one process\n"
+"       --segments=N            split large files into N parts sent at once\n"
 "  -nd, --no-directories        do not create any directories\n"
 "  -Y,  --proxy=http/socks/off  set proxy type or turn off\n"
 "       --proxy-user=NAME       set the proxy-username to NAME\n"
@@ -817,7 +1003,8 @@ void commandlineoptions(int argc, char * argv[]){
 #ifdef HAVE_SSL
 			fprintf(stderr, _(
 "       --force-tls             force the usage of TLS\n"
-"       --disable-tls           disable the usage of TLS\n"));
+"       --disable-tls           disable the usage of TLS\n"
+"       --tls-priority=PRIO     GnuTLS priority-string, aes-gcm or chacha20\n"));
 #endif
 /*"  -f,  --peace                 force wput not to be aggressive\n"*/
 /*"  -S,  --script=FILE      TODO USS load a wput-script\n\n"*/
@@ -140,6 +140,27 @@ struct global_options {
 
   unsigned short int retry_interval;
   unsigned       int speed_limit;
+  unsigned short int parallel;
+  unsigned short int multiplex;     /* connections on one event-loop */
+  unsigned short int segments;
+  unsigned       int buffer_size; /* 0: sized automatically */
+  unsigned short int read_ahead;  /* number of buffers, 0: disabled */
+  unsigned char      io_uring;
+  unsigned       int rate_burst;  /* 0: sized automatically */
+  unsigned char      kernel_pacing;
+  unsigned char      compress;      /* zlib-level for MODE Z, 0: disabled */
+  char             * compress_skip; /* extensions not to compress, NULL: default */
+  unsigned char      verify;        /* let the server confirm the checksum */
+  char             * checksum_file; /* sha256sum-like list of the files sent */
+  char             * manifest;      /* files uploaded by earlier runs */
+  unsigned char      pipeline;      /* send independent commands at once */
+  unsigned char      block_mode;    /* MODE B, one data-connection for all files */
+  unsigned char      prefetch_listing; /* MLSD a directory instead of SIZE/MDTM */
+  unsigned short int pool;          /* idle connections kept, 0: disabled */
+  unsigned short int pool_per_host;
+  unsigned       int pool_idle;     /* seconds until they are closed */
+  unsigned short int prewarm;       /* accounts to log in to in advance */
+  unsigned       int dns_ttl;       /* seconds a resolved hostname is kept */
 } opt;
 
 extern _fsession * fsession_queue_entry_point;
@@ -0,0 +1,136 @@
+/* MODE Z (deflate) compression of the data-connection
+
+   This file is part of wput.
+
+   This programm is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License
+   as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   The wput is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+   You should have received a copy of the GNU General Public
+   License along with the wput; if not, write to the Free
+   Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307 USA.  */
+
+/* With MODE Z each transfer is a single zlib-stream which the server
+ * inflates on the fly (draft-preston-ftpext-deflate). */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "wput.h"
+#include "utils.h"
+#include "zmode.h"
+
+/* formats that are compressed already and would not get any smaller */
+#define ZMODE_SKIP "gz,tgz,bz2,tbz,xz,txz,lzma,zst,lz4,z,zip,7z,rar,jar,apk,cab,deb,rpm," \
+                   "jpg,jpeg,png,gif,webp,mp3,mp4,m4a,m4v,ogg,flac,mkv,avi,mov,webm,pdf"
+/* how much of a file is tried before deciding */
+#define ZMODE_SAMPLE (64 * 1024)
+#define ZMODE_OUT    (64 * 1024)
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+
+/* whether the extension of fname is in the comma-separated list */
+static int zmode_skipped(char * fname, char * list) {
+	char * ext = strrchr(fname, '.');
+	int len;
+
+	if(!ext || strchr(ext, dirsep)) return 0;
+	len = strlen(++ext);
+	while(*list) {
+		if(!strncasecmp(list, ext, len) && (list[len] == ',' || list[len] == 0))
+			return 1;
+		list = strchr(list, ',');
+		if(!list) break;
+		list++;
+	}
+	return 0;
+}
+
+struct _zmode {
+	z_stream z;
+	off_t    sent;
+	char     out[ZMODE_OUT];
+};
+
+int zmode_worth(char * fname, int fd) {
+	char * in;
+	char * out;
+	uLongf outlen;
+	ssize_t len;
+	int worth = 1;
+
+	/* data from a pipe can neither be judged by name nor sampled */
+	if(!fname) return 1;
+	if(zmode_skipped(fname, opt.compress_skip ? opt.compress_skip : ZMODE_SKIP)) {
+		printout(vMORE, _("Not compressing `%s' due to its type.\n"), fname);
+		return 0;
+	}
+
+	in     = malloc(ZMODE_SAMPLE);
+	outlen = compressBound(ZMODE_SAMPLE);
+	out    = malloc(outlen);
+	len    = pread(fd, in, ZMODE_SAMPLE, 0);
+	/* less than 10% saved is not worth the cpu on both ends */
+	if(len > 0 && compress2((Bytef *) out, &outlen, (Bytef *) in, len, 1) == Z_OK
+			&& outlen > len - len / 10) {
+		printout(vMORE, _("Not compressing `%s', it does not get any smaller.\n"), fname);
+		worth = 0;
+	}
+	free(in);
+	free(out);
+	return worth;
+}
+
+zmode * zmode_new(int level) {
+	zmode * Z = malloc(sizeof(zmode));
+
+	memset(&Z->z, 0, sizeof(z_stream));
+	Z->sent = 0;
+	if(deflateInit(&Z->z, level) != Z_OK) {
+		free(Z);
+		return NULL;
+	}
+	return Z;
+}
+
+int zmode_send(zmode * Z, wput_socket * sock, char * buf, int len, int finish) {
+	int res;
+	int n;
+
+	Z->z.next_in  = (Bytef *) buf;
+	Z->z.avail_in = len;
+	do {
+		Z->z.next_out  = (Bytef *) Z->out;
+		Z->z.avail_out = ZMODE_OUT;
+		res = deflate(&Z->z, finish ? Z_FINISH : Z_NO_FLUSH);
+		if(res == Z_STREAM_ERROR) return ERR_FAILED;
+		n = ZMODE_OUT - Z->z.avail_out;
+		if(n && socket_write(sock, Z->out, n) != n) return ERR_FAILED;
+		Z->sent += n;
+	} while(Z->z.avail_out == 0);
+	return 0;
+}
+
+off_t zmode_sent(zmode * Z) {
+	return Z->sent;
+}
+
+void zmode_free(zmode * Z) {
+	if(!Z) return;
+	deflateEnd(&Z->z);
+	free(Z);
+}
+#else
+int     zmode_worth(char * fname, int fd) { return 0; }
+zmode * zmode_new(int level) { return NULL; }
+int     zmode_send(zmode * Z, wput_socket * sock, char * buf, int len, int finish) { return ERR_FAILED; }
+off_t   zmode_sent(zmode * Z) { return 0; }
+void    zmode_free(zmode * Z) { }
+#endif
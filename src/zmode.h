@@ -0,0 +1,22 @@
+#ifndef __ZMODE_H
+#define __ZMODE_H
+
+#include "config.h"
+#include "socketlib.h"
+
+typedef struct _zmode zmode;
+
+/* whether a file is worth being compressed. files with a name on the skip-list
+ * are not, otherwise a sample of fd is compressed to see what it gains */
+int     zmode_worth(char * fname, int fd);
+
+/* start a deflate-stream. returns NULL if there is no zlib */
+zmode * zmode_new(int level);
+/* compress len bytes and send what comes out. finish terminates the stream.
+ * returns 0 or ERR_FAILED */
+int     zmode_send(zmode * Z, wput_socket * sock, char * buf, int len, int finish);
+/* the number of compressed bytes sent so far */
+off_t   zmode_sent(zmode * Z);
+void    zmode_free(zmode * Z);
+
+#endif